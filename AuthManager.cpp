@@ -9,17 +9,28 @@
 
 AuthManager::AuthManager() {
     // Load admin credentials from config
-    adminUser_ = Config::getInstance().getValue("admin_user", "admin");
-    std::string adminPass = Config::getInstance().getValue("admin_pass", "admin123");
-    
+    const ServerSettings& settings = Config::getInstance().settings();
+    adminUser_ = settings.admin_user;
+
     // Hash admin password
-    std::string hashedPass = hashPassword(adminPass);
+    std::string hashedPass = hashPassword(settings.admin_pass);
     
     // Store admin credentials
     credentials_[adminUser_] = hashedPass;
     userRoles_[adminUser_] = UserRole::ADMIN;
     
-    Logger::log("AuthManager initialized with admin user: " + adminUser_, LogLevel::INFO);
+    LOG_INFO("AuthManager initialized with admin user: ", adminUser_);
+
+    // Optional load-test accounts bench0..bench<N-1> used by chat_bench
+    int benchAccounts = settings.bench_accounts;
+    if (benchAccounts > 0) {
+        std::string benchPass = hashPassword(settings.bench_password);
+        for (int i = 0; i < benchAccounts; ++i) {
+            credentials_["bench" + std::to_string(i)] = benchPass;
+            userRoles_["bench" + std::to_string(i)] = UserRole::USER;
+        }
+        LOG_WARN("Registered ", benchAccounts, " load-test accounts (bench_accounts)");
+    }
 }
 
 bool AuthManager::authenticate(const std::string& username, const std::string& password) {
@@ -48,6 +59,11 @@ bool AuthManager::isAdmin(const std::string& username) const {
     return (it != userRoles_.end() && it->second == UserRole::ADMIN);
 }
 
+bool AuthManager::userExists(const std::string& username) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return credentials_.find(username) != credentials_.end();
+}
+
 void AuthManager::setUserRole(const std::string& username, UserRole role) {
     std::lock_guard<std::mutex> lock(mtx_);
     userRoles_[username] = role;
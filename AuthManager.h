@@ -20,6 +20,7 @@ public:
     bool authenticate(const std::string& username, const std::string& password);
     bool registerUser(const std::string& username, const std::string& password);
     bool isAdmin(const std::string& username) const;
+    bool userExists(const std::string& username) const;
     void setUserRole(const std::string& username, UserRole role);
     UserRole getUserRole(const std::string& username) const;
     void pushStatus(const std::string& username, const std::string& status);
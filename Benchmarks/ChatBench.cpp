@@ -0,0 +1,530 @@
+// Load generator for ChatServer. Opens N client connections on localhost,
+// logs them in as bench0..bench<N-1> (start the server with bench_accounts
+// >= N) and issues an open-loop mix of broadcasts, /msg, /history and
+// /search at a fixed total rate. Reports throughput, end-to-end delivery
+// latency and, when the server process is found, its CPU time per message.
+// With --tls 1 the clients connect to the server's tls_port instead.
+//
+//   chat_bench --clients 500 --rate 2000 --duration 30 \
+//              --mix broadcast=70,msg=20,history=5,search=5
+//
+// --handshakes SECONDS measures connection setup instead: each client
+// connects, reads the welcome line and disconnects, over and over. Over TLS
+// each reconnect resumes the previous session from its ticket unless
+// --resume 0 forces full handshakes.
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "Metrics.h"
+
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::string host = "127.0.0.1";
+    unsigned short port = 12345;
+    int clients = 100;
+    double rate = 1000;         // operations per second, all clients combined
+    int duration = 10;          // seconds of load after every client logged in
+    int threads = 0;            // 0 = hardware concurrency
+    std::string password = "bench";
+    int server_pid = 0;         // 0 = look for a process named ChatServer
+    int weights[4] = {70, 20, 5, 5};   // broadcast, msg, history, search
+    bool tls = false;
+    bool resume = true;
+    int handshakes = 0;         // seconds of connection setup test; 0 = load test
+};
+
+enum OpKind { BROADCAST, DIRECT, HISTORY, SEARCH, OP_KINDS };
+const char *kOpNames[OP_KINDS] = {"broadcast", "msg", "history", "search"};
+const char *kWords[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel"};
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct Stats {
+    std::atomic<uint64_t> sent[OP_KINDS] = {};
+    std::atomic<uint64_t> deliveries{0};
+    std::atomic<uint64_t> responses{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<int> logged_in{0};
+    Histogram delivery[2];      // broadcast, msg: send -> received by a peer
+    Histogram response[2];      // history, search: send -> reply header
+    // Connection setup test
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> resumed{0};
+    Histogram setup;            // connect -> welcome line received
+};
+
+using TlsStream = boost::asio::ssl::stream<tcp::socket&>;
+
+class Client : public std::enable_shared_from_this<Client> {
+public:
+    // tls null for plaintext
+    Client(boost::asio::io_context &io, int id, const std::string &run_id, Stats &stats,
+           boost::asio::ssl::context *tls)
+        : socket_(boost::asio::make_strand(io)), id_(id), name_("bench" + std::to_string(id)),
+          run_tag_(" #r=" + run_id), stats_(stats), tls_context_(tls) {}
+
+    ~Client() {
+        if (session_) SSL_SESSION_free(session_);
+    }
+
+    void connect(const tcp::endpoint &endpoint, const std::string &password) {
+        auto self = shared_from_this();
+        open(endpoint, [this, self, password] {
+            read_line();
+            write("/login " + name_ + " " + password);
+        });
+    }
+
+    // Connection setup test: reconnects until deadline
+    void cycle(const tcp::endpoint &endpoint, Clock::time_point deadline, bool resume) {
+        if (Clock::now() >= deadline) return;
+        auto self = shared_from_this();
+        auto started = Clock::now();
+        open(endpoint, [this, self, endpoint, deadline, resume, started] {
+            boost::asio::async_read_until(*this, in_, '\n',
+                [this, self, endpoint, deadline, resume, started](boost::system::error_code ec, std::size_t) {
+                    if (ec) {
+                        stats_.errors++;
+                    } else {
+                        stats_.setup.record(Clock::now() - started);
+                        stats_.connections++;
+                        if (tls_) {
+                            // The ticket came with or before the welcome line
+                            stats_.resumed += SSL_session_reused(tls_->native_handle());
+                            if (resume) {
+                                if (session_) SSL_SESSION_free(session_);
+                                session_ = SSL_get1_session(tls_->native_handle());
+                            }
+                        }
+                    }
+                    in_.consume(in_.size());
+                    // Reset rather than close, so the client's ports don't
+                    // pile up in TIME_WAIT. OpenSSL makes the session of a
+                    // connection dropped without close_notify unresumable,
+                    // so it is told the shutdown happened.
+                    if (tls_) SSL_set_shutdown(tls_->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+                    boost::system::error_code ignored;
+                    socket_.set_option(boost::asio::socket_base::linger(true, 0), ignored);
+                    socket_.close(ignored);
+                    tls_.reset();
+                    cycle(endpoint, deadline, resume);
+                });
+        });
+    }
+
+    // Called from the load timer; hops onto this client's strand
+    void issue(OpKind kind, int peer, uint64_t seq, const std::string &word) {
+        auto self = shared_from_this();
+        boost::asio::post(socket_.get_executor(), [this, self, kind, peer, seq, word] {
+            if (!logged_in_) return;
+            std::string stamp = " #s=" + std::to_string(id_) + ":" + std::to_string(seq) +
+                                " #t=" + std::to_string(now_ns()) + run_tag_;
+            switch (kind) {
+                case BROADCAST: write(word + stamp); break;
+                case DIRECT: write("/msg bench" + std::to_string(peer) + " " + word + stamp); break;
+                case HISTORY:
+                    pending_[0].push_back(Clock::now());
+                    write("/history");
+                    break;
+                case SEARCH:
+                    pending_[1].push_back(Clock::now());
+                    write("/search " + word);
+                    break;
+                default: break;
+            }
+            stats_.sent[kind]++;
+        });
+    }
+
+    void close() {
+        auto self = shared_from_this();
+        boost::asio::post(socket_.get_executor(), [this, self] {
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+        });
+    }
+
+    // AsyncReadStream/AsyncWriteStream over the socket or the TLS stream
+    using executor_type = tcp::socket::executor_type;
+    executor_type get_executor() { return socket_.get_executor(); }
+    template <class Buffers, class Handler>
+    void async_read_some(const Buffers &buffers, Handler &&handler) {
+        if (tls_) tls_->async_read_some(buffers, std::forward<Handler>(handler));
+        else socket_.async_read_some(buffers, std::forward<Handler>(handler));
+    }
+    template <class Buffers, class Handler>
+    void async_write_some(const Buffers &buffers, Handler &&handler) {
+        if (tls_) tls_->async_write_some(buffers, std::forward<Handler>(handler));
+        else socket_.async_write_some(buffers, std::forward<Handler>(handler));
+    }
+
+private:
+    // Connects (and handshakes, resuming session_ if there is one), then
+    // calls on_open on the strand; failures only count as errors
+    template <class Handler>
+    void open(const tcp::endpoint &endpoint, Handler on_open) {
+        auto self = shared_from_this();
+        socket_.async_connect(endpoint, [this, self, on_open](boost::system::error_code ec) {
+            if (ec) {
+                stats_.errors++;
+                return;
+            }
+            socket_.set_option(tcp::no_delay(true));
+            if (!tls_context_) {
+                on_open();
+                return;
+            }
+            tls_ = std::make_unique<TlsStream>(socket_, *tls_context_);
+            if (session_) SSL_set_session(tls_->native_handle(), session_);
+            tls_->async_handshake(boost::asio::ssl::stream_base::client,
+                [this, self, on_open](boost::system::error_code ec) {
+                    if (ec) {
+                        stats_.errors++;
+                        return;
+                    }
+                    on_open();
+                });
+        });
+    }
+
+    void write(const std::string &line) {
+        bool idle = out_.empty();
+        out_.push_back(line + "\n");
+        if (idle) do_write();
+    }
+
+    void do_write() {
+        auto self = shared_from_this();
+        boost::asio::async_write(*this, boost::asio::buffer(out_.front()),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    out_.clear();
+                    return;
+                }
+                out_.pop_front();
+                if (!out_.empty()) do_write();
+            });
+    }
+
+    void read_line() {
+        auto self = shared_from_this();
+        boost::asio::async_read_until(*this, in_, '\n',
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (ec) return;
+                std::string line(boost::asio::buffers_begin(in_.data()),
+                                 boost::asio::buffers_begin(in_.data()) + length - 1);
+                in_.consume(length);
+                on_line(line);
+                read_line();
+            });
+    }
+
+    void on_line(const std::string &line) {
+        if (!logged_in_) {
+            if (line.rfind("Login successful", 0) == 0) {
+                logged_in_ = true;
+                stats_.logged_in++;
+            }
+            return;
+        }
+        if (line.rfind("===== Recent History", 0) == 0) {
+            complete(0);
+        } else if (line.rfind("===== Search results", 0) == 0 || line.rfind("No messages found", 0) == 0) {
+            complete(1);
+        } else if (line.find(run_tag_) != std::string::npos) {
+            on_delivery(line);
+        }
+    }
+
+    void complete(int which) {
+        if (pending_[which].empty()) return;
+        stats_.response[which].record(Clock::now() - pending_[which].front());
+        pending_[which].pop_front();
+        stats_.responses++;
+    }
+
+    // Live deliveries arrive in send order per sender; anything at or below
+    // the last seen sequence is a replay from /history or /search
+    void on_delivery(const std::string &line) {
+        bool direct = line.rfind("[Private] ", 0) == 0;
+        if (!direct && line.rfind("bench", 0) != 0) return;
+        size_t s = line.find(" #s=");
+        size_t t = line.find(" #t=");
+        if (s == std::string::npos || t == std::string::npos) return;
+        int sender = std::atoi(line.c_str() + s + 4);
+        uint64_t seq = std::strtoull(line.c_str() + line.find(':', s + 4) + 1, nullptr, 10);
+        if (sender == id_) return;
+        auto it = last_seen_.find(sender);
+        if (it != last_seen_.end() && seq <= it->second) return;
+        last_seen_[sender] = seq;
+        int64_t sent = std::strtoll(line.c_str() + t + 4, nullptr, 10);
+        int64_t elapsed = now_ns() - sent;
+        stats_.delivery[direct ? 1 : 0].record(static_cast<uint64_t>(std::max<int64_t>(elapsed, 0) / 1000));
+        stats_.deliveries++;
+    }
+
+    tcp::socket socket_;
+    std::unique_ptr<TlsStream> tls_;
+    int id_;
+    std::string name_;
+    std::string run_tag_;
+    Stats &stats_;
+    boost::asio::ssl::context *tls_context_;
+    SSL_SESSION *session_ = nullptr;    // resumed by the next connection
+    bool logged_in_ = false;
+    boost::asio::streambuf in_;
+    std::deque<std::string> out_;
+    std::deque<Clock::time_point> pending_[2];
+    std::unordered_map<int, uint64_t> last_seen_;
+};
+
+bool parse_mix(const std::string &mix, int weights[4]) {
+    for (int i = 0; i < OP_KINDS; ++i) weights[i] = 0;
+    std::stringstream ss(mix);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        std::string name = item.substr(0, eq);
+        int i = 0;
+        while (i < OP_KINDS && name != kOpNames[i]) ++i;
+        if (i == OP_KINDS) return false;
+        weights[i] = std::atoi(item.c_str() + eq + 1);
+    }
+    return weights[0] + weights[1] + weights[2] + weights[3] > 0;
+}
+
+bool parse_args(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--host") opt.host = value;
+        else if (arg == "--port") opt.port = static_cast<unsigned short>(std::stoi(value));
+        else if (arg == "--clients") opt.clients = std::stoi(value);
+        else if (arg == "--rate") opt.rate = std::stod(value);
+        else if (arg == "--duration") opt.duration = std::stoi(value);
+        else if (arg == "--threads") opt.threads = std::stoi(value);
+        else if (arg == "--password") opt.password = value;
+        else if (arg == "--server-pid") opt.server_pid = std::stoi(value);
+        else if (arg == "--tls") opt.tls = std::stoi(value) != 0;
+        else if (arg == "--resume") opt.resume = std::stoi(value) != 0;
+        else if (arg == "--handshakes") opt.handshakes = std::stoi(value);
+        else if (arg == "--mix") {
+            if (!parse_mix(value, opt.weights)) return false;
+        } else return false;
+    }
+    return opt.clients > 1 && opt.rate > 0 && opt.duration > 0 && opt.handshakes >= 0;
+}
+
+int find_server_pid() {
+    int found = 0;
+    DIR *proc = opendir("/proc");
+    if (!proc) return 0;
+    while (dirent *entry = readdir(proc)) {
+        int pid = std::atoi(entry->d_name);
+        if (pid <= 0) continue;
+        std::ifstream comm("/proc/" + std::to_string(pid) + "/comm");
+        std::string name;
+        if (std::getline(comm, name) && name == "ChatServer") {
+            if (found) {    // ambiguous
+                found = 0;
+                break;
+            }
+            found = pid;
+        }
+    }
+    closedir(proc);
+    return found;
+}
+
+// User + system CPU seconds consumed by pid so far, or -1
+double process_cpu_seconds(int pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string content;
+    if (!pid || !std::getline(stat, content)) return -1;
+    // Fields after the parenthesised command name; utime and stime are 14 and 15
+    std::istringstream rest(content.substr(content.rfind(')') + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && rest >> field; ++i) {
+        if (i == 14) utime = std::stoull(field);
+        if (i == 15) stime = std::stoull(field);
+    }
+    return static_cast<double>(utime + stime) / static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+void print_latency(const char *label, const Histogram &histogram) {
+    Histogram::Snapshot snap = histogram.snapshot();
+    std::printf("  %-22s n=%-9llu p50=%8.3fms p99=%8.3fms p999=%8.3fms max=%8.3fms\n", label,
+                static_cast<unsigned long long>(snap.count),
+                snap.quantile(0.5) / 1000.0, snap.quantile(0.99) / 1000.0,
+                snap.quantile(0.999) / 1000.0, snap.max / 1000.0);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) {
+        std::cerr << "Usage: chat_bench [--host 127.0.0.1] [--port 12345] [--clients 100] [--rate 1000]\n"
+                     "                  [--duration 10] [--threads N] [--password bench] [--server-pid PID]\n"
+                     "                  [--mix broadcast=70,msg=20,history=5,search=5]\n"
+                     "                  [--tls 0|1] [--handshakes SECONDS] [--resume 0|1]\n";
+        return 1;
+    }
+
+    boost::asio::io_context io;
+    auto work = boost::asio::make_work_guard(io);
+    unsigned threads = opt.threads > 0 ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < threads; ++i) {
+        pool.emplace_back([&io] { io.run(); });
+    }
+
+    // The server's certificate is typically self-signed; it isn't verified
+    std::unique_ptr<boost::asio::ssl::context> tls;
+    if (opt.tls) {
+        tls = std::make_unique<boost::asio::ssl::context>(boost::asio::ssl::context::tls_client);
+        tls->set_verify_mode(boost::asio::ssl::verify_none);
+    }
+
+    Stats stats;
+    std::string run_id = std::to_string(now_ns() % 1000000007);
+    tcp::endpoint endpoint(boost::asio::ip::make_address(opt.host), opt.port);
+    std::vector<std::shared_ptr<Client>> clients;
+
+    if (opt.handshakes > 0) {
+        int pid = opt.server_pid ? opt.server_pid : find_server_pid();
+        double cpu_before = process_cpu_seconds(pid);
+        auto start = Clock::now();
+        auto deadline = start + std::chrono::seconds(opt.handshakes);
+        for (int i = 0; i < opt.clients; ++i) {
+            clients.push_back(std::make_shared<Client>(io, i, run_id, stats, tls.get()));
+            clients.back()->cycle(endpoint, deadline, opt.resume);
+        }
+        std::this_thread::sleep_until(deadline + std::chrono::milliseconds(500));
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double cpu_after = process_cpu_seconds(pid);
+        uint64_t connections = stats.connections.load();
+        std::printf("chat_bench: %d clients reconnecting over %s for %ds\n", opt.clients,
+                    !opt.tls ? "plaintext" : opt.resume ? "TLS with resumption" : "TLS, full handshakes",
+                    opt.handshakes);
+        std::printf("  connections %llu (%.0f/s), %llu resumed, %llu errors\n",
+                    static_cast<unsigned long long>(connections), connections / seconds,
+                    static_cast<unsigned long long>(stats.resumed.load()),
+                    static_cast<unsigned long long>(stats.errors.load()));
+        print_latency("connect -> welcome", stats.setup);
+        if (cpu_before >= 0 && cpu_after >= 0 && connections > 0) {
+            std::printf("server cpu    %.2fs (pid %d): %.1fus per connection\n", cpu_after - cpu_before, pid,
+                        (cpu_after - cpu_before) * 1e6 / connections);
+        }
+        work.reset();
+        io.stop();
+        for (auto &t : pool) t.join();
+        return 0;
+    }
+
+    for (int i = 0; i < opt.clients; ++i) {
+        clients.push_back(std::make_shared<Client>(io, i, run_id, stats, tls.get()));
+        clients.back()->connect(endpoint, opt.password);
+        if (i % 100 == 99) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    auto login_deadline = Clock::now() + std::chrono::seconds(30);
+    while (stats.logged_in < opt.clients && Clock::now() < login_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    std::printf("%d/%d clients logged in\n", stats.logged_in.load(), opt.clients);
+    if (stats.logged_in < opt.clients) {
+        std::cerr << "Not all clients could log in; is the server running with bench_accounts >= "
+                  << opt.clients << "?\n";
+        return 1;
+    }
+
+    int pid = opt.server_pid ? opt.server_pid : find_server_pid();
+    double cpu_before = process_cpu_seconds(pid);
+
+    // Open loop: operations are issued on schedule whether or not earlier
+    // ones have completed, so server stalls show up as latency
+    std::mt19937 rng(12345);
+    std::discrete_distribution<int> pick_kind(std::begin(opt.weights), std::end(opt.weights));
+    std::uniform_int_distribution<int> pick_client(0, opt.clients - 1);
+    std::uniform_int_distribution<int> pick_word(0, sizeof(kWords) / sizeof(kWords[0]) - 1);
+    std::vector<uint64_t> seq(opt.clients, 0);
+
+    auto start = Clock::now();
+    auto end = start + std::chrono::seconds(opt.duration);
+    uint64_t issued = 0;
+    for (auto now = start; now < end; now = Clock::now()) {
+        double elapsed = std::chrono::duration<double>(now - start).count();
+        uint64_t due = static_cast<uint64_t>(elapsed * opt.rate);
+        for (; issued < due; ++issued) {
+            int from = pick_client(rng);
+            int peer = pick_client(rng);
+            if (peer == from) peer = (peer + 1) % opt.clients;
+            clients[from]->issue(static_cast<OpKind>(pick_kind(rng)), peer, ++seq[from],
+                                 kWords[pick_word(rng)]);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    double load_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Let in-flight deliveries land before reading the counters
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    double cpu_after = process_cpu_seconds(pid);
+
+    uint64_t sent = 0;
+    for (auto &count : stats.sent) sent += count;
+    std::printf("\nchat_bench: %d clients, %.0f ops/s target, %.1fs\n", opt.clients, opt.rate, load_seconds);
+    std::printf("  sent        %llu ops (%.0f/s):", static_cast<unsigned long long>(sent), sent / load_seconds);
+    for (int i = 0; i < OP_KINDS; ++i) {
+        std::printf(" %s=%llu", kOpNames[i], static_cast<unsigned long long>(stats.sent[i].load()));
+    }
+    std::printf("\n  delivered   %llu lines (%.0f/s), %llu replies, %llu connect errors\n",
+                static_cast<unsigned long long>(stats.deliveries.load()), stats.deliveries / load_seconds,
+                static_cast<unsigned long long>(stats.responses.load()),
+                static_cast<unsigned long long>(stats.errors.load()));
+    std::printf("latency (send -> received)\n");
+    print_latency("broadcast delivery", stats.delivery[0]);
+    print_latency("msg delivery", stats.delivery[1]);
+    print_latency("history reply", stats.response[0]);
+    print_latency("search reply", stats.response[1]);
+    if (cpu_before >= 0 && cpu_after >= 0 && sent > 0) {
+        double cpu = cpu_after - cpu_before;
+        std::printf("server cpu    %.2fs (pid %d): %.1fus per op, %.2fus per delivered line\n", cpu, pid,
+                    cpu * 1e6 / sent, stats.deliveries ? cpu * 1e6 / stats.deliveries : 0.0);
+    } else {
+        std::printf("server cpu    n/a (pass --server-pid)\n");
+    }
+
+    for (auto &client : clients) client->close();
+    work.reset();
+    io.stop();
+    for (auto &t : pool) t.join();
+    return 0;
+}
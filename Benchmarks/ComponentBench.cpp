@@ -0,0 +1,143 @@
+// Server components in isolation: command dispatch, broadcast fan-out, DB
+// batch inserts, logging, the flight recorder and password hashing. Sessions
+// are mocks whose deliver() only counts bytes, so no sockets are connected.
+#include <benchmark/benchmark.h>
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AuthManager.h"
+#include "CommandRouter.h"
+#include "Database.h"
+#include "FlightRecorder.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Session.h"
+#include "SessionManager.h"
+
+namespace {
+
+boost::asio::io_context &bench_io() {
+    static boost::asio::io_context io;
+    return io;
+}
+
+class MockSession : public Session {
+public:
+    MockSession() : Session(boost::asio::ip::tcp::socket(bench_io())) {}
+    void deliver(const std::string &msg, Priority) override { bytes_ += msg.size(); }
+    void deliver(const MessagePtr &message, Priority) override { bytes_ += message->wire_line().size(); }
+    size_t bytes() const { return bytes_; }
+
+private:
+    size_t bytes_ = 0;
+};
+
+// Parsing, lookup and dispatch of one command line
+void BM_CommandDispatch(benchmark::State &state, const char *line) {
+    auto session = std::make_shared<MockSession>();
+    session->set_username("bench_user");
+    session->set_authenticated(true);
+    CommandRouter router(*session);
+    std::string cmd = line;
+    for (auto _ : state) {
+        router.handle_command(cmd);
+    }
+    benchmark::DoNotOptimize(session->bytes());
+}
+BENCHMARK_CAPTURE(BM_CommandDispatch, unknown, "/nosuchcommand with some args");
+BENCHMARK_CAPTURE(BM_CommandDispatch, denied, "/list");
+BENCHMARK_CAPTURE(BM_CommandDispatch, history, "/history");
+
+void BM_Broadcast(benchmark::State &state) {
+    std::vector<std::shared_ptr<Session>> sessions;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        sessions.push_back(std::make_shared<MockSession>());
+        SessionManager::getInstance().add_session(sessions.back());
+    }
+    for (auto _ : state) {
+        MessagePtr message = Message::create("bench_user", {}, "a typical chat line of moderate length");
+        SessionManager::getInstance().broadcast(message, sessions.front().get());
+    }
+    state.SetItemsProcessed(state.iterations() * (state.range(0) - 1));
+    for (auto &session : sessions) {
+        SessionManager::getInstance().remove_session(session);
+    }
+}
+BENCHMARK(BM_Broadcast)->Arg(10)->Arg(100)->Arg(1000);
+
+// Messages per second through log_message() and the aggregator's batched
+// insert, measured until the batch is committed
+void BM_DatabaseBatchInsert(benchmark::State &state) {
+    Database &db = Database::getInstance();
+    Counter &persisted = Metrics::getInstance().counter(
+        "chat_db_messages_persisted_total", "Messages written to the database");
+    const int64_t batch = state.range(0);
+    for (auto _ : state) {
+        uint64_t target = persisted.value() + static_cast<uint64_t>(batch);
+        for (int64_t i = 0; i < batch; ++i) {
+            db.log_message(Message::create("bench_user", {}, "benchmark message number " + std::to_string(i)));
+        }
+        while (persisted.value() < target) {
+            std::this_thread::yield();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_DatabaseBatchInsert)->Arg(100)->Arg(1000)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+void BM_LogDisabled(benchmark::State &state) {
+    Logger::setLogLevel(LogLevel::INFO);
+    std::string user = "bench_user";
+    int i = 0;
+    for (auto _ : state) {
+        LOG_DEBUG("User ", user, " status updated to ", ++i);
+    }
+}
+BENCHMARK(BM_LogDisabled);
+
+// The pre-macro style: the message is built before the level check
+void BM_LogDisabledConcat(benchmark::State &state) {
+    Logger::setLogLevel(LogLevel::INFO);
+    std::string user = "bench_user";
+    int i = 0;
+    for (auto _ : state) {
+        Logger::log("User " + user + " status updated to " + std::to_string(++i), LogLevel::DEBUG);
+    }
+}
+BENCHMARK(BM_LogDisabledConcat);
+
+// Producer cost only; once the queue is full excess lines are dropped
+void BM_LogEnabled(benchmark::State &state) {
+    Logger::setLogLevel(LogLevel::INFO);
+    std::string user = "bench_user";
+    int i = 0;
+    for (auto _ : state) {
+        LOG_INFO("User ", user, " status updated to ", ++i);
+    }
+    Logger::flush();
+}
+BENCHMARK(BM_LogEnabled)->Threads(1)->Threads(4);
+
+// Cost of one always-on flight recorder event
+void BM_FlightRecord(benchmark::State &state) {
+    std::string command = "history";
+    uint64_t i = 0;
+    for (auto _ : state) {
+        FlightRecorder::record(FlightEvent::Command, 42, ++i, command);
+    }
+}
+BENCHMARK(BM_FlightRecord)->Threads(1)->Threads(4);
+
+void BM_AuthenticatePassword(benchmark::State &state) {
+    AuthManager &auth = AuthManager::getInstance();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(auth.authenticate("admin", "admin123"));
+    }
+}
+BENCHMARK(BM_AuthenticatePassword);
+
+} // namespace
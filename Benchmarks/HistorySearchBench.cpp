@@ -0,0 +1,133 @@
+// Compares ChatHistoryCache against the original implementation (vector with
+// erase-from-front on add, linear std::string::find under a mutex).
+#include <benchmark/benchmark.h>
+
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ChatHistoryCache.h"
+
+namespace {
+
+class LegacyHistoryCache {
+public:
+    explicit LegacyHistoryCache(size_t max_messages) : max_messages_(max_messages) {}
+
+    void add_message(const std::string &message) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (messages_.size() >= max_messages_) {
+            messages_.erase(messages_.begin());
+        }
+        messages_.push_back(message);
+    }
+
+    std::vector<std::string> search(const std::string &keyword) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<std::string> results;
+        for (auto &msg : messages_) {
+            if (msg.find(keyword) != std::string::npos) {
+                results.push_back(msg);
+            }
+        }
+        return results;
+    }
+
+private:
+    std::vector<std::string> messages_;
+    std::mutex mtx_;
+    size_t max_messages_;
+};
+
+// Chat-like lines: "userN: w w w ..." drawn from a small vocabulary, with a
+// rare word sprinkled in so searches have a few hits
+std::vector<std::string> make_lines(size_t count) {
+    static const char *vocab[] = {"hello", "there", "anyone", "around", "deploy", "build",
+                                  "failed", "again", "lunch", "today", "meeting", "notes",
+                                  "server", "latency", "looks", "fine", "ship", "it"};
+    std::mt19937 rng(42);
+    std::vector<std::string> lines;
+    lines.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        std::string line = "user" + std::to_string(rng() % 100) + ": ";
+        int words = 4 + rng() % 12;
+        for (int w = 0; w < words; ++w) {
+            line += vocab[rng() % (sizeof(vocab) / sizeof(vocab[0]))];
+            line += ' ';
+        }
+        if (rng() % 500 == 0) {
+            line += "kubernetes";
+        }
+        lines.push_back(std::move(line));
+    }
+    return lines;
+}
+
+const std::vector<std::string> &lines() {
+    static const std::vector<std::string> all = make_lines(100000);
+    return all;
+}
+
+template <typename Cache>
+void fill(Cache &cache, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        cache.add_message(lines()[i % lines().size()]);
+    }
+}
+
+void BM_LegacyAdd(benchmark::State &state) {
+    size_t capacity = static_cast<size_t>(state.range(0));
+    LegacyHistoryCache cache(capacity);
+    fill(cache, capacity);
+    size_t i = 0;
+    for (auto _ : state) {
+        cache.add_message(lines()[i++ % lines().size()]);
+    }
+}
+
+void BM_RingAdd(benchmark::State &state) {
+    size_t capacity = static_cast<size_t>(state.range(0));
+    ChatHistoryCache cache(capacity, 256);
+    fill(cache, capacity);
+    size_t i = 0;
+    for (auto _ : state) {
+        cache.add_message(lines()[i++ % lines().size()]);
+    }
+}
+
+void BM_LegacySearch(benchmark::State &state) {
+    size_t capacity = static_cast<size_t>(state.range(0));
+    LegacyHistoryCache cache(capacity);
+    fill(cache, capacity);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache.search("kubernetes"));
+    }
+}
+
+void BM_RingSubstringSearch(benchmark::State &state) {
+    size_t capacity = static_cast<size_t>(state.range(0));
+    ChatHistoryCache cache(capacity, 256);
+    fill(cache, capacity);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache.search("kubernetes"));
+    }
+}
+
+void BM_RingWordSearch(benchmark::State &state) {
+    size_t capacity = static_cast<size_t>(state.range(0));
+    ChatHistoryCache cache(capacity, 256);
+    fill(cache, capacity);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache.search_words("kubernetes"));
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_LegacyAdd)->Arg(50)->Arg(1000)->Arg(20000);
+BENCHMARK(BM_RingAdd)->Arg(50)->Arg(1000)->Arg(20000);
+BENCHMARK(BM_LegacySearch)->Arg(50)->Arg(1000)->Arg(20000);
+BENCHMARK(BM_RingSubstringSearch)->Arg(50)->Arg(1000)->Arg(20000);
+BENCHMARK(BM_RingWordSearch)->Arg(50)->Arg(1000)->Arg(20000);
+
@@ -0,0 +1,58 @@
+// Entry point for chat_microbench. Runs in a scratch directory so chat.db and
+// server.log never touch the working tree, and writes JSON results to
+// chat_microbench.json in the starting directory unless --benchmark_out is
+// given (console output stays human readable).
+#include <benchmark/benchmark.h>
+
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "Logger.h"
+
+// Defined in main.cpp for the server; commands that stop the server use them
+boost::asio::io_context* g_io_context_ptr = nullptr;
+void request_shutdown(const std::string &) {}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args(argv, argv + argc);
+    bool has_out = false;
+    for (auto &arg : args) {
+        has_out = has_out || arg.rfind("--benchmark_out=", 0) == 0;
+    }
+    if (!has_out) {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd))) {
+            args.push_back(std::string("--benchmark_out=") + cwd + "/chat_microbench.json");
+            args.push_back("--benchmark_out_format=json");
+        }
+    }
+
+    char scratch[] = "/tmp/chat_microbench.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        std::cerr << "Failed to create a scratch directory\n";
+        return 1;
+    }
+    Logger::setConsoleOutput(false);
+
+    std::vector<char *> raw;
+    for (auto &arg : args) {
+        raw.push_back(&arg[0]);
+    }
+    int raw_argc = static_cast<int>(raw.size());
+    benchmark::Initialize(&raw_argc, raw.data());
+    if (benchmark::ReportUnrecognizedArguments(raw_argc, raw.data())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    Logger::shutdown();
+    std::error_code ec;
+    std::filesystem::remove_all(scratch, ec);
+    return 0;
+}
@@ -1,33 +1,216 @@
 #include "ChatHistoryCache.h"
+#include "SimdSearch.h"
 #include <algorithm>
+#include <cstring>
+#include <iterator>
 
-ChatHistoryCache& ChatHistoryCache::instance() {
-    static ChatHistoryCache instance;
-    return instance;
+ChatHistoryCache::ChatHistoryCache(size_t capacity, size_t line_bytes)
+    : capacity_(capacity),
+      line_bytes_(line_bytes),
+      slots_(new Slot[capacity]),
+      data_(new char[capacity * line_bytes]),
+      index_(capacity) {}
+
+size_t ChatHistoryCache::memory_bytes() const {
+    return sizeof(*this) + capacity_ * (sizeof(Slot) + line_bytes_) + index_.memory_bytes();
+}
+
+void ChatHistoryCache::add_message(std::string_view message, uint64_t seq) {
+    std::lock_guard<std::mutex> lock(write_mtx_);
+    uint64_t n = head_.load(std::memory_order_relaxed);
+    // Lines usually arrive in seq order, so only an older seq needs the scan
+    // (workers relay theirs with a delay)
+    if (seq != 0 && seq <= max_seq_ && holds_seq(seq, n)) {
+        return;
+    }
+    max_seq_ = std::max(max_seq_, seq);
+    size_t index = n % capacity_;
+    Slot &slot = slots_[index];
+
+    // Mark the slot busy before touching its bytes
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    size_t length = std::min(message.size(), line_bytes_);
+    std::memcpy(&data_[index * line_bytes_], message.data(), length);
+    slot.length.store(static_cast<uint32_t>(length), std::memory_order_relaxed);
+    slot.message_seq.store(seq, std::memory_order_relaxed);
+
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+    head_.store(n + 1, std::memory_order_release);
+
+    index_.add(n, message.data(), length, oldest_live(n + 1));
+}
+
+bool ChatHistoryCache::holds_seq(uint64_t seq, uint64_t head) const {
+    for (uint64_t n = head; n-- > oldest_live(head);) {
+        if (slots_[n % capacity_].message_seq.load(std::memory_order_relaxed) == seq) {
+            return true;
+        }
+    }
+    return false;
 }
 
-ChatHistoryCache::ChatHistoryCache() : max_messages_(50) {}
+bool ChatHistoryCache::read_slot(uint64_t n, std::string &out, uint64_t *message_seq) const {
+    size_t index = n % capacity_;
+    const Slot &slot = slots_[index];
+
+    uint64_t expected = 2 * n + 2;
+    if (slot.seq.load(std::memory_order_acquire) != expected) {
+        return false;
+    }
+    uint32_t length = std::min<uint32_t>(slot.length.load(std::memory_order_relaxed),
+                                         static_cast<uint32_t>(line_bytes_));
+    out.assign(&data_[index * line_bytes_], length);
+    if (message_seq) {
+        *message_seq = slot.message_seq.load(std::memory_order_relaxed);
+    }
+
+    // If the writer lapped us while copying, the copy may be torn
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == expected;
+}
+
+std::vector<std::string> ChatHistoryCache::get_recent_messages(size_t count, std::vector<uint64_t> *seqs) const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t available = std::min<uint64_t>(head, capacity_);
+    uint64_t first = head - std::min<uint64_t>(count, available);
+
+    std::vector<std::string> result;
+    result.reserve(static_cast<size_t>(head - first));
+    std::string line;
+    uint64_t seq;
+    for (uint64_t n = first; n < head; ++n) {
+        if (read_slot(n, line, &seq)) {
+            result.push_back(line);
+            if (seqs) seqs->push_back(seq);
+        }
+    }
+    return result;
+}
+
+bool ChatHistoryCache::messages_since(uint64_t after, std::vector<std::pair<uint64_t, std::string>> &out) const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    std::vector<std::pair<uint64_t, std::string>> found;
+    bool covered = false;
+    std::string line;
+    uint64_t seq;
+    for (uint64_t n = oldest_live(head); n < head; ++n) {
+        if (!read_slot(n, line, &seq)) {
+            // Overwritten while we read, so whatever preceded it is gone
+            found.clear();
+            covered = false;
+            continue;
+        }
+        if (seq == 0) {
+            continue;
+        }
+        if (seq <= after) {
+            covered = true;
+        } else if (line.size() == line_bytes_) {
+            return false;   // possibly truncated; the DB has the full line
+        } else {
+            found.emplace_back(seq, line);
+        }
+    }
+    if (!covered) {
+        return false;
+    }
+    std::move(found.begin(), found.end(), std::back_inserter(out));
+    return true;
+}
 
-void ChatHistoryCache::add_message(const std::string &message) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    if (messages_.size() >= max_messages_) {
-        messages_.erase(messages_.begin());
+bool ChatHistoryCache::slot_contains(uint64_t n, size_t index, const std::string &keyword) const {
+    const Slot &slot = slots_[index];
+    if (slot.seq.load(std::memory_order_acquire) != 2 * n + 2) {
+        return false;
     }
-    messages_.push_back(message);
+    size_t length = std::min<size_t>(slot.length.load(std::memory_order_relaxed), line_bytes_);
+    return simd_find(&data_[index * line_bytes_], length, keyword.data(), keyword.size()) != std::string::npos;
 }
 
-std::vector<std::string> ChatHistoryCache::get_recent_messages() {
-    std::lock_guard<std::mutex> lock(mtx_);
-    return messages_;
+std::vector<std::string> ChatHistoryCache::search(const std::string &keyword, std::vector<uint64_t> *seqs) const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = oldest_live(head);
+
+    std::vector<std::string> results;
+    std::string line;
+    uint64_t message_seq = 0;
+    size_t index = static_cast<size_t>(first % capacity_);
+    for (uint64_t n = first; n < head; ++n) {
+        if (slot_contains(n, index, keyword) && read_slot(n, line, &message_seq) &&
+            simd_find(line.data(), line.size(), keyword.data(), keyword.size()) != std::string::npos) {
+            results.push_back(line);
+            if (seqs) seqs->push_back(message_seq);
+        }
+        if (++index == capacity_) {
+            index = 0;
+        }
+    }
+    return results;
 }
 
-std::vector<std::string> ChatHistoryCache::search(const std::string &keyword) {
-    std::lock_guard<std::mutex> lock(mtx_);
+std::vector<std::string> ChatHistoryCache::search_words(const std::string &query, std::vector<uint64_t> *seqs) const {
+    std::vector<uint64_t> terms;
+    TokenIndex::tokenize(query.data(), query.size(), terms);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    if (terms.empty()) {
+        return {};
+    }
+
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t oldest = oldest_live(head);
+
+    // Intersect posting lists; if any list may be incomplete, check every
+    // cached line instead
+    std::vector<uint64_t> candidates, hits, merged;
+    bool scan = false;
+    for (size_t i = 0; i < terms.size(); ++i) {
+        hits.clear();
+        TokenIndex::Result result = index_.lookup(terms[i], oldest, hits);
+        if (result == TokenIndex::Result::Unknown) {
+            scan = true;
+            break;
+        }
+        if (result == TokenIndex::Result::Absent) {
+            return {};
+        }
+        if (i == 0) {
+            candidates.swap(hits);
+        } else {
+            merged.clear();
+            std::set_intersection(candidates.begin(), candidates.end(), hits.begin(), hits.end(),
+                                  std::back_inserter(merged));
+            candidates.swap(merged);
+        }
+        if (candidates.empty()) {
+            return {};
+        }
+    }
+    if (scan) {
+        candidates.clear();
+        for (uint64_t n = oldest; n < head; ++n) {
+            candidates.push_back(n);
+        }
+    }
+
+    // Confirm every term against the text (hash collisions, overwrites)
     std::vector<std::string> results;
-    for (auto &msg : messages_) {
-        if (msg.find(keyword) != std::string::npos) {
-            results.push_back(msg);
+    std::vector<uint64_t> line_terms;
+    std::string line;
+    uint64_t message_seq = 0;
+    for (uint64_t n : candidates) {
+        if (n >= head || !read_slot(n, line, &message_seq)) {
+            continue;
+        }
+        line_terms.clear();
+        TokenIndex::tokenize(line.data(), line.size(), line_terms);
+        std::sort(line_terms.begin(), line_terms.end());
+        if (std::includes(line_terms.begin(), line_terms.end(), terms.begin(), terms.end())) {
+            results.push_back(line);
+            if (seqs) seqs->push_back(message_seq);
         }
     }
     return results;
-} 
\ No newline at end of file
+}
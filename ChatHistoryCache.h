@@ -1,29 +1,80 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <deque>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include "TokenIndex.h"
 
+// Fixed-capacity ring of recent chat lines for one conversation (see
+// HistoryManager, which owns one per conversation).
+//
+// Writers are serialized by write_mtx_ (in practice there is one writer, the
+// io thread). Readers never lock: each slot carries a sequence number that is
+// odd while the slot is being written and 2*n+2 once it holds message n, so a
+// reader copies the slot and keeps the copy only if the sequence is unchanged.
+// Lines longer than line_bytes are truncated in the cache (the DB keeps the
+// full text). Each slot also records the line's message seq (see
+// Database::next_sequence), so /sync can be answered from the cache.
+//
+// search() is a SIMD substring scan; search_words() answers word queries from
+// an inverted index maintained by add_message. Neither blocks the writer.
 class ChatHistoryCache {
 public:
-    static ChatHistoryCache& getInstance() {
-        static ChatHistoryCache instance;
-        return instance;
-    }
+    ChatHistoryCache(size_t capacity, size_t line_bytes);
+    ~ChatHistoryCache() = default;
 
-    void add_message(const std::string& message);
-    std::vector<std::string> get_recent_messages(size_t count = 10);
-    std::vector<std::string> search(const std::string& keyword);
+    // seq 0: a line with no seq, e.g. from a federated peer. A seq the cache
+    // already holds is ignored: a refill from Database may have loaded the
+    // line before its own add_message call.
+    void add_message(std::string_view message, uint64_t seq = 0);
+    // With seqs, each line's seq is appended to it alongside
+    std::vector<std::string> get_recent_messages(size_t count = SIZE_MAX,
+                                                 std::vector<uint64_t>* seqs = nullptr) const;
+    // Appends (seq, line) for every cached line with seq greater than after,
+    // in arrival order. False, with out unchanged, if the cache can't tell
+    // that it holds all of them: nothing at or before after is cached any
+    // more, or a matching line was truncated.
+    bool messages_since(uint64_t after, std::vector<std::pair<uint64_t, std::string>>& out) const;
+    // With seqs, each hit's seq is appended to it alongside
+    std::vector<std::string> search(const std::string& keyword, std::vector<uint64_t>* seqs = nullptr) const;
+    std::vector<std::string> search_words(const std::string& query, std::vector<uint64_t>* seqs = nullptr) const;
 
-private:
-    ChatHistoryCache() = default;
-    ~ChatHistoryCache() = default;
+    size_t capacity() const { return capacity_; }
+    // Bytes allocated for this cache, fixed at construction
+    size_t memory_bytes() const;
 
+private:
     ChatHistoryCache(const ChatHistoryCache&) = delete;
     ChatHistoryCache& operator=(const ChatHistoryCache&) = delete;
 
-    std::deque<std::string> messages;
-    std::mutex cacheMutex;
-    static const size_t MAX_CACHE_SIZE = 1000;
-}; 
\ No newline at end of file
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint32_t> length{0};
+        std::atomic<uint64_t> message_seq{0};
+    };
+
+    // Copies message n into out (and its seq into message_seq); false if it
+    // has been overwritten
+    bool read_slot(uint64_t n, std::string& out, uint64_t* message_seq = nullptr) const;
+    // Substring test directly on the slot bytes; may be torn, so callers
+    // confirm hits with read_slot
+    bool slot_contains(uint64_t n, size_t index, const std::string& keyword) const;
+    uint64_t oldest_live(uint64_t head) const { return head - std::min<uint64_t>(head, capacity_); }
+    // Caller holds write_mtx_
+    bool holds_seq(uint64_t seq, uint64_t head) const;
+
+    const size_t capacity_;
+    const size_t line_bytes_;
+    std::unique_ptr<Slot[]> slots_;
+    std::unique_ptr<char[]> data_;      // capacity_ * line_bytes_
+    std::atomic<uint64_t> head_{0};     // number of messages ever added
+    uint64_t max_seq_ = 0;              // highest seq added, under write_mtx_
+    std::mutex write_mtx_;
+    TokenIndex index_;                  // written under write_mtx_
+};
@@ -0,0 +1,608 @@
+#include "Cluster.h"
+#include "Database.h"
+#include "HistoryManager.h"
+#include "Logger.h"
+#include "Session.h"
+#include "SessionManager.h"
+#include "UserManager.h"
+#include <algorithm>
+#include <cstdlib>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace {
+
+// A link whose peer stops reading is dropped rather than buffering forever;
+// the reconnect replays the directory
+constexpr size_t kMaxPendingBytes = 8 << 20;
+constexpr size_t kMaxFrameBytes = 64 * 1024;
+constexpr int kMaxBackoffMs = 8000;
+
+// Frames are single lines; chat lines never contain newlines, but peers
+// must not be able to split a frame by sending one
+std::string one_line(std::string text) {
+    std::replace(text.begin(), text.end(), '\n', ' ');
+    std::replace(text.begin(), text.end(), '\r', ' ');
+    return text;
+}
+
+// Splits off the next tab-separated field
+std::string next_field(const std::string& frame, size_t& pos) {
+    size_t tab = frame.find('\t', pos);
+    std::string field = frame.substr(pos, tab == std::string::npos ? std::string::npos : tab - pos);
+    pos = tab == std::string::npos ? frame.size() : tab + 1;
+    return field;
+}
+
+} // namespace
+
+// ---------------------- Outgoing link to one peer ----------------------
+
+class Cluster::Link {
+public:
+    Link(Cluster& cluster, boost::asio::io_context& io_context, const ClusterPeer& peer)
+        : cluster_(cluster), peer_(peer), socket_(io_context), resolver_(io_context), retry_timer_(io_context) {}
+
+    const std::string& node() const { return peer_.node; }
+    bool connected() const { return connected_; }
+
+    void connect() {
+        resolver_.async_resolve(peer_.host, std::to_string(peer_.port),
+            [this](const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::results_type results) {
+                if (ec == boost::asio::error::operation_aborted || stopped_) return;
+                if (ec) {
+                    fail(ec);
+                    return;
+                }
+                boost::asio::async_connect(socket_, results,
+                    [this](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint&) {
+                        if (ec == boost::asio::error::operation_aborted || stopped_) return;
+                        if (ec) {
+                            fail(ec);
+                            return;
+                        }
+                        boost::system::error_code ignored;
+                        socket_.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+                        socket_.set_option(boost::asio::socket_base::keep_alive(true), ignored);
+                        connected_ = true;
+                        backoff_ms_ = 250;
+                        cluster_.peers_connected_.add(1);
+                        LOG_INFO("Cluster link to ", peer_.node, " (", peer_.host, ":", peer_.port, ") up");
+                        watch();
+
+                        // Introduce ourselves and replay our part of the directory
+                        send("HELLO\t" + cluster_.node_id_ + "\t" + cluster_.secret_);
+                        for (auto& user : UserManager::getInstance().get_all_users()) {
+                            send("JOIN\t" + user);
+                        }
+                        cluster_.link_up(peer_.node);
+                    });
+            });
+    }
+
+    // Queues a frame; false if the link is down
+    bool send(const std::string& frame) {
+        if (!connected_) return false;
+        pending_ += frame;
+        pending_ += '\n';
+        cluster_.frames_sent_.inc();
+        if (pending_.size() > kMaxPendingBytes) {
+            LOG_WARN("Cluster peer ", peer_.node, " is not keeping up, dropping the link");
+            fail(boost::asio::error::no_buffer_space);
+            return false;
+        }
+        if (!writing_ && !flush_posted_) {
+            // Deferred to the end of the current handler, so every frame it
+            // produces (a read can hold many lines) shares one write
+            flush_posted_ = true;
+            boost::asio::post(socket_.get_executor(), [this] {
+                flush_posted_ = false;
+                if (connected_ && !writing_ && !pending_.empty()) {
+                    flush();
+                }
+            });
+        }
+        return true;
+    }
+
+    void close() {
+        stopped_ = true;
+        boost::system::error_code ignored;
+        retry_timer_.cancel(ignored);
+        resolver_.cancel();
+        socket_.close(ignored);
+        if (connected_) {
+            connected_ = false;
+            cluster_.peers_connected_.add(-1);
+        }
+    }
+
+private:
+    // Peers never write on this link, so a completed read means it closed.
+    // Without this a crashed peer would only be noticed on the second write
+    // after it died, and the frames in between would be lost.
+    void watch() {
+        socket_.async_read_some(boost::asio::buffer(probe_),
+            [this](const boost::system::error_code& ec, std::size_t /*length*/) {
+                if (ec == boost::asio::error::operation_aborted || stopped_ || !connected_) return;
+                fail(ec ? ec : boost::asio::error::make_error_code(boost::asio::error::eof));
+            });
+    }
+
+    // Everything queued since the last write goes out as one batch
+    void flush() {
+        writing_ = true;
+        inflight_.swap(pending_);
+        pending_.clear();
+        cluster_.writes_.inc();
+        boost::asio::async_write(socket_, boost::asio::buffer(inflight_),
+            [this](const boost::system::error_code& ec, std::size_t /*length*/) {
+                if (ec == boost::asio::error::operation_aborted || stopped_) return;
+                writing_ = false;
+                inflight_.clear();
+                if (ec) {
+                    fail(ec);
+                } else if (!pending_.empty()) {
+                    flush();
+                }
+            });
+    }
+
+    void fail(const boost::system::error_code& ec) {
+        if (connected_) {
+            LOG_WARN("Cluster link to ", peer_.node, " lost: ", ec.message());
+            connected_ = false;
+            cluster_.peers_connected_.add(-1);
+        } else {
+            LOG_DEBUG("Cluster peer ", peer_.node, " unreachable: ", ec.message());
+        }
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        pending_.clear();
+        writing_ = false;
+
+        retry_timer_.expires_after(std::chrono::milliseconds(backoff_ms_));
+        backoff_ms_ = std::min(backoff_ms_ * 2, kMaxBackoffMs);
+        retry_timer_.async_wait([this](const boost::system::error_code& ec) {
+            if (!ec && !stopped_) {
+                connect();
+            }
+        });
+    }
+
+    Cluster& cluster_;
+    ClusterPeer peer_;
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::ip::tcp::resolver resolver_;
+    boost::asio::steady_timer retry_timer_;
+    int backoff_ms_ = 250;
+    bool connected_ = false;
+    bool stopped_ = false;
+    bool writing_ = false;
+    bool flush_posted_ = false;
+    std::string pending_;   // frames queued since the last write
+    std::string inflight_;  // the batch being written
+    char probe_[64];
+};
+
+// ---------------------- Incoming link from one peer ----------------------
+
+class Cluster::InboundLink : public std::enable_shared_from_this<InboundLink> {
+public:
+    InboundLink(Cluster& cluster, boost::asio::ip::tcp::socket socket)
+        : cluster_(cluster), socket_(std::move(socket)), buffer_(kMaxFrameBytes) {}
+
+    void start() { read(); }
+
+    void close() {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+
+private:
+    void read() {
+        auto self(shared_from_this());
+        boost::asio::async_read_until(socket_, buffer_, '\n',
+            [this, self](const boost::system::error_code& ec, std::size_t length) {
+                if (ec) {
+                    if (ec != boost::asio::error::operation_aborted && !node_.empty()) {
+                        cluster_.peer_lost(node_, this);
+                    }
+                    return;
+                }
+                std::string frame(boost::asio::buffers_begin(buffer_.data()),
+                                  boost::asio::buffers_begin(buffer_.data()) + length - 1);
+                buffer_.consume(length);
+
+                if (node_.empty()) {
+                    // The first frame must identify a configured peer
+                    size_t pos = 0;
+                    std::string type = next_field(frame, pos);
+                    std::string node = next_field(frame, pos);
+                    std::string secret = frame.substr(pos);
+                    if (type != "HELLO" || !cluster_.find_link(node) || secret != cluster_.secret_) {
+                        LOG_WARN("Rejected cluster connection claiming to be '", node, "'");
+                        close();
+                        return;
+                    }
+                    node_ = node;
+                    LOG_INFO("Cluster peer ", node_, " connected");
+                    // A reconnecting peer replays its directory from scratch
+                    cluster_.active_inbound_[node_] = this;
+                    UserManager::getInstance().remove_node(node_);
+                } else {
+                    cluster_.handle_frame(node_, frame);
+                }
+                read();
+            });
+    }
+
+    Cluster& cluster_;
+    boost::asio::ip::tcp::socket socket_;
+    boost::asio::streambuf buffer_;
+    std::string node_;      // empty until HELLO
+};
+
+// ---------------------- Cluster ----------------------
+
+Cluster::Cluster()
+    : frames_sent_(Metrics::getInstance().counter("chat_cluster_frames_sent_total", "Frames queued to peer nodes")),
+      writes_(Metrics::getInstance().counter("chat_cluster_writes_total", "Batched socket writes to peer nodes")),
+      frames_received_(Metrics::getInstance().counter("chat_cluster_frames_received_total",
+                                                      "Frames received from peer nodes")),
+      peers_connected_(Metrics::getInstance().gauge("chat_cluster_peers_connected",
+                                                    "Peer nodes with an established outgoing link")) {}
+
+Cluster::~Cluster() = default;
+
+void Cluster::start(boost::asio::io_context& io_context, const ServerSettings& settings) {
+    if (settings.node_id.empty()) return;
+    node_id_ = settings.node_id;
+    secret_ = settings.cluster_secret;
+
+    for (auto& peer : settings.cluster_peers) {
+        if (peer.node == node_id_) continue;    // one peer list can serve every node
+        links_.push_back(std::make_unique<Link>(*this, io_context, peer));
+    }
+    if (settings.cluster_port > 0) {
+        acceptor_ = std::make_unique<boost::asio::ip::tcp::acceptor>(io_context,
+            boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(settings.cluster_bind_address),
+                                           static_cast<unsigned short>(settings.cluster_port)));
+        accept_loop();
+    }
+    for (auto& link : links_) {
+        link->connect();
+    }
+    LOG_INFO("Cluster node ", node_id_, " started with ", links_.size(), " peers, listening on port ",
+             settings.cluster_port);
+}
+
+#ifndef _WIN32
+void Cluster::start_worker(boost::asio::io_context& io_context, std::unique_ptr<ShmBus> bus, int index) {
+    node_id_ = "worker" + std::to_string(index);
+    bus_ = std::move(bus);
+    bus_index_ = index;
+    Database::getInstance().share_sequence(&bus_->sequence());
+    // The descriptor closes its own copy; the bus keeps the original
+    bus_wakeup_ = std::make_unique<boost::asio::posix::stream_descriptor>(io_context, dup(bus_->eventfd(index)));
+    read_bus();
+    // Ask the others for their users; they also drop anything they still
+    // hold from our previous incarnation
+    send_to_all("SYNC");
+    LOG_INFO("Cluster node ", node_id_, " joined ", bus_->workers(), " workers on the bus");
+}
+#endif
+
+void Cluster::stop() {
+    if (!enabled()) return;
+    // Release sockets now; they must not outlive the io_context
+    if (acceptor_) {
+        boost::system::error_code ignored;
+        acceptor_->close(ignored);
+        acceptor_.reset();
+    }
+    for (auto& link : links_) {
+        link->close();
+    }
+    links_.clear();
+    for (auto& weak : inbound_) {
+        if (auto inbound = weak.lock()) {
+            inbound->close();
+        }
+    }
+    inbound_.clear();
+    active_inbound_.clear();
+    mailbox_batches_.clear();
+#ifndef _WIN32
+    if (bus_wakeup_) {
+        boost::system::error_code ignored;
+        bus_wakeup_->close(ignored);
+        bus_wakeup_.reset();
+    }
+    if (bus_) {
+        Database::getInstance().share_sequence(nullptr);
+    }
+    bus_.reset();
+#endif
+    bus_index_ = -1;
+    node_id_.clear();
+}
+
+void Cluster::accept_loop() {
+    acceptor_->async_accept(
+        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (ec == boost::asio::error::operation_aborted || !acceptor_) return;
+            if (!ec) {
+                auto inbound = std::make_shared<InboundLink>(*this, std::move(socket));
+                inbound_.erase(std::remove_if(inbound_.begin(), inbound_.end(),
+                                              [](const std::weak_ptr<InboundLink>& w) { return w.expired(); }),
+                               inbound_.end());
+                inbound_.push_back(inbound);
+                inbound->start();
+            }
+            accept_loop();
+        });
+}
+
+Cluster::Link* Cluster::find_link(const std::string& node) {
+    for (auto& link : links_) {
+        if (link->node() == node) {
+            return link.get();
+        }
+    }
+    return nullptr;
+}
+
+int Cluster::bus_worker(const std::string& node) const {
+#ifdef _WIN32
+    (void)node;
+    return -1;      // no workers (see Supervisor)
+#else
+    if (!bus_ || node.compare(0, 6, "worker") != 0 || node.size() == 6 ||
+        node.find_first_not_of("0123456789", 6) != std::string::npos) {
+        return -1;
+    }
+    int index = std::atoi(node.c_str() + 6);
+    return index < bus_->workers() && index != bus_index_ ? index : -1;
+#endif
+}
+
+void Cluster::send_to_all(const std::string& frame) {
+    for (auto& link : links_) {
+        link->send(frame);
+    }
+#ifndef _WIN32
+    if (bus_) {
+        for (int i = 0; i < bus_->workers(); ++i) {
+            if (i != bus_index_) {
+                send_to("worker" + std::to_string(i), frame);
+            }
+        }
+    }
+#endif
+}
+
+bool Cluster::send_to(const std::string& node, const std::string& frame) {
+    int worker = bus_worker(node);
+    if (worker < 0) {
+        Link* link = find_link(node);
+        return link && link->send(frame);
+    }
+#ifndef _WIN32
+    // Bus frames carry their sender, as there is no link to identify it
+    if (!bus_->push(worker, node_id_ + "\t" + frame)) {
+        LOG_WARN("Bus inbox of ", node, " is full, dropping frame");
+        return false;
+    }
+    frames_sent_.inc();
+#endif
+    return true;
+}
+
+#ifndef _WIN32
+void Cluster::read_bus() {
+    bus_wakeup_->async_wait(boost::asio::posix::stream_descriptor::wait_read,
+        [this](const boost::system::error_code& ec) {
+            if (ec || !bus_) return;
+            // Reset the eventfd before draining, so a push racing with the
+            // drain wakes us again rather than being missed
+            uint64_t count;
+            ssize_t ignored = read(bus_wakeup_->native_handle(), &count, sizeof(count));
+            (void)ignored;
+            std::string frame;
+            while (bus_ && bus_->pop(bus_index_, frame)) {
+                size_t pos = 0;
+                std::string node = next_field(frame, pos);
+                handle_frame(node, frame.substr(pos));
+            }
+            if (bus_) {
+                read_bus();
+            }
+        });
+}
+#endif
+
+void Cluster::user_joined(const std::string& username) {
+    if (!enabled() || username.empty()) return;
+    send_to_all("JOIN\t" + username);
+}
+
+void Cluster::user_left(const std::string& username) {
+    if (!enabled() || username.empty()) return;
+    send_to_all("LEAVE\t" + username);
+}
+
+void Cluster::relay_broadcast(const MessagePtr& message) {
+    if (!enabled()) return;
+    send_to_all(message_frame(*message));
+}
+
+bool Cluster::relay_private(const MessagePtr& message) {
+    if (!enabled()) return false;
+    std::string node = UserManager::getInstance().get_user_node(std::string(message->target()));
+    return !node.empty() && send_to(node, message_frame(*message));
+}
+
+std::string Cluster::message_frame(const Message& message) const {
+    if (bus_index_ >= 0 && message.seq()) {
+        return "MSG\t" + std::to_string(message.seq()) + "\t" + std::to_string(message.timestamp_ms()) + "\t" +
+               std::string(message.sender()) + "\t" + std::string(message.target()) + "\t" +
+               one_line(std::string(message.body()));
+    }
+    if (!message.is_private()) {
+        return "BCAST\t" + one_line(std::string(message.text_line()));
+    }
+    return "PRIV\t" + std::string(message.sender()) + "\t" + std::string(message.target()) + "\t" +
+           one_line(std::string(message.text_line()));
+}
+
+void Cluster::receive_message(const MessagePtr& message) {
+    if (!message->is_private()) {
+        HistoryManager::getInstance().add_message(Database::kGlobalConversation, message->text_line(),
+                                                  message->seq());
+        SessionManager::getInstance().broadcast(message);
+        return;
+    }
+    std::string to(message->target());
+    auto session = UserManager::getInstance().get_user(to);
+    if (session) {
+        session->deliver(message, Session::Priority::Private);
+        HistoryManager::getInstance().add_message(Database::conversation_key(std::string(message->sender()), to),
+                                                  message->text_line(), message->seq());
+    } else if (!Database::getInstance().store_offline_message(to, std::string(message->text_line()))) {
+        // They logged out while the frame was in flight
+        LOG_WARN("Relayed message for ", to, " dropped, mailbox full");
+    }
+}
+
+void Cluster::handle_frame(const std::string& node, const std::string& frame) {
+    frames_received_.inc();
+    size_t pos = 0;
+    std::string type = next_field(frame, pos);
+
+    if (type == "MSG") {
+        uint64_t seq = std::strtoull(next_field(frame, pos).c_str(), nullptr, 10);
+        int64_t timestamp_ms = std::strtoll(next_field(frame, pos).c_str(), nullptr, 10);
+        std::string sender = next_field(frame, pos);
+        std::string target = next_field(frame, pos);
+        // Only workers share our sequence, and each relays its own users'
+        // lines in the order it numbered them. Anything else would clash
+        // with our seqs or rewind the ones clients ack.
+        if (bus_worker(node) < 0 || UserManager::getInstance().get_user_node(sender) != node) {
+            LOG_WARN("Rejected MSG from ", node, " for ", sender, ", not a user of that worker");
+            return;
+        }
+        uint64_t& last = last_seq_[node];
+        if (seq <= last) {
+            LOG_WARN("Rejected MSG #", seq, " from ", node, ", not after #", last);
+            return;
+        }
+        last = seq;
+        receive_message(Message::create(sender, target, std::string_view(frame).substr(pos), seq, timestamp_ms));
+    } else if (type == "BCAST") {
+        receive_message(Message::parse(std::string_view(frame).substr(pos), {}));
+    } else if (type == "PRIV") {
+        std::string from = next_field(frame, pos);
+        std::string to = next_field(frame, pos);
+        std::string line = frame.substr(pos);
+        // No sender: a mailbox line handed over (see drain_mailbox_to)
+        if (!from.empty() && UserManager::getInstance().get_user_node(from) != node) {
+            LOG_WARN("Rejected PRIV from ", node, " for ", from, ", not a user of that node");
+            return;
+        }
+        auto session = UserManager::getInstance().get_user(to);
+        if (session) {
+            session->deliver(line, Session::Priority::Private);
+            if (!from.empty()) {
+                HistoryManager::getInstance().add_message(Database::conversation_key(from, to), line);
+            }
+        } else if (!Database::getInstance().store_offline_message(to, line)) {
+            // They logged out while the frame was in flight
+            LOG_WARN("Relayed message for ", to, " dropped, mailbox full");
+        }
+    } else if (type == "JOIN") {
+        std::string username = frame.substr(pos);
+        UserManager::getInstance().add_remote_user(username, node);
+        drain_mailbox_to(username, node);
+    } else if (type == "MBOX") {
+        // The PRIV frames before it on this link are delivered or stored
+        std::string username = next_field(frame, pos);
+        send_to(node, "MBOXACK\t" + username + "\t" + frame.substr(pos));
+    } else if (type == "MBOXACK") {
+        std::string username = next_field(frame, pos);
+        int64_t last_id = std::strtoll(frame.c_str() + pos, nullptr, 10);
+        auto it = mailbox_batches_.find(username);
+        if (it == mailbox_batches_.end() || it->second.node != node || it->second.last_id != last_id) return;
+        mailbox_batches_.erase(it);
+        Database::getInstance().delete_offline_messages(username, last_id);
+        if (UserManager::getInstance().get_user_node(username) == node) {
+            drain_mailbox_to(username, node);
+        }
+    } else if (type == "LEAVE") {
+        UserManager::getInstance().remove_remote_user(frame.substr(pos), node);
+    } else if (type == "SYNC") {
+        // A worker (re)started: forget its old users and tell it ours
+        UserManager::getInstance().remove_node(node);
+        last_seq_.erase(node);
+        for (auto& user : UserManager::getInstance().get_all_users()) {
+            send_to(node, "JOIN\t" + user);
+        }
+    } else if (type == "DOWN" && node == "supervisor") {
+        // A worker crashed
+        std::string worker = frame.substr(pos);
+        LOG_WARN("Cluster node ", worker, " went down, forgetting its users");
+        UserManager::getInstance().remove_node(worker);
+        last_seq_.erase(worker);
+    } else {
+        LOG_WARN("Unknown cluster frame from ", node, ": ", type);
+    }
+}
+
+void Cluster::peer_lost(const std::string& node, const InboundLink* link) {
+    // A late EOF on a replaced link must not wipe the replayed directory
+    auto it = active_inbound_.find(node);
+    if (it == active_inbound_.end() || it->second != link) return;
+    active_inbound_.erase(it);
+    // Their acks would have come over this link
+    drop_mailbox_batches(node);
+    LOG_WARN("Cluster peer ", node, " disconnected, forgetting its users");
+    UserManager::getInstance().remove_node(node);
+}
+
+void Cluster::link_up(const std::string& node) {
+    // Batches sent before the link dropped may never have arrived
+    drop_mailbox_batches(node);
+    // Users who joined there while our link was down may have mail here
+    for (auto& remote : UserManager::getInstance().get_remote_users()) {
+        if (remote.second == node) {
+            drain_mailbox_to(remote.first, node);
+        }
+    }
+}
+
+void Cluster::drain_mailbox_to(const std::string& username, const std::string& node) {
+    // Only peers have links; workers read the same mailbox themselves
+    Link* link = find_link(node);
+    if (!link || !link->connected() || mailbox_batches_.count(username)) return;
+    auto batch = Database::getInstance().peek_offline_messages(username,
+                                                               Config::getInstance().settings().offline_batch_size);
+    if (batch.empty()) return;
+    for (auto& row : batch) {
+        // No sender: stored lines are already formatted and not re-cached
+        if (!link->send("PRIV\t\t" + username + "\t" + one_line(row.second))) {
+            // The link dropped; the rows stay for the user's next JOIN
+            return;
+        }
+    }
+    int64_t last_id = batch.back().first;
+    if (link->send("MBOX\t" + username + "\t" + std::to_string(last_id))) {
+        mailbox_batches_[username] = {node, last_id};
+    }
+}
+
+void Cluster::drop_mailbox_batches(const std::string& node) {
+    for (auto it = mailbox_batches_.begin(); it != mailbox_batches_.end();) {
+        it = it->second.node == node ? mailbox_batches_.erase(it) : std::next(it);
+    }
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Config.h"
+#include "Message.h"
+#include "Metrics.h"
+#ifndef _WIN32
+#include "ShmBus.h"
+#endif
+
+// Federation of ChatServer nodes listed statically in server.config. Each
+// node dials every peer once and keeps that link for its outgoing frames;
+// frames from a peer arrive on the link the peer dialled. Frames are text
+// lines ("HELLO", "JOIN", "LEAVE", "BCAST", "PRIV", "MBOX"); frames queued by one
+// handler, or while a write is in flight, go out together in one write.
+//
+// Peers learn which users each node holds from JOIN/LEAVE (replayed in full
+// after every reconnect), so /msg reaches users on any node. Offline mail
+// stays in the mailbox of the node that stored it; when a user comes online
+// elsewhere, that node hands it over one batch at a time: PRIV frames
+// followed by MBOX, which the peer answers with MBOXACK once it has taken
+// them. Only then are they deleted here and the next batch sent, so mail
+// queued on a link that drops is sent again on the next JOIN (a lost ack
+// can mean a batch is delivered twice, never that it is lost).
+//
+// Worker processes of one server (see Supervisor) use the same frames, but
+// exchange them over a ShmBus instead of TCP and name themselves worker<k>.
+// Workers share chat.db, so there is no mailbox to hand over between them,
+// and one sequence for the messages in it: workers relay chat lines as MSG
+// frames carrying sender, target, seq and timestamp, so every worker's
+// clients see the same seq for a message. A MSG frame is taken only from
+// the worker holding its sender and only with a seq above that worker's
+// last one. Lines from federated peers keep the plain BCAST/PRIV form and
+// have no seq here; a PRIV with a sender must come from the sender's node.
+//
+// Everything runs on the main io_context, like Session.
+class Cluster {
+public:
+    static Cluster& getInstance() {
+        static Cluster instance;
+        return instance;
+    }
+
+    // Listens for peers and dials them; does nothing unless node_id is set
+    void start(boost::asio::io_context& io_context, const ServerSettings& settings);
+#ifndef _WIN32
+    // Joins the other workers on bus as worker<index>
+    void start_worker(boost::asio::io_context& io_context, std::unique_ptr<ShmBus> bus, int index);
+#endif
+    void stop();
+    bool enabled() const { return !node_id_.empty(); }
+
+    // Directory updates for users logging in and out on this node
+    void user_joined(const std::string& username);
+    void user_left(const std::string& username);
+
+    // Sends a room line to every connected peer
+    void relay_broadcast(const MessagePtr& message);
+    // Sends a private line to the node holding its target; false if no
+    // connected peer holds them, in which case the caller should store it
+    // offline
+    bool relay_private(const MessagePtr& message);
+
+private:
+    Cluster();
+    ~Cluster();
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    class Link;
+    class InboundLink;
+
+    void accept_loop();
+    void send_to_all(const std::string& frame);
+    // Routes a frame to one node over its link or the bus; false if neither
+    // can take it
+    bool send_to(const std::string& node, const std::string& frame);
+    Link* find_link(const std::string& node);
+    // Bus index of a worker<k> node other than this one, or -1
+    int bus_worker(const std::string& node) const;
+#ifndef _WIN32
+    void read_bus();
+#endif
+    // Frames from peer node, called by InboundLink
+    void handle_frame(const std::string& node, const std::string& frame);
+    void peer_lost(const std::string& node, const InboundLink* link);
+    // Our link to node (re)connected
+    void link_up(const std::string& node);
+    // Sends username's next mailbox batch to node, unless one is in flight
+    void drain_mailbox_to(const std::string& username, const std::string& node);
+    // Forgets unacknowledged batches to node, whose link went down
+    void drop_mailbox_batches(const std::string& node);
+    // The frame relaying message: MSG between workers, else BCAST or PRIV
+    std::string message_frame(const Message& message) const;
+    void receive_message(const MessagePtr& message);
+
+    std::string node_id_;
+    std::string secret_;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+    std::vector<std::unique_ptr<Link>> links_;
+    std::vector<std::weak_ptr<InboundLink>> inbound_;
+    std::unordered_map<std::string, const InboundLink*> active_inbound_;  // node -> its current link
+    // Mailbox batches awaiting MBOXACK: username -> node and last row id
+    struct MailboxBatch {
+        std::string node;
+        int64_t last_id;
+    };
+    std::unordered_map<std::string, MailboxBatch> mailbox_batches_;
+    std::unordered_map<std::string, uint64_t> last_seq_;    // worker -> seq of its last MSG
+    int bus_index_ = -1;        // >= 0 in a worker
+#ifndef _WIN32
+    std::unique_ptr<ShmBus> bus_;
+    std::unique_ptr<boost::asio::posix::stream_descriptor> bus_wakeup_;
+#endif
+
+    Counter& frames_sent_;
+    Counter& writes_;
+    Counter& frames_received_;
+    Gauge& peers_connected_;
+};
@@ -4,21 +4,21 @@
 #include "UserManager.h"
 #include "SessionManager.h"
 #include "Database.h"
-#include "ChatHistoryCache.h"
+#include "HistoryManager.h"
 #include "Logger.h"
+#include "Config.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "FlightRecorder.h"
+#include "Cluster.h"
+#include <chrono>
 #include <sstream>
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
-#include <atomic>
+// Defined in main.cpp
+void request_shutdown(const std::string &reason);
 
-extern std::atomic<int> g_messageCount;
-extern boost::asio::io_context* g_io_context_ptr;
-
-CommandRouter::CommandRouter() {}
-
-void CommandRouter::set_session(std::shared_ptr<Session> session) {
-    session_ = session;
-    register_commands();
-}
+CommandRouter::CommandRouter(Session &session) : session_(session) {}
 
 void CommandRouter::handle_command(const std::string &cmd_line) {
     // Example: /cmd args...
@@ -34,47 +34,74 @@ void CommandRouter::handle_command(const std::string &cmd_line) {
     std::getline(iss, args);
     boost::algorithm::trim(args);
 
-    auto it = commands_.find(command);
-    if (it != commands_.end()) {
-        it->second(args);
-    } else {
-        if (session_) {
-            session_->deliver("Unknown command: /" + command);
+    auto it = commands().find(command);
+    if (it != commands().end()) {
+        auto start = std::chrono::steady_clock::now();
+        {
+            ScopedTimer timer(*it->second.latency);
+            TraceSpan span("router.command");
+            (this->*it->second.handler)(args);
         }
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        FlightRecorder::record(FlightEvent::Command, session_.get_id(), static_cast<uint64_t>(micros), command);
+    } else {
+        session_.deliver("Unknown command: /" + command);
     }
 }
 
 void CommandRouter::handle_broadcast(const std::string &message) {
-    if (!session_) return;
-    std::string broadcast_msg = session_->get_username() + ": " + message;
+    static Histogram &latency = Metrics::getInstance().histogram(
+        "chat_command_duration_seconds", "Time to handle a client command", "command=\"broadcast\"");
+    ScopedTimer timer(latency);
+    TraceSpan span("router.broadcast");
+    MessagePtr line = Message::create(session_.get_username(), {}, message,
+                                      Database::getInstance().next_sequence());
 
     // Log to DB (batch aggregator) and store in memory cache
-    Database::getInstance().log_message(session_->get_username(), message);
-    ChatHistoryCache::getInstance().add_message(broadcast_msg);
+    Database::getInstance().log_message(line);
+    HistoryManager::getInstance().add_message(Database::kGlobalConversation, line->text_line(), line->seq());
 
-    // Broadcast to others
-    SessionManager::getInstance().broadcast(broadcast_msg, session_);
+    // Broadcast to others, here and on the other cluster nodes
+    SessionManager::getInstance().broadcast(line, &session_);
+    Cluster::getInstance().relay_broadcast(line);
 }
 
-void CommandRouter::register_commands() {
-    commands_["login"] = [this](const std::string &args){ cmd_login(args); };
-    commands_["logout"] = [this](const std::string &args){ cmd_logout(args); };
-    commands_["msg"] = [this](const std::string &args){ cmd_msg(args); };
-    commands_["history"] = [this](const std::string &args){ cmd_history(args); };
-    commands_["status"] = [this](const std::string &args){ cmd_status(args); };
-    commands_["undo"] = [this](const std::string &args){ cmd_undo(args); };
-    commands_["shutdown"] = [this](const std::string &args){ cmd_shutdown(args); };
-    commands_["list"] = [this](const std::string &args){ cmd_list(args); };
-    commands_["search"] = [this](const std::string &args){ cmd_search(args); };
-    commands_["offline"] = [this](const std::string &args){ cmd_offline(args); };
+const std::unordered_map<std::string, CommandRouter::Command> &CommandRouter::commands() {
+    static const std::unordered_map<std::string, Command> table = [] {
+        std::unordered_map<std::string, Command> table;
+        auto add = [&table](const std::string &name, void (CommandRouter::*handler)(const std::string&)) {
+            Histogram &latency = Metrics::getInstance().histogram(
+                "chat_command_duration_seconds", "Time to handle a client command", "command=\"" + name + "\"");
+            table[name] = Command{handler, &latency};
+        };
+        add("login", &CommandRouter::cmd_login);
+        add("logout", &CommandRouter::cmd_logout);
+        add("msg", &CommandRouter::cmd_msg);
+        add("history", &CommandRouter::cmd_history);
+        add("status", &CommandRouter::cmd_status);
+        add("undo", &CommandRouter::cmd_undo);
+        add("shutdown", &CommandRouter::cmd_shutdown);
+        add("list", &CommandRouter::cmd_list);
+        add("search", &CommandRouter::cmd_search);
+        add("offline", &CommandRouter::cmd_offline);
+        add("inbox", &CommandRouter::cmd_inbox);
+        add("stats", &CommandRouter::cmd_stats);
+        add("trace", &CommandRouter::cmd_trace);
+        add("flight", &CommandRouter::cmd_flight);
+        add("reload", &CommandRouter::cmd_reload);
+        add("ack", &CommandRouter::cmd_ack);
+        add("sync", &CommandRouter::cmd_sync);
+        return table;
+    }();
+    return table;
 }
 
 // ---------------------- Command Handlers ----------------------
 
 void CommandRouter::cmd_login(const std::string &args) {
-    if (!session_) return;
-    if (session_->is_authenticated()) {
-        session_->deliver("You are already logged in.");
+    if (session_.is_authenticated()) {
+        session_.deliver("You are already logged in.");
         return;
     }
 
@@ -82,54 +109,47 @@ void CommandRouter::cmd_login(const std::string &args) {
     std::string uname, pwd;
     iss >> uname >> pwd;
     if (uname.empty() || pwd.empty()) {
-        session_->deliver("Usage: /login <username> <password>");
+        session_.deliver("Usage: /login <username> <password>");
         return;
     }
 
     // Attempt authentication
     if (AuthManager::getInstance().authenticate(uname, pwd)) {
-        session_->set_authenticated(true);
-        session_->set_username(uname);
-        UserManager::getInstance().add_user(uname, session_);
-        SessionManager::getInstance().add_session(session_);
-
-        // Deliver offline messages if any
-        auto offline_msgs = Database::getInstance().retrieve_offline_messages(uname);
-        if (!offline_msgs.empty()) {
-            session_->deliver("You have offline messages:");
-            for (auto &msg : offline_msgs) {
-                session_->deliver(msg);
-            }
-            // Clear them from DB
-            Database::getInstance().clear_offline_messages(uname);
-        }
+        session_.set_authenticated(true);
+        session_.set_username(uname);
+        UserManager::getInstance().add_user(uname, session_.shared_from_this());
+        SessionManager::getInstance().add_session(session_.shared_from_this());
 
-        session_->deliver("Login successful. Welcome, " + uname + "!");
-        Logger::log("User logged in: " + uname, LogLevel::INFO);
+        session_.deliver("Login successful. Welcome, " + uname + "!");
+
+        // Deliver the first batch of offline messages, if any
+        deliver_offline_batch();
+        LOG_INFO("User logged in: ", uname);
+        FlightRecorder::record(FlightEvent::LoginOk, session_.get_id(), 0, uname);
     } else {
-        session_->deliver("Authentication failed. Use /login <username> <password>");
+        FlightRecorder::record(FlightEvent::LoginFailed, session_.get_id(), 0, uname);
+        session_.deliver("Authentication failed. Use /login <username> <password>");
     }
 }
 
 void CommandRouter::cmd_logout(const std::string &/*args*/) {
-    if (!session_) return;
-    if (!session_->is_authenticated()) {
-        session_->deliver("You are not logged in.");
+    if (!session_.is_authenticated()) {
+        session_.deliver("You are not logged in.");
         return;
     }
-    std::string uname = session_->get_username();
-    session_->set_authenticated(false);
-    session_->set_username("");
+    std::string uname = session_.get_username();
+    session_.set_authenticated(false);
+    session_.set_username("");
     UserManager::getInstance().remove_user(uname);
-    SessionManager::getInstance().remove_session(session_);
-    session_->deliver("You have been logged out.");
-    Logger::log("User logged out: " + uname, LogLevel::INFO);
+    SessionManager::getInstance().remove_session(session_.shared_from_this());
+    session_.deliver("You have been logged out.");
+    LOG_INFO("User logged out: ", uname);
+    FlightRecorder::record(FlightEvent::Logout, session_.get_id(), 0, uname);
 }
 
 void CommandRouter::cmd_msg(const std::string &args) {
-    if (!session_) return;
-    if (!session_->is_authenticated()) {
-        session_->deliver("Please /login first.");
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
         return;
     }
 
@@ -141,105 +161,118 @@ void CommandRouter::cmd_msg(const std::string &args) {
     boost::algorithm::trim(message);
 
     if (target_user.empty() || message.empty()) {
-        session_->deliver("Usage: /msg <username> <message>");
+        session_.deliver("Usage: /msg <username> <message>");
         return;
     }
 
+    // Only a DM that is delivered is logged, so only that one takes a seq;
+    // one for the offline mailbox gets none. A relay that fails after all
+    // (the peer's link just dropped) leaves a gap, which /sync tolerates.
     auto target_session = UserManager::getInstance().get_user(target_user);
-    if (target_session) {
-        // The user is online, deliver immediately
-        std::string private_msg = "[Private] " + session_->get_username() + ": " + message;
-        target_session->deliver(private_msg);
-        session_->deliver("[Private to " + target_user + "] " + message);
-
-        // Log and cache
-        Database::getInstance().log_message(session_->get_username(),
-                                         "[Private to " + target_user + "] " + message);
-        ChatHistoryCache::getInstance().add_message(private_msg);
+    bool reachable = target_session || !UserManager::getInstance().get_user_node(target_user).empty();
+    MessagePtr private_msg = Message::create(session_.get_username(), target_user, message,
+                                             reachable ? Database::getInstance().next_sequence() : 0);
+    if (target_session || (reachable && Cluster::getInstance().relay_private(private_msg))) {
+        // The user is online here or on another node, deliver immediately
+        if (target_session) {
+            target_session->deliver(private_msg, Session::Priority::Private);
+        }
+        session_.deliver("[Private to " + target_user + "] " + message);
+
+        // Log and cache under the DM conversation
+        Database::getInstance().log_message(private_msg);
+        HistoryManager::getInstance().add_message(
+            Database::conversation_key(session_.get_username(), target_user), private_msg->text_line(),
+            private_msg->seq());
     } else {
         // The user might be offline, store it as an offline message
-        session_->deliver("User " + target_user + " is offline or not found. Storing offline.");
-        Database::getInstance().store_offline_message(target_user,
-            "[Private] " + session_->get_username() + ": " + message);
+        if (Database::getInstance().store_offline_message(target_user, std::string(private_msg->text_line()))) {
+            session_.deliver("User " + target_user + " is offline or not found. Storing offline.");
+        } else {
+            session_.deliver("User " + target_user + " is offline and their mailbox is full. Message not stored.");
+        }
     }
 }
 
-void CommandRouter::cmd_history(const std::string &/*args*/) {
-    if (!session_) return;
+void CommandRouter::cmd_history(const std::string &args) {
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
+        return;
+    }
 
-    std::string db_history = Database::getInstance().get_chat_history();
-    auto recent = ChatHistoryCache::getInstance().get_recent_messages();
+    // No argument: the room; otherwise the DM conversation with that user
+    std::string peer = args;
+    boost::algorithm::trim(peer);
+    if (!peer.empty() && !AuthManager::getInstance().userExists(peer)) {
+        session_.deliver("No such user: " + peer);
+        return;
+    }
+    std::string conversation = Database::conversation_key(session_.get_username(), peer);
+    auto recent = HistoryManager::getInstance().get_recent_messages(conversation);
 
-    session_->deliver("===== Full Chat History (DB) =====\n" + db_history);
-    session_->deliver("===== Recent In-Memory =====");
+    if (peer.empty()) {
+        session_.deliver("===== Recent History =====", Session::Priority::Bulk);
+    } else {
+        session_.deliver("===== Recent History with " + peer + " =====", Session::Priority::Bulk);
+    }
     for (auto &m : recent) {
-        session_->deliver(m);
+        session_.deliver(m, Session::Priority::Bulk);
     }
 }
 
 void CommandRouter::cmd_status(const std::string &args) {
-    if (!session_) return;
-    if (!session_->is_authenticated()) {
-        session_->deliver("Please /login first.");
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
         return;
     }
 
     std::string status = args;
     boost::algorithm::trim(status);
     if (status != "online" && status != "offline") {
-        session_->deliver("Usage: /status <online|offline>");
+        session_.deliver("Usage: /status <online|offline>");
         return;
     }
 
-    UserManager::getInstance().update_status(session_->get_username(), status);
-    session_->deliver("Status updated to " + status);
-    Logger::log("User " + session_->get_username() + " updated status to " + status, LogLevel::INFO);
+    UserManager::getInstance().update_status(session_.get_username(), status);
+    session_.deliver("Status updated to " + status);
+    LOG_INFO("User ", session_.get_username(), " updated status to ", status);
 
     // We store statuses in AuthManager's user record for undo
-    AuthManager::getInstance().pushStatus(session_->get_username(), status);
+    AuthManager::getInstance().pushStatus(session_.get_username(), status);
 }
 
 void CommandRouter::cmd_undo(const std::string &/*args*/) {
-    if (!session_) return;
-    if (!session_->is_authenticated()) {
-        session_->deliver("Please /login first.");
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
         return;
     }
 
-    std::string old_status = AuthManager::getInstance().popStatus(session_->get_username());
+    std::string old_status = AuthManager::getInstance().popStatus(session_.get_username());
     if (old_status.empty()) {
-        session_->deliver("No previous status to revert to.");
+        session_.deliver("No previous status to revert to.");
     } else {
-        UserManager::getInstance().update_status(session_->get_username(), old_status);
-        session_->deliver("Reverted status to " + old_status);
-        Logger::log("User " + session_->get_username() + " reverted status to " + old_status, LogLevel::INFO);
+        UserManager::getInstance().update_status(session_.get_username(), old_status);
+        session_.deliver("Reverted status to " + old_status);
+        LOG_INFO("User ", session_.get_username(), " reverted status to ", old_status);
     }
 }
 
 void CommandRouter::cmd_shutdown(const std::string &/*args*/) {
-    if (!session_) return;
     // Must be admin
-    if (!AuthManager::getInstance().isAdmin(session_->get_username())) {
-        session_->deliver("You are not authorized to shut down the server.");
+    if (!AuthManager::getInstance().isAdmin(session_.get_username())) {
+        session_.deliver("You are not authorized to shut down the server.");
         return;
     }
 
-    session_->deliver("Shutting down server...");
-
-    // Gracefully stop all sessions first
-    SessionManager::getInstance().close_all_sessions();
-
-    // Now stop io_context
-    if (g_io_context_ptr) {
-        g_io_context_ptr->stop();
-    }
-    Logger::log("Server shutdown initiated by admin.", LogLevel::INFO);
+    session_.deliver("Shutting down server...");
+    LOG_INFO("Server shutdown initiated by admin.");
+    // Every session, this one included, gets its output and a goodbye
+    request_shutdown("/shutdown by " + session_.get_username());
 }
 
 void CommandRouter::cmd_list(const std::string &/*args*/) {
-    if (!session_) return;
-    if (!AuthManager::getInstance().isAdmin(session_->get_username())) {
-        session_->deliver("You are not authorized to use /list.");
+    if (!AuthManager::getInstance().isAdmin(session_.get_username())) {
+        session_.deliver("You are not authorized to use /list.");
         return;
     }
     auto users = UserManager::getInstance().get_all_users();
@@ -247,30 +280,278 @@ void CommandRouter::cmd_list(const std::string &/*args*/) {
     for (const auto &u : users) {
         user_list += "  " + u + "\n";
     }
-    session_->deliver(user_list);
+    for (const auto &remote : UserManager::getInstance().get_remote_users()) {
+        user_list += "  " + remote.first + " (on " + remote.second + ")\n";
+    }
+    session_.deliver(user_list);
 }
 
 void CommandRouter::cmd_search(const std::string &args) {
-    if (!session_) return;
-    // Basic search in ChatHistoryCache
     if (args.empty()) {
-        session_->deliver("Usage: /search <keyword>");
+        session_.deliver("Usage: /search [user:<name>] [since:<date>] [until:<date>] [page:<n>] <keywords>");
         return;
     }
-    auto results = ChatHistoryCache::getInstance().search(args);
-    if (results.empty()) {
-        session_->deliver("No messages found matching '" + args + "'.");
-    } else {
-        session_->deliver("Search results:");
-        for (auto &r : results) {
-            session_->deliver(r);
+
+    // Split filter options from the search terms
+    SearchQuery query;
+    query.viewer = session_.get_username();
+    query.page_size = Config::getInstance().settings().search_page_size;
+    std::istringstream iss(args);
+    std::string token;
+    while (iss >> token) {
+        if (token.rfind("user:", 0) == 0) {
+            query.user = token.substr(5);
+        } else if (token.rfind("since:", 0) == 0) {
+            query.since = token.substr(6);
+        } else if (token.rfind("until:", 0) == 0) {
+            query.until = token.substr(6);
+        } else if (token.rfind("page:", 0) == 0) {
+            try {
+                query.page = std::max(0, std::stoi(token.substr(5)) - 1);
+            } catch (const std::exception&) {
+                session_.deliver("Invalid page number: " + token.substr(5));
+                return;
+            }
+        } else {
+            if (!query.terms.empty()) query.terms += " ";
+            query.terms += token;
+        }
+    }
+    if (query.terms.empty()) {
+        session_.deliver("Usage: /search [user:<name>] [since:<date>] [until:<date>] [page:<n>] <keywords>");
+        return;
+    }
+
+    std::vector<uint64_t> result_seqs;
+    auto results = Database::getInstance().search_messages(query, &result_seqs);
+    // Lines from the last few seconds may not be flushed to the DB yet. The
+    // cache can't apply user:/since:/until: (its lines have no timestamp), so
+    // a filtered search shows the DB alone; lines already on the DB page are
+    // dropped by seq.
+    std::vector<std::string> recent;
+    if (query.page == 0 && query.user.empty() && query.since.empty() && query.until.empty()) {
+        std::vector<uint64_t> recent_seqs;
+        auto cached = HistoryManager::getInstance().search(Database::kGlobalConversation, query.terms,
+                                                           &recent_seqs);
+        std::sort(result_seqs.begin(), result_seqs.end());
+        for (size_t i = 0; i < cached.size(); ++i) {
+            if (recent_seqs[i] == 0 ||
+                !std::binary_search(result_seqs.begin(), result_seqs.end(), recent_seqs[i])) {
+                recent.push_back(std::move(cached[i]));
+            }
+        }
+    }
+
+    if (results.empty() && recent.empty()) {
+        session_.deliver("No messages found matching '" + query.terms + "'.");
+        return;
+    }
+    session_.deliver("===== Search results (page " + std::to_string(query.page + 1) + ") =====",
+                     Session::Priority::Bulk);
+    for (auto &r : results) {
+        session_.deliver(r, Session::Priority::Bulk);
+    }
+    if (static_cast<int>(results.size()) == query.page_size) {
+        session_.deliver("More results available, repeat the search with page:" + std::to_string(query.page + 2),
+                         Session::Priority::Bulk);
+    }
+    if (!recent.empty()) {
+        session_.deliver("===== Recent In-Memory =====", Session::Priority::Bulk);
+        for (auto &r : recent) {
+            session_.deliver(r, Session::Priority::Bulk);
+        }
+    }
+}
+
+void CommandRouter::cmd_inbox(const std::string &/*args*/) {
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
+        return;
+    }
+    if (!deliver_offline_batch()) {
+        session_.deliver("No offline messages.");
+    }
+}
+
+bool CommandRouter::deliver_offline_batch() {
+    // Bounded batches keep a large backlog from stalling login
+    int batch_size = Config::getInstance().settings().offline_batch_size;
+    std::string uname = session_.get_username();
+    auto offline_msgs = Database::getInstance().drain_offline_messages(uname, batch_size);
+    if (offline_msgs.empty()) {
+        return false;
+    }
+
+    session_.deliver("You have offline messages:", Session::Priority::Private);
+    for (auto &msg : offline_msgs) {
+        session_.deliver(msg, Session::Priority::Private);
+    }
+    if (static_cast<int>(offline_msgs.size()) == batch_size) {
+        int remaining = Database::getInstance().count_offline_messages(uname);
+        if (remaining > 0) {
+            session_.deliver(std::to_string(remaining) + " more offline messages. Use /inbox to read them.",
+                             Session::Priority::Private);
         }
     }
+    return true;
 }
 
 void CommandRouter::cmd_offline(const std::string &/*args*/) {
     // Just demonstration: forcibly close the session to test offline messaging
-    if (!session_) return;
-    session_->deliver("Forcing you offline...");
-    session_->force_disconnect();
-} 
\ No newline at end of file
+    session_.deliver("Forcing you offline...");
+    session_.force_disconnect();
+} 
+
+void CommandRouter::cmd_stats(const std::string &/*args*/) {
+    if (!AuthManager::getInstance().isAdmin(session_.get_username())) {
+        session_.deliver("You are not authorized to use /stats.");
+        return;
+    }
+    session_.deliver(Metrics::getInstance().render_summary());
+}
+
+void CommandRouter::cmd_trace(const std::string &args) {
+    if (!AuthManager::getInstance().isAdmin(session_.get_username())) {
+        session_.deliver("You are not authorized to use /trace.");
+        return;
+    }
+
+    // "/trace sample <N>" changes the sampling rate; "/trace" dumps the spans
+    std::istringstream iss(args);
+    std::string sub;
+    iss >> sub;
+    if (sub == "sample") {
+        int every = -1;
+        iss >> every;
+        if (every < 0) {
+            session_.deliver("Usage: /trace [sample <N>]  (trace 1 in N messages, 0 = off)");
+            return;
+        }
+        Tracer::getInstance().set_sample_every(every);
+        session_.deliver("Tracing 1 in " + std::to_string(every) + " messages" + (every == 0 ? " (off)" : ""));
+        return;
+    }
+    std::string path = Tracer::getInstance().dump_to_dir(Config::getInstance().settings().trace_dump_dir);
+    if (path.empty()) {
+        session_.deliver("Failed to write trace dump.");
+    } else {
+        session_.deliver("Trace written to " + path);
+        LOG_INFO("Trace dump written to ", path);
+    }
+}
+
+void CommandRouter::cmd_flight(const std::string &/*args*/) {
+    if (!AuthManager::getInstance().isAdmin(session_.get_username())) {
+        session_.deliver("You are not authorized to use /flight.");
+        return;
+    }
+    FlightRecorder::record(FlightEvent::Dump, session_.get_id(), 0, session_.get_username());
+    std::string path = FlightRecorder::getInstance().dump_to_dir(Config::getInstance().settings().flight_dump_dir);
+    if (path.empty()) {
+        session_.deliver("Failed to write flight recorder dump.");
+    } else {
+        session_.deliver("Flight recorder written to " + path);
+        LOG_INFO("Flight recorder dump written to ", path);
+    }
+}
+
+void CommandRouter::cmd_reload(const std::string &/*args*/) {
+    if (!AuthManager::getInstance().isAdmin(session_.get_username())) {
+        session_.deliver("You are not authorized to use /reload.");
+        return;
+    }
+    std::vector<std::string> errors;
+    if (Config::getInstance().reload(errors)) {
+        session_.deliver("Configuration reloaded.");
+        return;
+    }
+    session_.deliver("Reload rejected, configuration unchanged:");
+    for (auto &error : errors) {
+        session_.deliver("  " + error);
+    }
+}
+
+// Reads a seq argument; false (after telling the client) if it isn't one
+static bool parse_seq(Session &session, const std::string &text, uint64_t &seq) {
+    try {
+        size_t used = 0;
+        seq = std::stoull(text, &used);
+        if (used == text.size() && text[0] != '-') return true;
+    } catch (const std::exception&) {
+    }
+    session.deliver("Invalid sequence number: " + text);
+    return false;
+}
+
+void CommandRouter::cmd_ack(const std::string &args) {
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
+        return;
+    }
+    if (args.empty()) {
+        session_.deliver("Usage: /ack <seq>");
+        return;
+    }
+    uint64_t seq;
+    if (!parse_seq(session_, args, seq)) {
+        return;
+    }
+    // Silent: clients ack often, and a reply would need acking too
+    Database::getInstance().store_ack(session_.get_username(), seq);
+}
+
+void CommandRouter::cmd_sync(const std::string &args) {
+    if (!session_.is_authenticated()) {
+        session_.deliver("Please /login first.");
+        return;
+    }
+    // No argument: resume after the last /ack
+    std::string uname = session_.get_username();
+    uint64_t after;
+    if (args.empty()) {
+        after = Database::getInstance().load_ack(uname);
+    } else if (!parse_seq(session_, args, after)) {
+        return;
+    }
+    int limit = Config::getInstance().settings().sync_max_messages;
+
+    // From here on, live lines carry their seq too, so nothing arriving
+    // after the snapshot below goes out unnumbered. They may overtake the
+    // (bulk) lines below, so clients should ack only after the end marker.
+    session_.set_sequenced(true);
+
+    // Room lines from the cache when it reaches back far enough, the
+    // viewer's DMs (spread over many conversations) from the database
+    std::vector<std::pair<uint64_t, std::string>> room;
+    bool from_cache = HistoryManager::getInstance().messages_since(Database::kGlobalConversation, after, room);
+    auto stored = Database::getInstance().messages_since(uname, after, !from_cache, limit);
+
+    session_.deliver("===== Sync after #" + std::to_string(after) + " =====", Session::Priority::Bulk);
+    size_t r = 0, s = 0;
+    uint64_t last = after;
+    int sent = 0;
+    while (sent < limit && (r < room.size() || s < stored.size())) {
+        // Merged by seq; a line in both sources (or repeated) goes out once
+        if (s == stored.size() || (r < room.size() && room[r].first < stored[s]->seq())) {
+            if (room[r].first > last) {
+                last = room[r].first;
+                session_.deliver("#" + std::to_string(last) + " " + room[r].second, Session::Priority::Bulk);
+                ++sent;
+            }
+            ++r;
+        } else {
+            if (stored[s]->seq() > last) {
+                last = stored[s]->seq();
+                session_.deliver(stored[s], Session::Priority::Bulk);
+                ++sent;
+            }
+            ++s;
+        }
+    }
+    // A full page from the database may have more behind it
+    if (r < room.size() || s < stored.size() || stored.size() == static_cast<size_t>(limit)) {
+        session_.deliver("===== More: /sync " + std::to_string(last) + " =====", Session::Priority::Bulk);
+    } else {
+        session_.deliver("===== End of sync (" + std::to_string(sent) + " messages) =====", Session::Priority::Bulk);
+    }
+}
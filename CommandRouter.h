@@ -2,22 +2,20 @@
 #define COMMANDROUTER_H
 
 #include <string>
-#include <functional>
 #include <unordered_map>
-#include <memory>
 
 class Session;
+class Histogram;
 
 class CommandRouter {
 public:
-    CommandRouter();
-    void set_session(std::shared_ptr<Session> session);
+    // The router belongs to its session and holds it by reference; an owning
+    // pointer would keep every session alive forever
+    explicit CommandRouter(Session &session);
     void handle_command(const std::string &cmd_line);
     void handle_broadcast(const std::string &message);
 
 private:
-    void register_commands();
-
     // Command handlers
     void cmd_login(const std::string &args);
     void cmd_logout(const std::string &args);
@@ -29,9 +27,25 @@ private:
     void cmd_list(const std::string &args);
     void cmd_search(const std::string &args);
     void cmd_offline(const std::string &args); // demonstration command to show offline messaging
+    void cmd_inbox(const std::string &args);
+    void cmd_stats(const std::string &args);
+    void cmd_trace(const std::string &args);
+    void cmd_flight(const std::string &args);
+    void cmd_reload(const std::string &args);
+    void cmd_ack(const std::string &args);
+    void cmd_sync(const std::string &args);
+
+    // Drains and delivers one batch of offline messages; false if none
+    bool deliver_offline_batch();
+
+    Session &session_;
 
-    std::shared_ptr<Session> session_;
-    std::unordered_map<std::string, std::function<void(const std::string&)>> commands_;
+    struct Command {
+        void (CommandRouter::*handler)(const std::string&);
+        Histogram *latency;     // per-command latency, owned by Metrics
+    };
+    // Shared by every router, built on first use
+    static const std::unordered_map<std::string, Command> &commands();
 };
 
 #endif // COMMANDROUTER_H 
\ No newline at end of file
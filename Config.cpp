@@ -1,19 +1,127 @@
 #include "Config.h"
 #include "Logger.h"
+#include <algorithm>
+#include <cctype>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
 
+namespace {
+
+using Values = std::unordered_map<std::string, std::string>;
+
+void parse_int(const Values& values, const std::string& key, int min, int max,
+               int& out, std::vector<std::string>& errors) {
+    auto it = values.find(key);
+    if (it == values.end()) return;
+    try {
+        size_t used = 0;
+        int value = std::stoi(it->second, &used);
+        if (used != it->second.size() || value < min || value > max) {
+            throw std::out_of_range(key);
+        }
+        out = value;
+    } catch (const std::exception&) {
+        errors.push_back(key + "=" + it->second + " (expected an integer in [" +
+                         std::to_string(min) + ", " + std::to_string(max) + "])");
+    }
+}
+
+void parse_choice(const Values& values, const std::string& key, const std::vector<std::string>& choices,
+                  std::string& out, std::vector<std::string>& errors) {
+    auto it = values.find(key);
+    if (it == values.end()) return;
+    std::string lower = it->second;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    for (auto& choice : choices) {
+        if (lower == choice) {
+            out = choice;
+            return;
+        }
+    }
+    std::string expected;
+    for (auto& choice : choices) {
+        expected += (expected.empty() ? "" : "|") + choice;
+    }
+    errors.push_back(key + "=" + it->second + " (expected " + expected + ")");
+}
+
+void parse_string(const Values& values, const std::string& key, std::string& out) {
+    auto it = values.find(key);
+    if (it != values.end() && !it->second.empty()) {
+        out = it->second;
+    }
+}
+
+// Like parse_string, but an empty value is kept; it disables a feature
+void parse_optional(const Values& values, const std::string& key, std::string& out) {
+    auto it = values.find(key);
+    if (it != values.end()) {
+        out = it->second;
+    }
+}
+
+// Comma-separated node@host:port entries
+void parse_peers(const Values& values, const std::string& key, std::vector<ClusterPeer>& out,
+                 std::vector<std::string>& errors) {
+    auto it = values.find(key);
+    if (it == values.end()) return;
+    std::vector<ClusterPeer> peers;
+    std::stringstream list(it->second);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+        if (entry.empty()) continue;
+        size_t at = entry.find('@');
+        size_t colon = entry.rfind(':');
+        ClusterPeer peer;
+        if (at != std::string::npos && colon != std::string::npos && at > 0 && colon > at + 1) {
+            peer.node = entry.substr(0, at);
+            peer.host = entry.substr(at + 1, colon - at - 1);
+            Values port{{"port", entry.substr(colon + 1)}};
+            std::vector<std::string> port_errors;
+            parse_int(port, "port", 1, 65535, peer.port, port_errors);
+            if (port_errors.empty()) {
+                peers.push_back(peer);
+                continue;
+            }
+        }
+        errors.push_back(key + " entry '" + entry + "' (expected node@host:port)");
+    }
+    out = peers;
+}
+
+} // namespace
+
+Config::Config() {
+    auto defaults = std::make_unique<Snapshot>();
+    current_.store(defaults.get(), std::memory_order_release);
+    snapshots_.push_back(std::move(defaults));
+}
+
 void Config::load(const std::string& configFile) {
+    std::lock_guard<std::mutex> lock(reload_mtx_);
     configFileName = configFile;
-    loadConfig();
+    auto snapshot = std::make_unique<Snapshot>();
+    if (!read_file(configFileName, snapshot->values)) {
+        return;
+    }
+    // At startup a bad value falls back to its default rather than failing
+    std::vector<std::string> errors;
+    parse_settings(snapshot->values, snapshot->settings, errors);
+    for (auto& error : errors) {
+        LOG_ERROR("Invalid config value, using the default: ", error);
+    }
+    publish(std::move(snapshot));
+    LOG_INFO("Loaded configuration from ", configFileName);
 }
 
-void Config::loadConfig() {
-    std::ifstream file(configFileName);
+bool Config::read_file(const std::string& filename, Values& values) const {
+    std::ifstream file(filename);
     if (!file.is_open()) {
-        Logger::log("Failed to open config file: " + configFileName, LogLevel::ERROR);
-        return;
+        LOG_ERROR("Failed to open config file: ", filename);
+        return false;
     }
 
     std::string line;
@@ -35,32 +143,153 @@ void Config::loadConfig() {
             value.erase(0, value.find_first_not_of(" \t"));
             value.erase(value.find_last_not_of(" \t") + 1);
 
-            configData[key] = value;
+            values[key] = value;
+        }
+    }
+    return true;
+}
+
+void Config::parse_settings(const Values& values, ServerSettings& s, std::vector<std::string>& errors) {
+    const int kMax = 1 << 30;
+    parse_int(values, "port", 1, 65535, s.port, errors);
+    parse_int(values, "max_connections", 1, 1 << 20, s.max_connections, errors);
+    parse_int(values, "workers", 1, 64, s.workers, errors);
+    parse_optional(values, "upgrade_socket", s.upgrade_socket);
+    parse_int(values, "metrics_port", 0, 65535, s.metrics_port, errors);
+    parse_string(values, "metrics_bind_address", s.metrics_bind_address);
+    parse_int(values, "tls_port", 0, 65535, s.tls_port, errors);
+    parse_string(values, "tls_cert_file", s.tls_cert_file);
+    parse_string(values, "tls_key_file", s.tls_key_file);
+
+    parse_string(values, "node_id", s.node_id);
+    parse_int(values, "cluster_port", 0, 65535, s.cluster_port, errors);
+    parse_string(values, "cluster_bind_address", s.cluster_bind_address);
+    parse_string(values, "cluster_secret", s.cluster_secret);
+    parse_peers(values, "cluster_peers", s.cluster_peers, errors);
+
+    parse_int(values, "message_retention_days", 0, kMax, s.message_retention_days, errors);
+    parse_int(values, "message_retention_max_rows", 0, kMax, s.message_retention_max_rows, errors);
+    parse_int(values, "retention_batch_size", 1, 1000000, s.retention_batch_size, errors);
+    parse_int(values, "retention_interval_seconds", 1, kMax, s.retention_interval_seconds, errors);
+    parse_int(values, "retention_quiet_seconds", 0, kMax, s.retention_quiet_seconds, errors);
+    parse_optional(values, "retention_archive_file", s.retention_archive_file);
+
+    parse_int(values, "history_cache_size", 1, 1000000, s.history_cache_size, errors);
+    parse_int(values, "dm_history_cache_size", 1, 1000000, s.dm_history_cache_size, errors);
+    parse_int(values, "history_line_bytes", 1, 1 << 20, s.history_line_bytes, errors);
+    parse_int(values, "history_memory_budget_mb", 1, 1 << 20, s.history_memory_budget_mb, errors);
+    parse_optional(values, "history_snapshot_file", s.history_snapshot_file);
+    parse_int(values, "history_snapshot_interval_seconds", 0, kMax, s.history_snapshot_interval_seconds, errors);
+
+    parse_string(values, "admin_user", s.admin_user);
+    parse_string(values, "admin_pass", s.admin_pass);
+    parse_int(values, "bench_accounts", 0, 1000000, s.bench_accounts, errors);
+    parse_string(values, "bench_password", s.bench_password);
+
+    // server.config has always documented idle_timeout; session_timeout wins
+    parse_int(values, "idle_timeout", 1, kMax, s.session_timeout_seconds, errors);
+    parse_int(values, "session_timeout", 1, kMax, s.session_timeout_seconds, errors);
+    parse_int(values, "shutdown_drain_seconds", 0, 3600, s.shutdown_drain_seconds, errors);
+    parse_int(values, "search_page_size", 1, 1000, s.search_page_size, errors);
+    parse_int(values, "offline_batch_size", 1, 100000, s.offline_batch_size, errors);
+    parse_int(values, "offline_max_per_user", 0, kMax, s.offline_max_per_user, errors);
+    parse_int(values, "sync_max_messages", 1, 100000, s.sync_max_messages, errors);
+
+    parse_choice(values, "log_level", {"debug", "info", "warn", "error"}, s.log_level, errors);
+    parse_choice(values, "log_overflow_policy", {"drop", "block"}, s.log_overflow_policy, errors);
+    std::string console = s.log_console ? "true" : "false";
+    parse_choice(values, "log_console", {"true", "false"}, console, errors);
+    s.log_console = console == "true";
+    int max_size_mb = static_cast<int>(s.log_max_bytes >> 20);
+    parse_int(values, "log_max_size_mb", 0, 1 << 20, max_size_mb, errors);
+    s.log_max_bytes = static_cast<uint64_t>(max_size_mb) << 20;
+    parse_int(values, "log_rotate_interval_seconds", 0, kMax, s.log_rotate_interval_seconds, errors);
+    parse_int(values, "log_max_files", 0, 100000, s.log_max_files, errors);
+
+    parse_int(values, "trace_sample_every", 0, kMax, s.trace_sample_every, errors);
+    parse_string(values, "trace_dump_dir", s.trace_dump_dir);
+    parse_string(values, "flight_dump_dir", s.flight_dump_dir);
+}
+
+void Config::publish(std::unique_ptr<Snapshot> snapshot) {
+    current_.store(snapshot.get(), std::memory_order_release);
+    snapshots_.push_back(std::move(snapshot));
+}
+
+bool Config::reload(std::vector<std::string>& errors) {
+    std::vector<std::function<void(const ServerSettings&)>> listeners;
+    const ServerSettings* applied = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(reload_mtx_);
+        auto snapshot = std::make_unique<Snapshot>();
+        if (!read_file(configFileName, snapshot->values)) {
+            errors.push_back("cannot read " + configFileName);
+            return false;
         }
+        parse_settings(snapshot->values, snapshot->settings, errors);
+        if (!errors.empty()) {
+            for (auto& error : errors) {
+                LOG_ERROR("Config reload rejected: ", error);
+            }
+            return false;
+        }
+
+        const ServerSettings& old = settings();
+        const ServerSettings& next = snapshot->settings;
+        if (next.port != old.port || next.max_connections != old.max_connections || next.workers != old.workers ||
+            next.upgrade_socket != old.upgrade_socket ||
+            next.metrics_port != old.metrics_port || next.metrics_bind_address != old.metrics_bind_address ||
+            next.tls_port != old.tls_port || next.tls_cert_file != old.tls_cert_file ||
+            next.tls_key_file != old.tls_key_file ||
+            next.node_id != old.node_id || next.cluster_port != old.cluster_port ||
+            next.message_retention_days != old.message_retention_days ||
+            next.message_retention_max_rows != old.message_retention_max_rows ||
+            next.retention_batch_size != old.retention_batch_size ||
+            next.retention_interval_seconds != old.retention_interval_seconds ||
+            next.retention_quiet_seconds != old.retention_quiet_seconds ||
+            next.retention_archive_file != old.retention_archive_file ||
+            next.history_cache_size != old.history_cache_size ||
+            next.dm_history_cache_size != old.dm_history_cache_size ||
+            next.history_line_bytes != old.history_line_bytes ||
+            next.history_memory_budget_mb != old.history_memory_budget_mb ||
+            next.history_snapshot_file != old.history_snapshot_file ||
+            next.history_snapshot_interval_seconds != old.history_snapshot_interval_seconds ||
+            next.admin_user != old.admin_user || next.admin_pass != old.admin_pass ||
+            next.bench_accounts != old.bench_accounts || next.bench_password != old.bench_password) {
+            LOG_WARN("port, max_connections, workers, upgrade_socket, metrics_*, tls_*, cluster, retention, "
+                     "history, admin and bench_* changes take effect after a restart");
+        }
+        applied = &next;
+        publish(std::move(snapshot));
+        listeners = listeners_;
     }
+    for (auto& listener : listeners) {
+        listener(*applied);
+    }
+    LOG_INFO("Reloaded configuration from ", configFileName);
+    return true;
+}
 
-    Logger::log("Loaded configuration from " + configFileName, LogLevel::INFO);
+void Config::on_reload(std::function<void(const ServerSettings&)> listener) {
+    std::lock_guard<std::mutex> lock(reload_mtx_);
+    listeners_.push_back(std::move(listener));
 }
 
 std::string Config::getValue(const std::string& key, const std::string& defaultValue) const {
-    auto it = configData.find(key);
-    return it != configData.end() ? it->second : defaultValue;
+    const Values& values = current_.load(std::memory_order_acquire)->values;
+    auto it = values.find(key);
+    return it != values.end() ? it->second : defaultValue;
 }
 
 int Config::getInt(const std::string& key, int defaultValue) const {
-    auto it = configData.find(key);
-    if (it != configData.end()) {
+    const Values& values = current_.load(std::memory_order_acquire)->values;
+    auto it = values.find(key);
+    if (it != values.end()) {
         try {
             return std::stoi(it->second);
         } catch (const std::exception& e) {
-            Logger::log("Failed to convert config value to int: " + key, LogLevel::ERROR);
+            LOG_ERROR("Failed to convert config value to int: ", key);
         }
     }
     return defaultValue;
 }
-
-void Config::reload(const std::string& filename) {
-    configFileName = filename;
-    configData.clear();
-    loadConfig();
-} 
\ No newline at end of file
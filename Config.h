@@ -2,6 +2,81 @@
 #include <string>
 #include <unordered_map>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+// A cluster_peers entry: node@host:port
+struct ClusterPeer {
+    std::string node;
+    std::string host;
+    int port = 0;
+};
+
+// Settings parsed and validated once per load. Values marked (restart) are
+// only read at startup; the rest take effect on the next /reload or SIGHUP.
+struct ServerSettings {
+    int port = 12345;                       // (restart)
+    int max_connections = 100;              // (restart)
+    int workers = 1;                        // (restart) >1 runs a Supervisor
+    std::string upgrade_socket = "chat.upgrade.sock";  // (restart) see Handoff
+    int metrics_port = 9464;                // (restart)
+    std::string metrics_bind_address = "127.0.0.1";  // (restart)
+
+    // TLS listener, all (restart); see TlsContext
+    int tls_port = 0;                       // 0 = plaintext only
+    std::string tls_cert_file = "server.crt";
+    std::string tls_key_file = "server.key";
+
+    // Federation, all (restart); see Cluster
+    std::string node_id;                    // empty = standalone
+    int cluster_port = 0;
+    std::string cluster_bind_address = "127.0.0.1";
+    std::string cluster_secret;
+    std::vector<ClusterPeer> cluster_peers;
+
+    // Message retention, all (restart); see Database::run_retention
+    int message_retention_days = 0;         // 0 = keep forever
+    int message_retention_max_rows = 0;     // 0 = unlimited
+    int retention_batch_size = 500;
+    int retention_interval_seconds = 60;
+    int retention_quiet_seconds = 30;
+    std::string retention_archive_file;     // empty = delete without archiving
+
+    // History caches, all (restart); see HistoryManager
+    int history_cache_size = 50;
+    int dm_history_cache_size = 20;
+    int history_line_bytes = 1024;
+    int history_memory_budget_mb = 64;
+    std::string history_snapshot_file = "history.snapshot";  // empty = no snapshots
+    int history_snapshot_interval_seconds = 300;  // 0 = only on shutdown
+
+    // Accounts, all (restart); see AuthManager
+    std::string admin_user = "admin";
+    std::string admin_pass = "admin123";
+    int bench_accounts = 0;
+    std::string bench_password = "bench";
+
+    int session_timeout_seconds = 300;
+    int shutdown_drain_seconds = 10;
+    int search_page_size = 20;
+    int offline_batch_size = 50;
+    int offline_max_per_user = 500;
+    int sync_max_messages = 500;
+
+    std::string log_level = "INFO";
+    std::string log_overflow_policy = "drop";
+    bool log_console = true;
+    uint64_t log_max_bytes = 100ull * 1024 * 1024;
+    int log_rotate_interval_seconds = 86400;
+    int log_max_files = 7;
+
+    int trace_sample_every = 1000;
+    std::string trace_dump_dir = ".";
+    std::string flight_dump_dir = ".";
+};
 
 class Config {
 public:
@@ -13,14 +88,41 @@ public:
     void load(const std::string& configFile);
     std::string getValue(const std::string& key, const std::string& defaultValue = "") const;
     int getInt(const std::string& key, int defaultValue = 0) const;
-    void reload(const std::string& filename);
+
+    // The current typed settings. Lock-free; the reference stays valid for
+    // the life of the process, so callers may hold it across a reload.
+    const ServerSettings& settings() const {
+        return current_.load(std::memory_order_acquire)->settings;
+    }
+
+    // Re-reads the config file and publishes it as a new snapshot. If any
+    // value fails validation the current snapshot is kept; errors describes
+    // why. Reload listeners run on the calling thread after a successful swap.
+    bool reload(std::vector<std::string>& errors);
+    void on_reload(std::function<void(const ServerSettings&)> listener);
 
 private:
-    Config() = default;
+    Config();
     Config(const Config&) = delete;
     Config& operator=(const Config&) = delete;
-    
+
+    // One immutable parse of the config file
+    struct Snapshot {
+        std::unordered_map<std::string, std::string> values;
+        ServerSettings settings;
+    };
+
+    bool read_file(const std::string& filename, std::unordered_map<std::string, std::string>& values) const;
+    static void parse_settings(const std::unordered_map<std::string, std::string>& values,
+                               ServerSettings& settings, std::vector<std::string>& errors);
+    void publish(std::unique_ptr<Snapshot> snapshot);
+
     std::string configFileName;
-    std::unordered_map<std::string, std::string> configData;
-    void loadConfig();
-}; 
\ No newline at end of file
+    std::atomic<const Snapshot*> current_;
+    // Guards reloads. Replaced snapshots are retained rather than freed, as
+    // readers hold references without synchronizing with the swap; reloads
+    // are rare and a snapshot is a few hundred bytes.
+    std::mutex reload_mtx_;
+    std::vector<std::unique_ptr<Snapshot>> snapshots_;
+    std::vector<std::function<void(const ServerSettings&)>> listeners_;
+};
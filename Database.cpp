@@ -1,5 +1,8 @@
 #include "Database.h"
 #include "Logger.h"
+#include "Config.h"
+#include "Tracer.h"
+#include "FlightRecorder.h"
 #include <sstream>
 #include <chrono>
 #include <fstream>
@@ -7,30 +10,81 @@
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 #include <iomanip>
+#include <algorithm>
+#include <ctime>
 
 static int callback(void *unused, int count, char **data, char **columns) {
     // we won't use this, just a placeholder
     return 0;
 }
 
-Database& Database::instance() {
-    static Database instance;
-    return instance;
+// Formats a time the way datetime(?, 'unixepoch') stores it (UTC)
+static std::string sql_datetime(int64_t timestamp_ms) {
+    std::time_t seconds = static_cast<std::time_t>(timestamp_ms / 1000);
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &seconds);
+#else
+    gmtime_r(&seconds, &tm);
+#endif
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
 }
 
-Database::Database() : db_(nullptr), running_(false) {
-    int rc = sqlite3_open("chat.db", &db_);
+// Runs a single-value query, returning 0 when there is no row or NULL.
+static sqlite3_int64 query_int64(sqlite3 *db, const std::string &sql) {
+    sqlite3_int64 value = 0;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+Database::Database()
+    : db_(nullptr),
+      fts_available_(false),
+      retention_pending_(false),
+      needs_compaction_(false),
+      queue_depth_(Metrics::getInstance().gauge("chat_db_queue_depth", "Messages waiting for the DB batch writer")),
+      batch_commit_time_(Metrics::getInstance().histogram("chat_db_batch_commit_seconds",
+                                                          "Time to insert and commit one message batch")),
+      messages_persisted_(Metrics::getInstance().counter("chat_db_messages_persisted_total",
+                                                         "Messages written to the database")),
+      own_sequence_(1),
+      sequence_(&own_sequence_),
+      running_(false) {
+    int rc = sqlite3_open(path_().c_str(), &db_);
     if (rc) {
-        Logger::log("Can't open database: " + std::string(sqlite3_errmsg(db_)), LogLevel::ERROR);
+        LOG_ERROR("Can't open database: ", sqlite3_errmsg(db_));
         return;
     }
+    // Worker processes share the file; wait out each other's write locks
+    sqlite3_busy_timeout(db_, 5000);
+
+    // WAL lets readers run alongside the aggregator; incremental auto-vacuum
+    // (effective for newly created files) lets retention give space back.
+    exec_sql("PRAGMA auto_vacuum = INCREMENTAL;");
+    exec_sql("PRAGMA journal_mode = WAL;");
 
     // Create tables if they don't exist
     exec_sql("CREATE TABLE IF NOT EXISTS messages ("
              "id INTEGER PRIMARY KEY AUTOINCREMENT,"
              "username TEXT NOT NULL,"
              "message TEXT NOT NULL,"
-             "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP);");
+             "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,"
+             "conversation TEXT NOT NULL DEFAULT 'global',"
+             "recipient TEXT);");
+    migrate_schema("main");
+
+    // Per-conversation history reads (cache fills)
+    exec_sql("CREATE INDEX IF NOT EXISTS idx_messages_conversation ON messages (conversation, id);");
+
+    // Used by retention to find the newest expired row
+    exec_sql("CREATE INDEX IF NOT EXISTS idx_messages_timestamp ON messages (timestamp);");
 
     exec_sql("CREATE TABLE IF NOT EXISTS offline_messages ("
              "id INTEGER PRIMARY KEY AUTOINCREMENT,"
@@ -38,11 +92,28 @@ Database::Database() : db_(nullptr), running_(false) {
              "message TEXT NOT NULL,"
              "timestamp DATETIME DEFAULT CURRENT_TIMESTAMP);");
 
+    // Mailbox reads are always by recipient in arrival order
+    exec_sql("CREATE INDEX IF NOT EXISTS idx_offline_messages_to_user "
+             "ON offline_messages (to_user, id);");
+
+    // Highest seq each user acknowledged, the default for /sync
+    exec_sql("CREATE TABLE IF NOT EXISTS acks ("
+             "username TEXT PRIMARY KEY,"
+             "seq INTEGER NOT NULL);");
+
     exec_sql("CREATE TABLE IF NOT EXISTS users ("
              "username TEXT PRIMARY KEY,"
              "salt TEXT NOT NULL,"
              "password_hash TEXT NOT NULL);");
 
+    // Continue after every id ever used, including rows retention removed
+    sqlite3_int64 last_id = std::max(
+        query_int64(db_, "SELECT IFNULL(MAX(id), 0) FROM messages;"),
+        query_int64(db_, "SELECT IFNULL(MAX(seq), 0) FROM sqlite_sequence WHERE name = 'messages';"));
+    own_sequence_.store(static_cast<uint64_t>(last_id) + 1, std::memory_order_relaxed);
+
+    init_fts();
+    load_retention_policy();
     loadUsers();
     running_ = true;
     aggregator_thread_ = std::thread(&Database::db_aggregator_main, this);
@@ -58,116 +129,745 @@ Database::~Database() {
 bool Database::exec_sql(const std::string &sql) {
     char *errmsg = nullptr;
     if (sqlite3_exec(db_, sql.c_str(), callback, 0, &errmsg) != SQLITE_OK) {
-        Logger::instance().log(LogLevel::ERROR, "SQL error: " + std::string(errmsg));
+        LOG_ERROR("SQL error: ", errmsg);
+        FlightRecorder::record(FlightEvent::DbError, 0, static_cast<uint64_t>(sqlite3_errcode(db_)), sql);
         sqlite3_free(errmsg);
         return false;
     }
     return true;
 }
 
-void Database::log_message(const std::string &username, const std::string &message) {
+void Database::migrate_schema(const std::string &schema) {
+    // Databases (and archives) created before conversations existed lack
+    // these columns
+    bool has_conversation = false;
+    sqlite3_stmt *stmt = nullptr;
+    std::string table_info = "PRAGMA " + schema + ".table_info(messages);";
+    if (sqlite3_prepare_v2(db_, table_info.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *name = sqlite3_column_text(stmt, 1);
+            if (name && std::string((const char*)name) == "conversation") {
+                has_conversation = true;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (!has_conversation) {
+        LOG_INFO("Adding conversation columns to ", schema, ".messages table");
+        exec_sql("ALTER TABLE " + schema + ".messages ADD COLUMN conversation TEXT NOT NULL DEFAULT 'global';");
+        exec_sql("ALTER TABLE " + schema + ".messages ADD COLUMN recipient TEXT;");
+    }
+}
+
+std::string Database::conversation_key(const std::string &sender, const std::string &recipient) {
+    if (recipient.empty()) {
+        return kGlobalConversation;
+    }
+    // Usernames never contain spaces, so the pair is unambiguous
+    return sender < recipient ? "dm:" + sender + " " + recipient
+                              : "dm:" + recipient + " " + sender;
+}
+
+void Database::share_sequence(std::atomic<uint64_t> *counter) {
+    std::atomic<uint64_t> &target = counter ? *counter : own_sequence_;
+    uint64_t next = sequence_->load(std::memory_order_relaxed);
+    uint64_t current = target.load(std::memory_order_relaxed);
+    while (current < next && !target.compare_exchange_weak(current, next, std::memory_order_relaxed)) {
+    }
+    sequence_ = &target;
+}
+
+void Database::log_message(const MessagePtr &message) {
     // Instead of writing directly, we push to a queue
+    TraceSpan span("db.enqueue");
+    DBMessage msg{message};
+    if ((msg.trace_id = Tracer::current()) != 0) {
+        msg.queued_ns = Tracer::now_ns();
+    }
     {
         std::lock_guard<std::mutex> lock(queue_mtx_);
-        message_queue_.push({username, message});
+        message_queue_.push_back(std::move(msg));
+        queue_depth_.set(static_cast<int64_t>(message_queue_.size()));
     }
     queue_cv_.notify_one();
 }
 
 void Database::db_aggregator_main() {
+    Tracer::getInstance().name_thread("db-aggregator");
+    FlightRecorder::getInstance().name_thread("db-aggregator");
     // Batches messages every 2 seconds or so
-    while (running_) {
+    for (;;) {
         std::unique_lock<std::mutex> lock(queue_mtx_);
-        if (message_queue_.empty()) {
+        if (message_queue_.empty() && !retention_pending_ && running_) {
             // Wait until there's a message or we time out
             queue_cv_.wait_for(lock, std::chrono::seconds(2));
         }
+        // Messages queued before stop_aggregator() were acknowledged to
+        // their senders, so the last pass still commits them
+        bool stopping = !running_;
 
-        if (!running_) break;
-
-        // Gather all messages currently in the queue
-        std::vector<DBMessage> batch;
-        while (!message_queue_.empty()) {
-            batch.push_back(message_queue_.front());
-            message_queue_.pop();
-        }
+        // Gather all messages currently in the queue. They stay visible to
+        // messages_since() in in_flight_ until committed; only this thread
+        // modifies it, so it is read here without the lock.
+        std::move(message_queue_.begin(), message_queue_.end(), std::back_inserter(in_flight_));
+        message_queue_.clear();
+        queue_depth_.set(0);
         lock.unlock();
 
-        if (!batch.empty() && db_) {
-            // Perform a transaction to insert them
-            const char *begin_tx = "BEGIN TRANSACTION;";
-            const char *commit_tx = "COMMIT;";
-            sqlite3_exec(db_, begin_tx, 0, 0, nullptr);
-
-            std::string sql = "INSERT INTO messages (username, message) VALUES (?, ?);";
-            for (auto &msg : batch) {
-                sqlite3_stmt *stmt = nullptr;
-                if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-                    sqlite3_bind_text(stmt, 1, msg.username.c_str(), -1, SQLITE_STATIC);
-                    sqlite3_bind_text(stmt, 2, msg.message.c_str(), -1, SQLITE_STATIC);
-                    if (sqlite3_step(stmt) != SQLITE_DONE) {
-                        Logger::instance().log(LogLevel::ERROR, "Failed to execute batch insert.");
-                    }
+        auto now = std::chrono::steady_clock::now();
+        bool flushed = true;
+        if (db_ && !in_flight_.empty()) {
+            // Another worker may hold the write lock past the busy timeout;
+            // the batch then stays in flight and is retried on the next pass
+            // (the last pass retries a few times before giving up on it)
+            flushed = flush_batch(in_flight_);
+            for (int attempt = 1; !flushed && stopping && attempt < 3; ++attempt) {
+                flushed = flush_batch(in_flight_);
+            }
+            if (flushed) {
+                // Inserts grow the WAL and add FTS segments too, so quiet
+                // maintenance runs whether or not retention is enabled
+                last_write_ = now;
+                needs_compaction_ = true;
+                if (stopping) {
+                    LOG_INFO("Flushed ", in_flight_.size(), " queued messages to the database");
                 }
-                sqlite3_finalize(stmt);
+            } else if (stopping) {
+                LOG_ERROR("Could not flush ", in_flight_.size(), " queued messages, they are lost");
+                flushed = true;
+            } else {
+                LOG_WARN("Database busy, retrying ", in_flight_.size(), " queued messages");
+            }
+        }
+        if (flushed) {
+            lock.lock();
+            in_flight_.clear();
+            lock.unlock();
+        }
+
+        if (!db_) {
+            if (stopping) break;
+            continue;
+        }
+        if (stopping) break;
+
+        // Retention runs between flushes on this thread, a bounded slice at a
+        // time, so it never competes with inserts for the write lock
+        if (retention_pending_ || now >= next_retention_) {
+            retention_pending_ = run_retention(std::chrono::milliseconds(50));
+            if (!retention_pending_) {
+                next_retention_ = now + std::chrono::seconds(retention_.interval_seconds);
+            }
+        }
+        if (needs_compaction_ && !retention_pending_ &&
+            now - last_write_ >= std::chrono::seconds(retention_.quiet_seconds)) {
+            run_quiet_maintenance();
+        }
+    }
+}
+
+bool Database::flush_batch(const std::vector<DBMessage> &batch) {
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    ScopedTimer timer(batch_commit_time_);
+    // One transaction per batch; the FTS index is updated in the same
+    // transaction so it never lags behind the messages table. IMMEDIATE
+    // takes the write lock up front, waiting out other workers' commits; a
+    // deferred one would fail outright when its snapshot went stale.
+    if (!exec_sql("BEGIN IMMEDIATE;")) {
+        return false;
+    }
+
+    sqlite3_stmt *insert_stmt = nullptr;
+    sqlite3_stmt *fts_stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, "INSERT INTO messages (username, message, conversation, recipient, timestamp, id) "
+                                "VALUES (?, ?, ?, ?, datetime(?, 'unixepoch'), ?);",
+                           -1, &insert_stmt, nullptr) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare batch insert: ", sqlite3_errmsg(db_));
+        FlightRecorder::record(FlightEvent::DbError, 0, static_cast<uint64_t>(sqlite3_errcode(db_)), "prepare insert");
+        sqlite3_exec(db_, "ROLLBACK;", 0, 0, nullptr);
+        return true;    // not transient, a retry would fail the same way
+    }
+    if (fts_available_ &&
+        sqlite3_prepare_v2(db_, "INSERT INTO messages_fts (rowid, message, username) VALUES (?, ?, ?);",
+                           -1, &fts_stmt, nullptr) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare FTS insert: ", sqlite3_errmsg(db_));
+        fts_stmt = nullptr;
+    }
+
+    std::string conversation;
+    for (auto &msg : batch) {
+        const Message &m = *msg.message;
+        std::string_view sender = m.sender(), body = m.body(), target = m.target();
+        conversation = conversation_key(std::string(sender), std::string(target));
+        sqlite3_bind_text(insert_stmt, 1, sender.data(), static_cast<int>(sender.size()), SQLITE_STATIC);
+        sqlite3_bind_text(insert_stmt, 2, body.data(), static_cast<int>(body.size()), SQLITE_STATIC);
+        sqlite3_bind_text(insert_stmt, 3, conversation.c_str(), -1, SQLITE_STATIC);
+        if (target.empty()) {
+            sqlite3_bind_null(insert_stmt, 4);
+        } else {
+            sqlite3_bind_text(insert_stmt, 4, target.data(), static_cast<int>(target.size()), SQLITE_STATIC);
+        }
+        sqlite3_bind_int64(insert_stmt, 5, m.timestamp_ms() / 1000);
+        if (m.seq()) {
+            sqlite3_bind_int64(insert_stmt, 6, static_cast<sqlite3_int64>(m.seq()));
+        } else {
+            sqlite3_bind_null(insert_stmt, 6);
+        }
+        if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
+            LOG_ERROR("Failed to execute batch insert: ", sqlite3_errmsg(db_));
+            FlightRecorder::record(FlightEvent::DbError, 0, static_cast<uint64_t>(sqlite3_errcode(db_)),
+                                   std::string(sender));
+        } else if (fts_stmt) {
+            sqlite3_bind_int64(fts_stmt, 1, sqlite3_last_insert_rowid(db_));
+            sqlite3_bind_text(fts_stmt, 2, body.data(), static_cast<int>(body.size()), SQLITE_STATIC);
+            sqlite3_bind_text(fts_stmt, 3, sender.data(), static_cast<int>(sender.size()), SQLITE_STATIC);
+            if (sqlite3_step(fts_stmt) != SQLITE_DONE) {
+                LOG_ERROR("Failed to index message for search.");
             }
-            sqlite3_exec(db_, commit_tx, 0, 0, nullptr);
+            sqlite3_reset(fts_stmt);
+        }
+        sqlite3_reset(insert_stmt);
+    }
+    sqlite3_finalize(insert_stmt);
+    sqlite3_finalize(fts_stmt);
+    // A failed COMMIT (e.g. busy or out of disk) leaves the transaction
+    // open; roll it back and keep the batch in flight for the next pass
+    if (!exec_sql("COMMIT;")) {
+        sqlite3_exec(db_, "ROLLBACK;", 0, 0, nullptr);
+        return false;
+    }
+    messages_persisted_.inc(batch.size());
+    FlightRecorder::record(FlightEvent::DbFlush, 0, batch.size());
+
+    int64_t committed_ns = 0;
+    for (auto &msg : batch) {
+        if (msg.trace_id) {
+            if (!committed_ns) committed_ns = Tracer::now_ns();
+            Tracer::getInstance().record(msg.trace_id, "db.persist", msg.queued_ns, committed_ns, true);
         }
     }
+    return true;
 }
 
-std::string Database::get_chat_history() {
-    std::lock_guard<std::mutex> lock(queue_mtx_);
-    if (!db_) {
-        return "Database not available.\n";
+void Database::load_retention_policy() {
+    const ServerSettings &settings = Config::getInstance().settings();
+    retention_.max_age_days = settings.message_retention_days;
+    retention_.max_rows = settings.message_retention_max_rows;
+    retention_.batch_size = settings.retention_batch_size;
+    retention_.interval_seconds = settings.retention_interval_seconds;
+    retention_.quiet_seconds = settings.retention_quiet_seconds;
+    retention_.archive_file = settings.retention_archive_file;
+
+    if (!retention_.archive_file.empty()) {
+        std::string attach = "ATTACH DATABASE '";
+        for (char c : retention_.archive_file) {
+            if (c == '\'') attach += '\'';
+            attach += c;
+        }
+        attach += "' AS archive;";
+        if (!exec_sql(attach) ||
+            !exec_sql("CREATE TABLE IF NOT EXISTS archive.messages ("
+                      "id INTEGER PRIMARY KEY,"
+                      "username TEXT NOT NULL,"
+                      "message TEXT NOT NULL,"
+                      "timestamp DATETIME,"
+                      "conversation TEXT NOT NULL DEFAULT 'global',"
+                      "recipient TEXT);")) {
+            LOG_WARN("Archive unavailable, expired messages will be deleted");
+            retention_.archive_file.clear();
+        } else {
+            migrate_schema("archive");
+        }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    next_retention_ = now;
+    last_write_ = now;
+    if (retention_.max_age_days > 0 || retention_.max_rows > 0) {
+        LOG_INFO("Message retention: max_age_days=", retention_.max_age_days,
+                 ", max_rows=", retention_.max_rows,
+                 retention_.archive_file.empty() ? "" : ", archive=", retention_.archive_file);
+    }
+}
+
+bool Database::run_retention(std::chrono::milliseconds budget) {
+    if (retention_.max_age_days <= 0 && retention_.max_rows <= 0) {
+        return false;
+    }
+    // Steps until nothing is left to prune or the slice is used up; the
+    // caller resumes after the next flush when this returns true
+    auto deadline = std::chrono::steady_clock::now() + budget;
+    while (running_) {
+        if (retention_step() < retention_.batch_size) {
+            return false;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int Database::retention_step() {
+    std::lock_guard<std::mutex> lock(db_mtx_);
+
+    // Ids increase with time, so every expired row lies at or below a single
+    // cutoff id and pruning can proceed in contiguous id ranges
+    sqlite3_int64 cutoff = 0;
+    if (retention_.max_rows > 0) {
+        // The newest row beyond the max_rows kept. Ids have gaps (seqs are
+        // also spent on lines that are never stored here), so MAX(id) minus
+        // max_rows would keep too few.
+        cutoff = query_int64(db_, "SELECT id FROM messages ORDER BY id DESC LIMIT 1 OFFSET " +
+                                  std::to_string(retention_.max_rows) + ";");
+    }
+    if (retention_.max_age_days > 0) {
+        sqlite3_int64 aged = query_int64(db_,
+            "SELECT id FROM messages WHERE timestamp < datetime('now', '-" +
+            std::to_string(retention_.max_age_days) + " days') "
+            "ORDER BY timestamp DESC LIMIT 1;");
+        cutoff = std::max(cutoff, aged);
+    }
+    if (cutoff <= 0) {
+        return 0;
+    }
+
+    sqlite3_int64 lower = query_int64(db_, "SELECT IFNULL(MIN(id), 0) FROM messages;");
+    if (lower == 0 || lower > cutoff) {
+        return 0;
+    }
+    sqlite3_int64 upper = std::min(cutoff, lower + retention_.batch_size - 1);
+    std::string range = " FROM messages WHERE id BETWEEN " + std::to_string(lower) +
+                        " AND " + std::to_string(upper) + ";";
+
+    if (!exec_sql("BEGIN IMMEDIATE;")) {
+        LOG_ERROR("Retention step could not start, will retry next interval");
+        return 0;
+    }
+    bool ok = true;
+    if (!retention_.archive_file.empty()) {
+        // OR IGNORE: a range copied before a crash may be copied again
+        ok = exec_sql("INSERT OR IGNORE INTO archive.messages "
+                      "(id, username, message, timestamp, conversation, recipient) "
+                      "SELECT id, username, message, timestamp, conversation, recipient" + range);
+    }
+    if (ok && fts_available_) {
+        ok = exec_sql("INSERT INTO messages_fts (messages_fts, rowid, message, username) "
+                      "SELECT 'delete', id, message, username" + range);
+    }
+    int deleted = 0;
+    if (ok) {
+        ok = exec_sql("DELETE" + range);
+        deleted = sqlite3_changes(db_);
+    }
+    if (!ok) {
+        sqlite3_exec(db_, "ROLLBACK;", 0, 0, nullptr);
+        LOG_ERROR("Retention step failed, will retry next interval");
+        return 0;
     }
-    std::string history;
-    const char *sql = "SELECT timestamp, username, message FROM messages ORDER BY id ASC;";
+    if (!exec_sql("COMMIT;")) {
+        sqlite3_exec(db_, "ROLLBACK;", 0, 0, nullptr);
+        LOG_ERROR("Retention step could not commit, will retry next interval");
+        return 0;
+    }
+
+    // Ranges left empty by earlier deletes still count as progress
+    int pruned = static_cast<int>(upper - lower + 1);
+    if (deleted > 0) {
+        needs_compaction_ = true;
+        LOG_DEBUG("Retention pruned ", deleted, " messages");
+    }
+    return pruned;
+}
+
+void Database::run_quiet_maintenance() {
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    // Bounded work only: merge a few FTS segments, release some free pages
+    // and truncate the WAL
+    if (fts_available_) {
+        exec_sql("INSERT INTO messages_fts (messages_fts, rank) VALUES ('merge', 500);");
+    }
+    exec_sql("PRAGMA incremental_vacuum(2000);");
+    exec_sql("PRAGMA wal_checkpoint(TRUNCATE);");
+    needs_compaction_ = false;
+    LOG_DEBUG("Database compaction completed");
+}
+
+std::vector<StoredMessage> Database::recent_messages(const std::string &conversation, int limit) {
+    std::vector<StoredMessage> results;
+    // Unwritten messages first, as in messages_since, so a cache filled from
+    // this has lines the batch writer hasn't committed yet
+    {
+        std::lock_guard<std::mutex> lock(queue_mtx_);
+        auto add_pending = [&](const DBMessage &msg) {
+            const Message &m = *msg.message;
+            if (!m.seq() ||
+                conversation_key(std::string(m.sender()), std::string(m.target())) != conversation) {
+                return;
+            }
+            StoredMessage row;
+            row.id = static_cast<sqlite3_int64>(m.seq());
+            row.timestamp = sql_datetime(m.timestamp_ms());
+            row.username = std::string(m.sender());
+            row.recipient = std::string(m.target());
+            row.message = std::string(m.body());
+            results.push_back(std::move(row));
+        };
+        for (auto &msg : in_flight_) add_pending(msg);
+        for (auto &msg : message_queue_) add_pending(msg);
+    }
+    if (!db_) return results;
+
+    std::unique_lock<std::mutex> lock(db_mtx_);
+    const char *sql = "SELECT id, timestamp, username, recipient, message FROM messages "
+                      "WHERE conversation = ? ORDER BY id DESC LIMIT ?;";
     sqlite3_stmt *stmt = nullptr;
     if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return "Failed to retrieve history.\n";
+        LOG_ERROR("Failed to read conversation: ", sqlite3_errmsg(db_));
+        return results;
     }
+    sqlite3_bind_text(stmt, 1, conversation.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit);
     while (sqlite3_step(stmt) == SQLITE_ROW) {
+        StoredMessage row;
+        row.id = sqlite3_column_int64(stmt, 0);
+        for (int col = 1; col < 5; ++col) {
+            const unsigned char *text = sqlite3_column_text(stmt, col);
+            std::string value = text ? (const char*)text : "";
+            switch (col) {
+                case 1: row.timestamp = std::move(value); break;
+                case 2: row.username = std::move(value); break;
+                case 3: row.recipient = std::move(value); break;
+                default: row.message = std::move(value); break;
+            }
+        }
+        results.push_back(std::move(row));
+    }
+    sqlite3_finalize(stmt);
+    lock.unlock();
+
+    // A message written while we looked may have been found twice
+    std::sort(results.begin(), results.end(),
+              [](const StoredMessage &a, const StoredMessage &b) { return a.id < b.id; });
+    results.erase(std::unique(results.begin(), results.end(),
+                              [](const StoredMessage &a, const StoredMessage &b) { return a.id == b.id; }),
+                  results.end());
+    if (results.size() > static_cast<size_t>(limit)) {
+        results.erase(results.begin(), results.end() - limit);
+    }
+    return results;
+}
+
+sqlite3_int64 Database::last_message_id() {
+    if (!db_) return 0;
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    return query_int64(db_, "SELECT IFNULL(MAX(id), 0) FROM messages;");
+}
+
+bool Database::conversations_since(sqlite3_int64 after_id, int max_rows, std::vector<std::string> &out) {
+    if (!db_) return false;
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    std::string since = " FROM messages WHERE id > " + std::to_string(after_id);
+    if (query_int64(db_, "SELECT COUNT(*)" + since + ";") > max_rows) {
+        return false;
+    }
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, ("SELECT DISTINCT conversation" + since + ";").c_str(),
+                           -1, &stmt, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *conversation = sqlite3_column_text(stmt, 0);
+        if (conversation) {
+            out.push_back((const char*)conversation);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+std::vector<MessagePtr> Database::messages_since(const std::string &viewer, uint64_t after, bool include_room,
+                                                 int limit) {
+    std::vector<MessagePtr> results;
+    auto visible = [&](const Message &m) {
+        if (m.seq() <= after) return false;
+        if (!m.is_private()) return include_room;
+        return m.target() == viewer || m.sender() == viewer;
+    };
+    // Unwritten messages first: a row can't be committed between this and
+    // the query below without having been in one of these lists
+    {
+        std::lock_guard<std::mutex> lock(queue_mtx_);
+        for (auto &msg : in_flight_) {
+            if (visible(*msg.message)) results.push_back(msg.message);
+        }
+        for (auto &msg : message_queue_) {
+            if (visible(*msg.message)) results.push_back(msg.message);
+        }
+    }
+
+    if (db_) {
+        std::lock_guard<std::mutex> lock(db_mtx_);
+        std::string sql = "SELECT id, strftime('%s', timestamp), username, recipient, message FROM messages "
+                          "WHERE id > ? AND (";
+        sql += include_room ? "recipient IS NULL OR " : "";
+        sql += "recipient = ? OR (username = ? AND recipient IS NOT NULL)) ORDER BY id LIMIT ?;";
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_ERROR("Failed to read messages since ", after, ": ", sqlite3_errmsg(db_));
+        } else {
+            sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(after));
+            sqlite3_bind_text(stmt, 2, viewer.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, viewer.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 4, limit);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                auto text = [stmt](int col) {
+                    const unsigned char *value = sqlite3_column_text(stmt, col);
+                    return value ? std::string_view((const char*)value,
+                                                    static_cast<size_t>(sqlite3_column_bytes(stmt, col)))
+                                 : std::string_view();
+                };
+                results.push_back(Message::create(text(2), text(3), text(4),
+                                                  static_cast<uint64_t>(sqlite3_column_int64(stmt, 0)),
+                                                  sqlite3_column_int64(stmt, 1) * 1000));
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    // A message written while we looked may have been found twice
+    std::sort(results.begin(), results.end(),
+              [](const MessagePtr &a, const MessagePtr &b) { return a->seq() < b->seq(); });
+    results.erase(std::unique(results.begin(), results.end(),
+                              [](const MessagePtr &a, const MessagePtr &b) { return a->seq() == b->seq(); }),
+                  results.end());
+    if (results.size() > static_cast<size_t>(limit)) {
+        results.resize(static_cast<size_t>(limit));
+    }
+    return results;
+}
+
+void Database::store_ack(const std::string &username, uint64_t seq) {
+    if (!db_) return;
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, "INSERT INTO acks (username, seq) VALUES (?, ?) "
+                                "ON CONFLICT(username) DO UPDATE SET seq = MAX(seq, excluded.seq);",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(seq));
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            LOG_ERROR("Failed to store ack for ", username, ": ", sqlite3_errmsg(db_));
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+uint64_t Database::load_ack(const std::string &username) {
+    if (!db_) return 0;
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    uint64_t seq = 0;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, "SELECT seq FROM acks WHERE username = ?;", -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            seq = static_cast<uint64_t>(sqlite3_column_int64(stmt, 0));
+        }
+    }
+    sqlite3_finalize(stmt);
+    return seq;
+}
+
+// Turns free text into an FTS5 query: every whitespace-separated term is
+// quoted so user input can't inject FTS syntax, and a trailing '*' on a
+// term is kept as a prefix match. Terms are implicitly AND-ed.
+static std::string to_fts_query(const std::string &terms) {
+    std::istringstream iss(terms);
+    std::string term, query;
+    while (iss >> term) {
+        bool prefix = term.size() > 1 && term.back() == '*';
+        if (prefix) term.pop_back();
+        std::string quoted = "\"";
+        for (char c : term) {
+            if (c == '"') quoted += '"';
+            quoted += c;
+        }
+        quoted += "\"";
+        if (prefix) quoted += "*";
+        if (!query.empty()) query += " ";
+        query += quoted;
+    }
+    return query;
+}
+
+void Database::init_fts() {
+    if (!db_) return;
+    // External-content FTS5 table over messages; rows are added by the
+    // batch aggregator (see flush_batch), so no triggers are needed.
+    fts_available_ = exec_sql("CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5("
+                              "message, username UNINDEXED,"
+                              "content='messages', content_rowid='id');");
+    if (!fts_available_) {
+        LOG_WARN("FTS5 unavailable, /search will fall back to table scans");
+        return;
+    }
+
+    // Rebuild the index if it is behind the messages table (first run on an
+    // existing chat.db, or rows written by an older build).
+    const char *sql = "SELECT (SELECT IFNULL(MAX(id), 0) FROM messages) != "
+                      "(SELECT IFNULL(MAX(id), 0) FROM messages_fts_docsize);";
+    sqlite3_stmt *stmt = nullptr;
+    bool stale = false;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        stale = sqlite3_column_int(stmt, 0) != 0;
+    }
+    sqlite3_finalize(stmt);
+    if (stale) {
+        LOG_INFO("Rebuilding full-text search index...");
+        exec_sql("INSERT INTO messages_fts(messages_fts) VALUES('rebuild');");
+    }
+}
+
+std::vector<std::string> Database::search_messages(const SearchQuery &query, std::vector<uint64_t> *seqs) {
+    std::vector<std::string> results;
+    if (!db_) return results;
+
+    std::string match = to_fts_query(query.terms);
+    if (match.empty()) return results;
+
+    std::string until = query.until;
+    if (until.size() == 10) {
+        until += " 23:59:59"; // date only: include the whole day
+    }
+
+    // Ranked via bm25 when the index exists, newest-first scan otherwise.
+    std::string sql;
+    if (fts_available_) {
+        sql = "SELECT m.timestamp, m.username, m.message, m.recipient, m.id FROM messages_fts "
+              "JOIN messages m ON m.id = messages_fts.rowid "
+              "WHERE messages_fts MATCH ?1";
+    } else {
+        sql = "SELECT m.timestamp, m.username, m.message, m.recipient, m.id FROM messages m "
+              "WHERE m.message LIKE '%' || ?1 || '%'";
+    }
+    // Private messages are visible only to their two participants
+    sql += " AND (m.recipient IS NULL OR m.username = ?7 OR m.recipient = ?7)";
+    if (!query.user.empty())  sql += " AND m.username = ?2";
+    if (!query.since.empty()) sql += " AND m.timestamp >= ?3";
+    if (!until.empty())       sql += " AND m.timestamp <= ?4";
+    sql += fts_available_ ? " ORDER BY messages_fts.rank" : " ORDER BY m.id DESC";
+    sql += " LIMIT ?5 OFFSET ?6;";
+
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare search: ", sqlite3_errmsg(db_));
+        return results;
+    }
+    const std::string &needle = fts_available_ ? match : query.terms;
+    sqlite3_bind_text(stmt, 1, needle.c_str(), -1, SQLITE_STATIC);
+    if (!query.user.empty())  sqlite3_bind_text(stmt, 2, query.user.c_str(), -1, SQLITE_STATIC);
+    if (!query.since.empty()) sqlite3_bind_text(stmt, 3, query.since.c_str(), -1, SQLITE_STATIC);
+    if (!until.empty())       sqlite3_bind_text(stmt, 4, until.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 5, query.page_size);
+    sqlite3_bind_int(stmt, 6, query.page * query.page_size);
+    sqlite3_bind_text(stmt, 7, query.viewer.c_str(), -1, SQLITE_STATIC);
+
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
         const unsigned char *timestamp = sqlite3_column_text(stmt, 0);
         const unsigned char *username = sqlite3_column_text(stmt, 1);
         const unsigned char *message = sqlite3_column_text(stmt, 2);
-        history += (timestamp ? (const char*)timestamp : "") ;
-        history += " ";
-        history += (username ? (const char*)username : "");
-        history += ": ";
-        history += (message ? (const char*)message : "");
-        history += "\n";
+        const unsigned char *recipient = sqlite3_column_text(stmt, 3);
+        std::string line = timestamp ? (const char*)timestamp : "";
+        line += " ";
+        if (recipient) {
+            line += "[Private to " + std::string((const char*)recipient) + "] ";
+        }
+        line += username ? (const char*)username : "";
+        line += ": ";
+        line += message ? (const char*)message : "";
+        results.push_back(std::move(line));
+        if (seqs) seqs->push_back(static_cast<uint64_t>(sqlite3_column_int64(stmt, 4)));
+    }
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Search failed: ", sqlite3_errmsg(db_));
+    }
+    sqlite3_finalize(stmt);
+    return results;
+}
+
+// Counts a user's mailbox using the (to_user, id) index. Caller holds db_mtx_.
+static int count_mailbox(sqlite3 *db, const std::string &username) {
+    int count = 0;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM offline_messages WHERE to_user = ?;",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            count = sqlite3_column_int(stmt, 0);
+        }
     }
     sqlite3_finalize(stmt);
-    return history;
+    return count;
 }
 
-void Database::store_offline_message(const std::string &to_user, const std::string &message) {
+bool Database::store_offline_message(const std::string &to_user, const std::string &message) {
     // Immediate insert for offline messages
-    if (!db_) return;
-    std::lock_guard<std::mutex> lock(queue_mtx_);
-    std::string sql = "INSERT INTO offline_msgs (to_user, message) VALUES (?, ?);";
+    if (!db_) return false;
+    std::lock_guard<std::mutex> lock(db_mtx_);
+
+    // Cap check and insert in one transaction so concurrent senders can't
+    // push a mailbox past the limit
+    if (!exec_sql("BEGIN IMMEDIATE;")) {
+        LOG_ERROR("Failed to store offline message for ", to_user);
+        return false;
+    }
+    int max_per_user = Config::getInstance().settings().offline_max_per_user;
+    if (max_per_user > 0 && count_mailbox(db_, to_user) >= max_per_user) {
+        sqlite3_exec(db_, "ROLLBACK;", 0, 0, nullptr);
+        LOG_WARN("Offline mailbox full for user: ", to_user);
+        return false;
+    }
+
+    bool stored = false;
+    std::string sql = "INSERT INTO offline_messages (to_user, message) VALUES (?, ?);";
     sqlite3_stmt *stmt = nullptr;
     if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_text(stmt, 1, to_user.c_str(), -1, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 2, message.c_str(), -1, SQLITE_STATIC);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            Logger::instance().log(LogLevel::ERROR, "Failed to store offline message.");
+        stored = sqlite3_step(stmt) == SQLITE_DONE;
+        if (!stored) {
+            LOG_ERROR("Failed to store offline message.");
         }
     }
     sqlite3_finalize(stmt);
+    sqlite3_exec(db_, stored ? "COMMIT;" : "ROLLBACK;", 0, 0, nullptr);
+    return stored;
 }
 
-std::vector<std::string> Database::retrieve_offline_messages(const std::string &username) {
+std::vector<std::string> Database::drain_offline_messages(const std::string &username, int max_count) {
     std::vector<std::string> results;
     if (!db_) return results;
 
-    std::lock_guard<std::mutex> lock(queue_mtx_);
-    std::string sql = "SELECT id, message FROM offline_msgs WHERE to_user = ?;";
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    // Fetch and delete in one transaction. The delete is bounded by the last
+    // id we read, so messages stored meanwhile stay for the next drain.
+    if (!exec_sql("BEGIN IMMEDIATE;")) {
+        LOG_ERROR("Failed to drain offline messages for ", username);
+        return results;     // the mailbox stays for the next drain
+    }
+
+    sqlite3_int64 last_id = -1;
+    std::string sql = "SELECT id, message FROM offline_messages WHERE to_user = ? "
+                      "ORDER BY id LIMIT ?;";
     sqlite3_stmt *stmt = nullptr;
     if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, max_count);
         while (sqlite3_step(stmt) == SQLITE_ROW) {
+            last_id = sqlite3_column_int64(stmt, 0);
             const unsigned char *msg_text = sqlite3_column_text(stmt, 1);
             if (msg_text) {
                 results.push_back((const char*)msg_text);
@@ -175,23 +875,85 @@ std::vector<std::string> Database::retrieve_offline_messages(const std::string &
         }
     }
     sqlite3_finalize(stmt);
+
+    bool ok = true;
+    if (last_id >= 0) {
+        sql = "DELETE FROM offline_messages WHERE to_user = ? AND id <= ?;";
+        stmt = nullptr;
+        ok = false;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 2, last_id);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    if (ok) {
+        sqlite3_exec(db_, "COMMIT;", 0, 0, nullptr);
+    } else {
+        // Leave the mailbox intact rather than deliver twice
+        LOG_ERROR("Failed to drain offline messages for ", username);
+        sqlite3_exec(db_, "ROLLBACK;", 0, 0, nullptr);
+        results.clear();
+    }
     return results;
 }
 
-void Database::clear_offline_messages(const std::string &username) {
-    if (!db_) return;
-    std::lock_guard<std::mutex> lock(queue_mtx_);
-    std::string sql = "DELETE FROM offline_msgs WHERE to_user = ?;";
+std::vector<std::pair<sqlite3_int64, std::string>> Database::peek_offline_messages(const std::string &username,
+                                                                                   int max_count) {
+    std::vector<std::pair<sqlite3_int64, std::string>> results;
+    if (!db_) return results;
+
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    std::string sql = "SELECT id, message FROM offline_messages WHERE to_user = ? ORDER BY id LIMIT ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, max_count);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *msg_text = sqlite3_column_text(stmt, 1);
+            if (msg_text) {
+                results.emplace_back(sqlite3_column_int64(stmt, 0), (const char*)msg_text);
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    return results;
+}
+
+bool Database::delete_offline_messages(const std::string &username, sqlite3_int64 up_to_id) {
+    if (!db_) return false;
+
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    std::string sql = "DELETE FROM offline_messages WHERE to_user = ? AND id <= ?;";
     sqlite3_stmt *stmt = nullptr;
+    bool ok = false;
     if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
         sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
-        sqlite3_step(stmt);
+        sqlite3_bind_int64(stmt, 2, up_to_id);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
     }
     sqlite3_finalize(stmt);
+    if (!ok) {
+        LOG_ERROR("Failed to delete delivered offline messages for ", username);
+    }
+    return ok;
+}
+
+int Database::count_offline_messages(const std::string &username) {
+    if (!db_) return 0;
+    std::lock_guard<std::mutex> lock(db_mtx_);
+    return count_mailbox(db_, username);
 }
 
 void Database::stop_aggregator() {
-    running_ = false;
+    {
+        // Under the lock so the aggregator can't miss the wakeup between
+        // checking running_ and waiting
+        std::lock_guard<std::mutex> lock(queue_mtx_);
+        running_ = false;
+    }
     queue_cv_.notify_all();
     if (aggregator_thread_.joinable()) {
         aggregator_thread_.join();
@@ -199,7 +961,7 @@ void Database::stop_aggregator() {
 }
 
 bool Database::verifyUser(const std::string& username, const std::string& password) {
-    Logger::log("Verifying user: " + username, LogLevel::DEBUG);
+    LOG_DEBUG("Verifying user: ", username);
     auto it = users.find(username);
     if (it == users.end()) {
         return false;
@@ -214,7 +976,7 @@ void Database::loadUsers() {
     sqlite3_stmt* stmt;
     int rc = sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        Logger::log("Failed to load users: " + std::string(sqlite3_errmsg(db_)), LogLevel::ERROR);
+        LOG_ERROR("Failed to load users: ", sqlite3_errmsg(db_));
         return;
     }
 
@@ -225,7 +987,7 @@ void Database::loadUsers() {
         users[username] = UserRecord{salt, passHash};
     }
     sqlite3_finalize(stmt);
-    Logger::log("Users loaded from database", LogLevel::INFO);
+    LOG_INFO("Users loaded from database");
 }
 
 std::string Database::generateSalt(size_t length) {
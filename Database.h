@@ -3,13 +3,17 @@
 #include <sqlite3.h>
 #include <string>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <unordered_map>
+#include <utility>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include "Metrics.h"
+#include "Message.h"
 
 struct UserRecord {
     std::string salt;      // Random salt
@@ -17,9 +21,42 @@ struct UserRecord {
 };
 
 struct DBMessage {
+    MessagePtr message;        // shared with the recipients, not copied
+    uint64_t trace_id = 0;     // sampled trace (see Tracer), 0 if none
+    int64_t queued_ns = 0;
+};
+
+// A persisted chat line as read back from the messages table
+struct StoredMessage {
+    sqlite3_int64 id = 0;      // the message's seq
+    std::string timestamp;
     std::string username;
+    std::string recipient;     // empty for room messages
     std::string message;
-    DBMessage(const std::string &u, const std::string &m) : username(u), message(m) {}
+};
+
+// Parameters for a full-text search over persisted history.
+// Empty user/since/until mean "no filter"; page is zero-based.
+struct SearchQuery {
+    std::string terms;
+    std::string viewer;    // only room messages and this user's DMs match
+    std::string user;
+    std::string since;     // "YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS" (UTC)
+    std::string until;     // inclusive
+    int page = 0;
+    int page_size = 20;
+};
+
+// Message retention. The messages table is pruned oldest-first in id
+// ranges of batch_size rows, each range in its own short transaction, so
+// the aggregator never holds the writer for long. Zero disables a limit.
+struct RetentionPolicy {
+    int max_age_days = 0;
+    int max_rows = 0;
+    int batch_size = 500;
+    int interval_seconds = 60;
+    int quiet_seconds = 30;       // idle time before checkpoint/vacuum
+    std::string archive_file;     // if set, pruned rows are copied here first
 };
 
 class Database {
@@ -29,11 +66,58 @@ public:
         return instance;
     }
 
-    void log_message(const std::string &username, const std::string &message);
-    std::string get_chat_history();
-    void store_offline_message(const std::string &to_user, const std::string &message);
-    std::vector<std::string> retrieve_offline_messages(const std::string &username);
-    void clear_offline_messages(const std::string &username);
+    // Overrides the database file (default chat.db); must run before the
+    // first getInstance()
+    static void set_path(const std::string &path) { path_() = path; }
+
+    static constexpr const char *kGlobalConversation = "global";
+    // Key under which a message between sender and recipient is stored;
+    // the room when recipient is empty, otherwise the unordered user pair
+    static std::string conversation_key(const std::string &sender, const std::string &recipient);
+
+    // Sequence number for a new message, which becomes its row id. Ids are
+    // allocated when messages are sent rather than when the batch writer
+    // inserts them, so clients see the number a message is stored under.
+    uint64_t next_sequence() { return sequence_->fetch_add(1, std::memory_order_relaxed); }
+    // Allocates from counter from now on, e.g. one in shared memory that all
+    // worker processes use; it is raised past every id this process knows
+    // of. nullptr goes back to a private counter, before counter goes away.
+    void share_sequence(std::atomic<uint64_t> *counter);
+
+    // Queues a message for the batch writer; stored with its own timestamp
+    // and, when it has one, its seq as the row id
+    void log_message(const MessagePtr &message);
+    // Messages with seq greater than after that viewer may see: the room (if
+    // include_room) and the viewer's DMs, oldest first, at most limit of
+    // them. Includes messages still waiting for the batch writer.
+    std::vector<MessagePtr> messages_since(const std::string &viewer, uint64_t after, bool include_room,
+                                           int limit);
+    // Highest seq a user acknowledged with /ack (0 if none); store never
+    // lowers it
+    void store_ack(const std::string &username, uint64_t seq);
+    uint64_t load_ack(const std::string &username);
+    // Newest `limit` messages of a conversation, oldest first. Includes
+    // messages still waiting for the batch writer.
+    std::vector<StoredMessage> recent_messages(const std::string &conversation, int limit);
+    sqlite3_int64 last_message_id();
+    // Conversations with messages newer than after_id; false if there are
+    // more than max_rows such messages
+    bool conversations_since(sqlite3_int64 after_id, int max_rows, std::vector<std::string> &out);
+    // With seqs, each result's message seq (its row id) is appended alongside
+    std::vector<std::string> search_messages(const SearchQuery &query, std::vector<uint64_t> *seqs = nullptr);
+    // Offline mailbox. store returns false when the recipient's mailbox is
+    // full; drain atomically fetches and deletes up to max_count of the
+    // oldest messages for a user.
+    bool store_offline_message(const std::string &to_user, const std::string &message);
+    std::vector<std::string> drain_offline_messages(const std::string &username, int max_count);
+    // For a mailbox handed to another node in batches (see Cluster): peek
+    // reads up to max_count of the oldest messages with their ids and leaves
+    // them in place; delete removes them once the node has taken them
+    std::vector<std::pair<sqlite3_int64, std::string>> peek_offline_messages(const std::string &username,
+                                                                             int max_count);
+    bool delete_offline_messages(const std::string &username, sqlite3_int64 up_to_id);
+    int count_offline_messages(const std::string &username);
+    // Stops the batch writer after committing everything queued so far
     void stop_aggregator();
     bool verifyUser(const std::string& username, const std::string& password);
 
@@ -45,17 +129,44 @@ private:
     Database& operator=(const Database&) = delete;
 
     bool exec_sql(const std::string &sql);
+    // schema: "main" or "archive"
+    void migrate_schema(const std::string &schema);
+    void init_fts();
     void db_aggregator_main();
+    // False if the transaction couldn't start or commit (the write lock
+    // stayed busy); nothing was written and the batch can be retried
+    bool flush_batch(const std::vector<DBMessage> &batch);
+    void load_retention_policy();
+    bool run_retention(std::chrono::milliseconds budget);
+    int retention_step();
+    void run_quiet_maintenance();
+    static std::string &path_() {
+        static std::string path = "chat.db";
+        return path;
+    }
     static std::string generateSalt(size_t length = 16);
     static std::string hashPassword(const std::string& password, const std::string& salt);
     void loadUsers();
 
     sqlite3 *db_;
-    std::queue<DBMessage> message_queue_;
+    bool fts_available_;
+    RetentionPolicy retention_;
+    std::chrono::steady_clock::time_point next_retention_;
+    std::chrono::steady_clock::time_point last_write_;
+    bool retention_pending_;
+    bool needs_compaction_;
+    Gauge &queue_depth_;
+    Histogram &batch_commit_time_;
+    Counter &messages_persisted_;
+    std::mutex db_mtx_;    // serializes statements on db_
+    std::atomic<uint64_t> own_sequence_;
+    std::atomic<uint64_t> *sequence_;
+    std::deque<DBMessage> message_queue_;
+    std::vector<DBMessage> in_flight_;     // batch being written; read by messages_since
     std::mutex queue_mtx_;
     std::condition_variable queue_cv_;
     std::thread aggregator_thread_;
-    bool running_;
+    std::atomic<bool> running_;
     std::unordered_map<std::string, UserRecord> users;
 
     void aggregate_messages();
@@ -0,0 +1,97 @@
+#include "FlightRecorder.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+
+FlightRecorder::ThreadRing &FlightRecorder::local_ring() {
+    thread_local ThreadRing *ring = nullptr;
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        rings_.push_back(std::make_unique<ThreadRing>());
+        ring = rings_.back().get();
+        ring->thread = static_cast<uint16_t>(rings_.size());
+    }
+    return *ring;
+}
+
+void FlightRecorder::append(FlightEvent event, uint64_t session, uint64_t value, const char *tag, size_t tag_len) {
+    ThreadRing &ring = local_ring();
+    FlightRecord rec{};
+    rec.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    rec.session = session;
+    rec.value = value;
+    rec.event = static_cast<uint16_t>(event);
+    rec.thread = ring.thread;
+    std::memcpy(rec.tag, tag, std::min(tag_len, sizeof(rec.tag)));
+
+    uint64_t words[kWords];
+    std::memcpy(words, &rec, sizeof(rec));
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    Slot &slot = ring.slots[head & (kRecordsPerThread - 1)];
+    for (size_t i = 0; i < kWords; ++i) {
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void FlightRecorder::name_thread(const std::string &name) {
+    ThreadRing &ring = local_ring();
+    std::lock_guard<std::mutex> lock(mtx_);
+    ring.name = name;
+}
+
+bool FlightRecorder::dump(const std::string &path) const {
+    std::vector<FlightDumpThread> threads;
+    std::vector<FlightRecord> records;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (auto &ring : rings_) {
+            FlightDumpThread info{};
+            info.thread = ring->thread;
+            std::strncpy(info.name, ring->name.c_str(), sizeof(info.name) - 1);
+            threads.push_back(info);
+
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t begin = head > kRecordsPerThread ? head - kRecordsPerThread : 0;
+            for (uint64_t i = begin; i < head; ++i) {
+                const Slot &slot = ring->slots[i & (kRecordsPerThread - 1)];
+                uint64_t words[kWords];
+                for (size_t w = 0; w < kWords; ++w) {
+                    words[w] = slot.words[w].load(std::memory_order_relaxed);
+                }
+                // Skip slots the owner overwrote while we were reading
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (ring->head.load(std::memory_order_relaxed) - i >= kRecordsPerThread) {
+                    continue;
+                }
+                FlightRecord rec;
+                std::memcpy(&rec, words, sizeof(rec));
+                records.push_back(rec);
+            }
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const FlightRecord &a, const FlightRecord &b) { return a.wall_ns < b.wall_ns; });
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        return false;
+    }
+    FlightDumpHeader header{};
+    std::memcpy(header.magic, "CHATFLT1", sizeof(header.magic));
+    header.record_size = sizeof(FlightRecord);
+    header.thread_count = static_cast<uint32_t>(threads.size());
+    header.record_count = records.size();
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(threads.data()), threads.size() * sizeof(FlightDumpThread));
+    out.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(FlightRecord));
+    return static_cast<bool>(out);
+}
+
+std::string FlightRecorder::dump_to_dir(const std::string &dir) const {
+    std::string path = (dir.empty() ? std::string(".") : dir) + "/flight-" +
+                       std::to_string(std::time(nullptr)) + ".bin";
+    return dump(path) ? path : "";
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What happened; stored as a uint16_t, so only append new values
+enum class FlightEvent : uint16_t {
+    Start = 1,
+    Accept,
+    Disconnect,
+    LoginOk,
+    LoginFailed,
+    Logout,
+    Command,
+    DbFlush,
+    DbError,
+    SocketError,
+    Timeout,
+    Error,
+    Dump,
+};
+
+inline const char *flight_event_name(uint16_t event) {
+    switch (static_cast<FlightEvent>(event)) {
+    case FlightEvent::Start:       return "START";
+    case FlightEvent::Accept:      return "ACCEPT";
+    case FlightEvent::Disconnect:  return "DISCONNECT";
+    case FlightEvent::LoginOk:     return "LOGIN_OK";
+    case FlightEvent::LoginFailed: return "LOGIN_FAILED";
+    case FlightEvent::Logout:      return "LOGOUT";
+    case FlightEvent::Command:     return "COMMAND";
+    case FlightEvent::DbFlush:     return "DB_FLUSH";
+    case FlightEvent::DbError:     return "DB_ERROR";
+    case FlightEvent::SocketError: return "SOCKET_ERROR";
+    case FlightEvent::Timeout:     return "TIMEOUT";
+    case FlightEvent::Error:       return "ERROR";
+    case FlightEvent::Dump:        return "DUMP";
+    }
+    return "UNKNOWN";
+}
+
+// One event as written to a dump file (little-endian, packed to 48 bytes).
+// session is Session::get_id() (0 = none); value is event specific (batch
+// size, duration in microseconds, error code); tag is a short, possibly
+// truncated, string such as a username or command name.
+struct FlightRecord {
+    int64_t wall_ns;    // system_clock, so dumps line up with server.log
+    uint64_t session;
+    uint64_t value;
+    uint16_t event;
+    uint16_t thread;
+    char tag[20];
+};
+static_assert(sizeof(FlightRecord) == 48, "FlightRecord is part of the dump format");
+
+// Dump layout: FlightDumpHeader, thread_count FlightDumpThread entries, then
+// record_count FlightRecords ordered by time.
+struct FlightDumpHeader {
+    char magic[8];          // "CHATFLT1"
+    uint32_t record_size;
+    uint32_t thread_count;
+    uint64_t record_count;
+};
+struct FlightDumpThread {
+    uint16_t thread;
+    char name[30];
+};
+
+// Always-on flight recorder: every thread that records owns a fixed ring of
+// binary events, so recording is a handful of stores with no lock, no
+// allocation and no formatting. dump() snapshots all rings for post-mortem
+// reading with flight_decode.
+class FlightRecorder {
+public:
+    static FlightRecorder& getInstance() {
+        static FlightRecorder instance;
+        return instance;
+    }
+
+    static void record(FlightEvent event, uint64_t session = 0, uint64_t value = 0, const std::string &tag = "") {
+        getInstance().append(event, session, value, tag.data(), tag.size());
+    }
+    static void record(FlightEvent event, uint64_t session, uint64_t value, const char *tag) {
+        getInstance().append(event, session, value, tag, std::strlen(tag));
+    }
+
+    // Names the calling thread in dumps
+    void name_thread(const std::string &name);
+
+    bool dump(const std::string &path) const;
+    // Dumps to <dir>/flight-<epoch>.bin; returns the path, or "" on failure
+    std::string dump_to_dir(const std::string &dir) const;
+
+private:
+    FlightRecorder() = default;
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+    static constexpr size_t kRecordsPerThread = 1 << 13;
+    static constexpr size_t kWords = sizeof(FlightRecord) / sizeof(uint64_t);
+
+    // A record stored as relaxed atomic words so dump() can copy a ring
+    // while its owner keeps writing
+    struct Slot {
+        std::atomic<uint64_t> words[kWords];
+    };
+    struct ThreadRing {
+        uint16_t thread;
+        std::string name;
+        std::atomic<uint64_t> head{0};
+        std::unique_ptr<Slot[]> slots{new Slot[kRecordsPerThread]()};
+    };
+
+    void append(FlightEvent event, uint64_t session, uint64_t value, const char *tag, size_t tag_len);
+    ThreadRing &local_ring();
+
+    mutable std::mutex mtx_;    // guards rings_ and thread names
+    std::vector<std::unique_ptr<ThreadRing>> rings_;
+};
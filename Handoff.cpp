@@ -0,0 +1,351 @@
+#include "Handoff.h"
+#include "Logger.h"
+#include "Server.h"
+#include "Session.h"
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// Wire format on the Unix socket, after the successor's "UPGRADE\n":
+// records of {u32 type, u32 body length}, the header sent with at most one
+// descriptor attached, then the body. Native byte order; both ends are
+// on the same host.
+enum RecordType : uint32_t {
+    kListener = 1,      // the listening socket, empty body
+    kSession = 2,       // one client socket, body from encode_session
+    kEnd = 3,
+};
+
+struct RecordHeader {
+    uint32_t type;
+    uint32_t length;
+};
+
+template <typename T>
+void put(std::string &out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_bytes(std::string &out, const std::string &bytes) {
+    put(out, static_cast<uint32_t>(bytes.size()));
+    out += bytes;
+}
+
+// Bounds-checked reader over a record body
+class BodyReader {
+public:
+    explicit BodyReader(const std::string &body) : body_(body), pos_(0) {}
+
+    template <typename T>
+    bool get(T &value) {
+        if (body_.size() - pos_ < sizeof(T)) return false;
+        std::memcpy(&value, body_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return true;
+    }
+
+    bool get_bytes(std::string &out) {
+        uint32_t length;
+        if (!get(length) || body_.size() - pos_ < length) return false;
+        out.assign(body_, pos_, length);
+        pos_ += length;
+        return true;
+    }
+
+private:
+    const std::string &body_;
+    size_t pos_;
+};
+
+std::string encode_session(const HandoffSession &session) {
+    std::string body;
+    // Flag bits: 1 authenticated, 2 sequenced
+    put(body, static_cast<uint8_t>(session.authenticated | session.sequenced << 1));
+    put_bytes(body, session.username);
+    put_bytes(body, session.read_buffer);
+    put(body, static_cast<uint32_t>(session.pending_output.size()));
+    for (auto &line : session.pending_output) {
+        put_bytes(body, line);
+    }
+    return body;
+}
+
+bool decode_session(const std::string &body, HandoffSession &session) {
+    BodyReader reader(body);
+    uint8_t flags;
+    uint32_t pending;
+    if (!reader.get(flags) || !reader.get_bytes(session.username) ||
+        !reader.get_bytes(session.read_buffer) || !reader.get(pending)) {
+        return false;
+    }
+    session.authenticated = (flags & 1) != 0;
+    session.sequenced = (flags & 2) != 0;
+    session.pending_output.resize(pending);
+    for (auto &line : session.pending_output) {
+        if (!reader.get_bytes(line)) return false;
+    }
+    return true;
+}
+
+bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool read_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = recv(fd, data, length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool send_record(int fd, uint32_t type, const std::string &body, int passed_fd = -1) {
+    RecordHeader header{type, static_cast<uint32_t>(body.size())};
+    iovec iov{&header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (passed_fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(sizeof(header)) && write_all(fd, body.data(), body.size());
+}
+
+// Reads one record; passed_fd is -1 unless a descriptor came with it
+bool receive_record(int fd, RecordHeader &header, std::string &body, int &passed_fd) {
+    passed_fd = -1;
+    iovec iov{&header, sizeof(header)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (n != static_cast<ssize_t>(sizeof(header))) {
+        return false;
+    }
+    body.resize(header.length);
+    return read_all(fd, &body[0], body.size());
+}
+
+} // namespace
+
+// ---------------------- Predecessor ----------------------
+
+Handoff::Handoff(boost::asio::io_context &io_context, const std::string &path, Server &server,
+                 std::function<void()> on_handed_off)
+    : path_(path), server_(server), on_handed_off_(std::move(on_handed_off)), acceptor_(io_context) {
+    // Left behind by a crash; a live server would hold our port, and we
+    // only get here once the port is bound
+    unlink(path_.c_str());
+    boost::asio::local::stream_protocol::endpoint endpoint(path_);
+    boost::system::error_code ec;
+    acceptor_.open(endpoint.protocol(), ec);
+    if (!ec) acceptor_.bind(endpoint, ec);
+    if (!ec) acceptor_.listen(1, ec);
+    if (ec) {
+        LOG_ERROR("Cannot listen for upgrades on ", path_, ": ", ec.message());
+        return;
+    }
+    // Whoever connects can take every client socket
+    chmod(path_.c_str(), S_IRUSR | S_IWUSR);
+    LOG_INFO("Listening for upgrades on ", path_);
+    accept();
+}
+
+Handoff::~Handoff() {
+    if (acceptor_.is_open()) {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        unlink(path_.c_str());
+    }
+}
+
+void Handoff::accept() {
+    acceptor_.async_accept([this](const boost::system::error_code &ec,
+                                  boost::asio::local::stream_protocol::socket socket) {
+        if (ec == boost::asio::error::operation_aborted || handed_off_) return;
+        if (ec) {
+            accept();
+            return;
+        }
+        ucred peer{};
+        socklen_t length = sizeof(peer);
+        if (getsockopt(socket.native_handle(), SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+            peer.uid != getuid()) {
+            LOG_WARN("Rejected upgrade request from uid ", peer.uid);
+            accept();
+            return;
+        }
+        successor_ = std::make_unique<boost::asio::local::stream_protocol::socket>(std::move(socket));
+        boost::asio::async_read_until(*successor_, request_, '\n',
+            [this](const boost::system::error_code &ec, std::size_t length) {
+                std::string request;
+                if (!ec) {
+                    request.assign(boost::asio::buffers_begin(request_.data()),
+                                   boost::asio::buffers_begin(request_.data()) + length - 1);
+                    request_.consume(length);
+                }
+                if (request == "UPGRADE") {
+                    hand_off();
+                } else {
+                    LOG_WARN("Ignoring upgrade connection: ", ec ? ec.message() : "bad request");
+                    successor_.reset();
+                    accept();
+                }
+            });
+    });
+}
+
+void Handoff::hand_off() {
+    LOG_INFO("Handing the server off to a new process");
+    handed_off_ = true;
+    // The successor listens on the same path once we are gone
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+    unlink(path_.c_str());
+
+    int listen_fd = server_.release_listener();
+    auto sessions = server_.live_sessions();
+    std::vector<int> fds;
+    for (auto &session : sessions) {
+        fds.push_back(session->begin_handoff());
+    }
+
+    // Runs after the reads and writes cancelled above have completed, so each
+    // session's queue holds exactly the output its client has not received
+    boost::asio::post(acceptor_.get_executor(), [this, listen_fd, sessions, fds] {
+        int successor = successor_->native_handle();
+        boost::system::error_code ignored;
+        successor_->non_blocking(false, ignored);
+        successor_->native_non_blocking(false, ignored);
+
+        bool ok = listen_fd < 0 || send_record(successor, kListener, "", listen_fd);
+        size_t sent = 0;
+        for (size_t i = 0; ok && i < sessions.size(); ++i) {
+            if (fds[i] < 0) continue;
+            HandoffSession state;
+            sessions[i]->fill_handoff(state);
+            ok = send_record(successor, kSession, encode_session(state), fds[i]);
+            sent += ok;
+        }
+        ok = ok && send_record(successor, kEnd, "");
+
+        // The successor holds its own copies now
+        if (listen_fd >= 0) close(listen_fd);
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+        if (ok) {
+            LOG_INFO("Handed off the listener and ", sent, " sessions");
+        } else {
+            LOG_ERROR("Handoff broke off after ", sent, " of ", sessions.size(), " sessions: ", std::strerror(errno));
+        }
+        on_handed_off_();
+    });
+}
+
+void Handoff::finish() {
+    if (successor_) {
+        // Tells the successor our ports are free and the snapshot is saved
+        successor_.reset();
+    }
+}
+
+// ---------------------- Successor ----------------------
+
+bool Handoff::receive(const std::string &path, HandoffState &state, int &predecessor) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERROR("upgrade_socket path too long: ", path);
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    const char request[] = "UPGRADE\n";
+    RecordHeader header{};
+    std::string body;
+    int passed_fd = -1;
+    bool ok = write_all(fd, request, sizeof(request) - 1);
+    while (ok && (ok = receive_record(fd, header, body, passed_fd)) && header.type != kEnd) {
+        if (header.type == kListener && passed_fd >= 0) {
+            state.listen_fd = passed_fd;
+        } else if (header.type == kSession && passed_fd >= 0) {
+            HandoffSession session;
+            if (decode_session(body, session)) {
+                session.fd = passed_fd;
+                state.sessions.push_back(std::move(session));
+            } else {
+                LOG_WARN("Dropping a handed-off session with a malformed record");
+                close(passed_fd);
+            }
+        } else if (passed_fd >= 0) {
+            close(passed_fd);
+        }
+    }
+    if (!ok) {
+        LOG_ERROR("Handoff from the previous process broke off after ", state.sessions.size(), " sessions");
+    }
+    predecessor = fd;
+    return true;
+}
+
+void Handoff::wait_for_predecessor(int predecessor, std::chrono::seconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    char buffer[64];
+    for (;;) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            LOG_WARN("Previous process still running after ", timeout.count(), "s, continuing");
+            break;
+        }
+        pollfd pfd{predecessor, POLLIN, 0};
+        int ready = poll(&pfd, 1, static_cast<int>(left.count()));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready > 0 && recv(predecessor, buffer, sizeof(buffer), 0) > 0) continue;
+        if (ready != 0) break;  // EOF or error: it is gone
+    }
+    close(predecessor);
+}
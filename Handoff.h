@@ -0,0 +1,64 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Server;
+
+// One client connection being handed to a new process
+struct HandoffSession {
+    int fd = -1;
+    bool authenticated = false;
+    bool sequenced = false;                   // chat lines carry their seq (see /sync)
+    std::string username;
+    std::string read_buffer;                  // partial line not yet processed
+    std::vector<std::string> pending_output;  // queued lines not yet written
+};
+
+struct HandoffState {
+    int listen_fd = -1;
+    std::vector<HandoffSession> sessions;
+};
+
+#ifndef _WIN32
+// Zero-downtime upgrades (POSIX only; see CMakeLists.txt). A running server listens on upgrade_socket (a
+// Unix socket only its own user may use); a new binary started with
+// --upgrade connects to it and receives the listening socket and every
+// client socket via SCM_RIGHTS, with the state each session needs. The old
+// process then shuts down without disconnecting anyone, saving its history
+// snapshot and releasing its other ports before closing the connection;
+// the new one waits for that, warms up, and resumes the sessions. Clients
+// see a pause, not a disconnect.
+class Handoff {
+public:
+    // Predecessor side: serves one takeover request for server.
+    // on_handed_off runs once the sockets are gone and should stop the
+    // process; finish() must be called after its shutdown work.
+    Handoff(boost::asio::io_context& io_context, const std::string& path, Server& server,
+            std::function<void()> on_handed_off);
+    ~Handoff();
+    void finish();
+
+    // Successor side, before anything else starts. False if no server is
+    // listening on path (start normally) or the transfer failed.
+    static bool receive(const std::string& path, HandoffState& state, int& predecessor);
+    // Blocks until the predecessor closes the connection or timeout passes
+    static void wait_for_predecessor(int predecessor, std::chrono::seconds timeout);
+
+private:
+    void accept();
+    void hand_off();
+
+    std::string path_;
+    Server& server_;
+    std::function<void()> on_handed_off_;
+    boost::asio::local::stream_protocol::acceptor acceptor_;
+    std::unique_ptr<boost::asio::local::stream_protocol::socket> successor_;
+    boost::asio::streambuf request_;
+    bool handed_off_ = false;
+};
+#endif
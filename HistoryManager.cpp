@@ -0,0 +1,380 @@
+#include "HistoryManager.h"
+#include "Database.h"
+#include "Config.h"
+#include "Logger.h"
+#include "Tracer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_set>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace {
+
+// Snapshot layout (native byte order, read back by the same build):
+//   magic[8] "CHSNAP02", u64 last message id, u32 conversation count,
+//   per conversation: u32 key length, key, u32 line count,
+//                     per line: u64 seq, u32 length, bytes
+//   u64 FNV-1a checksum of everything before it
+// "CHSNAP01" files, written before lines had seqs, lack the per-line seq.
+const char kSnapshotMagic[8] = {'C', 'H', 'S', 'N', 'A', 'P', '0', '2'};
+
+// Conversations touched by more newer messages than this are rebuilt from
+// scratch rather than patched
+const int kMaxSnapshotLag = 10000;
+
+uint64_t fnv1a(const char *data, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+template <typename T>
+void put(std::string &out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_bytes(std::string &out, const std::string &bytes) {
+    put(out, static_cast<uint32_t>(bytes.size()));
+    out += bytes;
+}
+
+// Bounds-checked reader over the mapped file
+class SnapshotReader {
+public:
+    SnapshotReader(const char *data, size_t size) : data_(data), size_(size), pos_(0) {}
+
+    template <typename T>
+    bool get(T &value) {
+        if (size_ - pos_ < sizeof(T)) return false;
+        std::memcpy(&value, data_ + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return true;
+    }
+
+    bool get_bytes(std::string &out) {
+        uint32_t length;
+        if (!get(length) || size_ - pos_ < length) return false;
+        out.assign(data_ + pos_, length);
+        pos_ += length;
+        return true;
+    }
+
+private:
+    const char *data_;
+    size_t size_;
+    size_t pos_;
+};
+
+} // namespace
+
+HistoryManager::HistoryManager() : used_bytes_(0), snapshot_running_(false) {
+    const ServerSettings &settings = Config::getInstance().settings();
+    room_capacity_ = static_cast<size_t>(settings.history_cache_size);
+    dm_capacity_ = static_cast<size_t>(settings.dm_history_cache_size);
+    line_bytes_ = static_cast<size_t>(settings.history_line_bytes);
+    budget_bytes_ = static_cast<size_t>(settings.history_memory_budget_mb) << 20;
+    snapshot_file_ = settings.history_snapshot_file;
+}
+
+HistoryManager::~HistoryManager() {
+    if (snapshot_thread_.joinable()) {
+        snapshot_thread_.join();
+    }
+}
+
+std::string HistoryManager::format_line(const std::string &username, const std::string &message,
+                                        bool is_private) {
+    return (is_private ? "[Private] " : "") + username + ": " + message;
+}
+
+std::shared_ptr<HistoryManager::Conversation> HistoryManager::insert_locked(const std::string &conversation) {
+    auto entry = std::make_shared<Conversation>();
+    entry->cache = std::make_shared<ChatHistoryCache>(capacity_of(conversation), line_bytes_);
+    if (conversation == Database::kGlobalConversation) {
+        entry->lru = lru_.end();    // the room is never evicted
+    } else {
+        lru_.push_front(conversation);
+        entry->lru = lru_.begin();
+    }
+    conversations_[conversation] = entry;
+    used_bytes_ += entry->cache->memory_bytes();
+    evict_to_budget();
+    return entry;
+}
+
+std::shared_ptr<ChatHistoryCache> HistoryManager::acquire(const std::string &conversation, bool keep_empty) {
+    std::shared_ptr<Conversation> entry;
+    bool created = false;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = conversations_.find(conversation);
+        if (it != conversations_.end()) {
+            entry = it->second;
+            if (entry->lru != lru_.end()) {
+                lru_.splice(lru_.begin(), lru_, entry->lru);
+            }
+        } else if (keep_empty) {
+            entry = insert_locked(conversation);
+            created = true;
+        }
+    }
+
+    std::vector<StoredMessage> rows;
+    bool prefetched = false;
+    if (!entry) {
+        // Read the rows before taking a slot, so looking at a conversation
+        // that has none doesn't evict one that does
+        rows = Database::getInstance().recent_messages(conversation, static_cast<int>(capacity_of(conversation)));
+        if (rows.empty()) {
+            return nullptr;
+        }
+        prefetched = true;
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = conversations_.find(conversation);
+        if (it != conversations_.end()) {
+            entry = it->second;     // another caller got here first
+        } else {
+            entry = insert_locked(conversation);
+            created = true;
+        }
+    }
+    if (created) {
+        LOG_DEBUG("History cache miss for ", conversation, ", loading from database");
+    }
+
+    // Filled outside mtx_ so a slow query only delays users of this
+    // conversation; concurrent callers wait here until the fill is done
+    std::call_once(entry->filled, [&]{
+        if (!prefetched) {
+            rows = Database::getInstance().recent_messages(conversation,
+                                                           static_cast<int>(entry->cache->capacity()));
+        }
+        fill(rows, *entry->cache);
+    });
+    return entry->cache;
+}
+
+size_t HistoryManager::capacity_of(const std::string &conversation) const {
+    return conversation == Database::kGlobalConversation ? room_capacity_ : dm_capacity_;
+}
+
+void HistoryManager::fill(const std::vector<StoredMessage> &rows, ChatHistoryCache &cache) {
+    for (auto &row : rows) {
+        cache.add_message(format_line(row.username, row.message, !row.recipient.empty()),
+                          static_cast<uint64_t>(row.id));
+    }
+}
+
+void HistoryManager::evict_to_budget() {
+    // Caller holds mtx_. Readers holding a shared_ptr keep an evicted cache
+    // alive until they finish with it.
+    while (used_bytes_ > budget_bytes_ && !lru_.empty()) {
+        // Keep the entry we just inserted at the front
+        if (lru_.size() == 1) break;
+        std::string victim = lru_.back();
+        lru_.pop_back();
+        auto it = conversations_.find(victim);
+        if (it != conversations_.end()) {
+            used_bytes_ -= it->second->cache->memory_bytes();
+            conversations_.erase(it);
+        }
+    }
+}
+
+void HistoryManager::add_message(const std::string &conversation, std::string_view line, uint64_t seq) {
+    TraceSpan span("history.add");
+    acquire(conversation)->add_message(line, seq);
+}
+
+std::vector<std::string> HistoryManager::get_recent_messages(const std::string &conversation, size_t count) {
+    auto cache = acquire(conversation, false);
+    return cache ? cache->get_recent_messages(count) : std::vector<std::string>{};
+}
+
+bool HistoryManager::messages_since(const std::string &conversation, uint64_t after,
+                                    std::vector<std::pair<uint64_t, std::string>> &out) {
+    return acquire(conversation)->messages_since(after, out);
+}
+
+std::vector<std::string> HistoryManager::search(const std::string &conversation, const std::string &query,
+                                                std::vector<uint64_t> *seqs) {
+    auto cache = acquire(conversation);
+    return TokenIndex::is_word_query(query) ? cache->search_words(query, seqs) : cache->search(query, seqs);
+}
+
+size_t HistoryManager::memory_used() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return used_bytes_;
+}
+
+size_t HistoryManager::conversation_count() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return conversations_.size();
+}
+
+void HistoryManager::warm_start() {
+    load_snapshot();
+    // Without a usable snapshot this fills the room from the database, so
+    // it is ready before clients arrive
+    acquire(Database::kGlobalConversation);
+}
+
+bool HistoryManager::save_snapshot() {
+    std::lock_guard<std::mutex> save_lock(snapshot_mtx_);
+    if (snapshot_file_.empty()) return false;
+    auto started = std::chrono::steady_clock::now();
+
+    // Least recently used first, so loading in file order restores the LRU
+    std::vector<std::pair<std::string, std::shared_ptr<ChatHistoryCache>>> entries;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto room = conversations_.find(Database::kGlobalConversation);
+        if (room != conversations_.end()) {
+            entries.emplace_back(room->first, room->second->cache);
+        }
+        for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+            entries.emplace_back(*it, conversations_[*it]->cache);
+        }
+    }
+
+    // Read the DB position before the lines: anything flushed after this is
+    // detected as newer at load time
+    std::string out(kSnapshotMagic, sizeof(kSnapshotMagic));
+    put(out, static_cast<uint64_t>(Database::getInstance().last_message_id()));
+    put(out, static_cast<uint32_t>(entries.size()));
+    for (auto &entry : entries) {
+        put_bytes(out, entry.first);
+        std::vector<uint64_t> seqs;
+        auto lines = entry.second->get_recent_messages(SIZE_MAX, &seqs);
+        put(out, static_cast<uint32_t>(lines.size()));
+        for (size_t i = 0; i < lines.size(); ++i) {
+            put(out, seqs[i]);
+            put_bytes(out, lines[i]);
+        }
+    }
+    put(out, fnv1a(out.data(), out.size()));
+
+    // Write-then-rename so a crash never leaves a torn snapshot behind
+    std::string tmp = snapshot_file_ + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file.write(out.data(), static_cast<std::streamsize>(out.size()));
+        if (!file) {
+            LOG_ERROR("Failed to write history snapshot: ", tmp);
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, snapshot_file_, ec);
+    if (ec) {
+        LOG_ERROR("Failed to replace history snapshot: ", ec.message());
+        return false;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    LOG_INFO("History snapshot saved (", entries.size(), " conversations, ", out.size(),
+             " bytes, ", elapsed.count(), " ms)");
+    return true;
+}
+
+void HistoryManager::save_snapshot_async() {
+    if (snapshot_running_.exchange(true)) {
+        return;
+    }
+    if (snapshot_thread_.joinable()) {
+        snapshot_thread_.join();
+    }
+    snapshot_thread_ = std::thread([this]{
+        save_snapshot();
+        snapshot_running_ = false;
+    });
+}
+
+bool HistoryManager::load_snapshot() {
+    namespace bip = boost::interprocess;
+    std::error_code ec;
+    if (snapshot_file_.empty() || !std::filesystem::exists(snapshot_file_, ec)) {
+        return false;
+    }
+    auto started = std::chrono::steady_clock::now();
+
+    try {
+        bip::file_mapping mapping(snapshot_file_.c_str(), bip::read_only);
+        bip::mapped_region region(mapping, bip::read_only);
+        const char *data = static_cast<const char*>(region.get_address());
+        size_t size = region.get_size();
+
+        uint64_t checksum;
+        // Same magic up to the version digit, which must be 1 or 2
+        if (size < sizeof(kSnapshotMagic) + sizeof(checksum) ||
+            std::memcmp(data, kSnapshotMagic, sizeof(kSnapshotMagic) - 1) != 0 ||
+            (data[7] != '1' && data[7] != '2')) {
+            LOG_WARN("Ignoring history snapshot with unknown format");
+            return false;
+        }
+        bool has_seqs = data[7] == '2';
+        std::memcpy(&checksum, data + size - sizeof(checksum), sizeof(checksum));
+        if (fnv1a(data, size - sizeof(checksum)) != checksum) {
+            LOG_WARN("Ignoring corrupt history snapshot");
+            return false;
+        }
+
+        SnapshotReader reader(data + sizeof(kSnapshotMagic), size - sizeof(kSnapshotMagic) - sizeof(checksum));
+        uint64_t last_id;
+        uint32_t count;
+        if (!reader.get(last_id) || !reader.get(count)) {
+            return false;
+        }
+
+        // Conversations that gained messages after the snapshot (e.g. it is a
+        // periodic one and we crashed) are left to the normal lazy fill
+        std::vector<std::string> newer;
+        if (!Database::getInstance().conversations_since(static_cast<sqlite3_int64>(last_id),
+                                                         kMaxSnapshotLag, newer)) {
+            LOG_WARN("History snapshot is too far behind the database, ignoring it");
+            return false;
+        }
+        std::unordered_set<std::string> stale(newer.begin(), newer.end());
+
+        size_t loaded = 0;
+        std::string key, line;
+        for (uint32_t c = 0; c < count; ++c) {
+            uint32_t lines;
+            if (!reader.get_bytes(key) || !reader.get(lines)) {
+                LOG_WARN("Truncated history snapshot");
+                break;
+            }
+            std::shared_ptr<Conversation> entry;
+            if (!stale.count(key)) {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (!conversations_.count(key)) {
+                    entry = insert_locked(key);
+                }
+            }
+            for (uint32_t l = 0; l < lines; ++l) {
+                uint64_t seq = 0;
+                if ((has_seqs && !reader.get(seq)) || !reader.get_bytes(line)) break;
+                if (entry) entry->cache->add_message(line, seq);
+            }
+            if (entry) {
+                std::call_once(entry->filled, []{});
+                ++loaded;
+            }
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        LOG_INFO("History snapshot loaded (", loaded, " of ", count, " conversations, ",
+                 elapsed.count(), " ms)");
+        return loaded > 0;
+    } catch (const bip::interprocess_exception &e) {
+        LOG_WARN("Failed to map history snapshot: ", e.what());
+        return false;
+    }
+}
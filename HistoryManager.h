@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ChatHistoryCache.h"
+
+struct StoredMessage;
+
+// Owns one ChatHistoryCache per conversation (the global room or a DM
+// pair, keyed by Database::conversation_key) under a single memory budget.
+// Conversations other than the room are evicted least-recently-used first
+// and refilled from Database on the next access.
+//
+// To avoid a cold cache after restarts the resident conversations are
+// written to a snapshot file (on shutdown and every
+// history_snapshot_interval_seconds) and mapped back in at startup.
+class HistoryManager {
+public:
+    static HistoryManager& getInstance() {
+        static HistoryManager instance;
+        return instance;
+    }
+
+    // seq as in ChatHistoryCache::add_message
+    void add_message(const std::string& conversation, std::string_view line, uint64_t seq = 0);
+    std::vector<std::string> get_recent_messages(const std::string& conversation, size_t count = SIZE_MAX);
+    // See ChatHistoryCache::messages_since
+    bool messages_since(const std::string& conversation, uint64_t after,
+                        std::vector<std::pair<uint64_t, std::string>>& out);
+    // Word queries use the token index, anything else a substring scan.
+    // seqs as in ChatHistoryCache::search
+    std::vector<std::string> search(const std::string& conversation, const std::string& query,
+                                    std::vector<uint64_t>* seqs = nullptr);
+
+    // Formats a stored message the way it is shown in history
+    static std::string format_line(const std::string& username, const std::string& message,
+                                   bool is_private);
+
+    size_t memory_used() const;
+    size_t conversation_count() const;
+
+    // Loads the snapshot, or pre-fills the room from Database without one
+    void warm_start();
+    bool save_snapshot();
+    // Runs save_snapshot on a background thread unless one is in progress
+    void save_snapshot_async();
+    bool load_snapshot();
+
+private:
+    HistoryManager();
+    ~HistoryManager();
+
+    HistoryManager(const HistoryManager&) = delete;
+    HistoryManager& operator=(const HistoryManager&) = delete;
+
+    struct Conversation {
+        std::shared_ptr<ChatHistoryCache> cache;
+        std::once_flag filled;
+        std::list<std::string>::iterator lru;   // lru_.end() for the room
+    };
+
+    // Returns the cache for a conversation, creating and filling it on a
+    // miss. Without keep_empty, a miss on a conversation with no stored
+    // messages returns nullptr and caches nothing.
+    std::shared_ptr<ChatHistoryCache> acquire(const std::string& conversation, bool keep_empty = true);
+    // Caller holds mtx_; inserts an empty, unfilled conversation as most recent
+    std::shared_ptr<Conversation> insert_locked(const std::string& conversation);
+    size_t capacity_of(const std::string& conversation) const;
+    void fill(const std::vector<StoredMessage>& rows, ChatHistoryCache& cache);
+    void evict_to_budget();
+
+    std::unordered_map<std::string, std::shared_ptr<Conversation>> conversations_;
+    std::list<std::string> lru_;                // front = most recently used
+    size_t budget_bytes_;
+    size_t used_bytes_;
+    size_t room_capacity_;
+    size_t dm_capacity_;
+    size_t line_bytes_;
+    std::string snapshot_file_;
+    mutable std::mutex mtx_;
+
+    std::mutex snapshot_mtx_;                   // one save at a time
+    std::thread snapshot_thread_;
+    std::atomic<bool> snapshot_running_;
+};
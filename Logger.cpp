@@ -2,24 +2,57 @@
 #include <iostream>
 #include <chrono>
 #include <ctime>
-#include <iomanip>
-#include <sstream>
-#include <filesystem>
+#include <cstring>
 #include <algorithm>
+#include <cstdio>
+#include <cctype>
+#include <filesystem>
+#include <vector>
+#include <csignal>
+#include <exception>
+#include <zlib.h>
 
 namespace fs = std::filesystem;
 
-LogLevel Logger::currentLevel = LogLevel::INFO;
-std::mutex Logger::logMutex;
-std::ofstream Logger::logFile("server.log");
+static const char* const kLogFile = "server.log";
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Rotated logs are named server_<epoch>[_<n>].log so they sort by age
+static bool is_rotated_log(const std::string& name) {
+    return name.size() > 7 && name.compare(0, 7, "server_") == 0 &&
+           std::isdigit(static_cast<unsigned char>(name[7])) &&
+           (ends_with(name, ".log") || ends_with(name, ".log.gz"));
+}
+
+std::atomic<LogLevel> Logger::currentLevel(LogLevel::INFO);
+std::atomic<bool> Logger::running(false);
 
 Logger& Logger::instance() {
     static Logger instance;
     return instance;
 }
 
-Logger::Logger() : current_level_(LogLevel::DEBUG) {
-    log_file_.open("server.log", std::ios::app);
+Logger::Logger() : ring_(new Record[kQueueSize]) {
+    for (size_t i = 0; i < kQueueSize; ++i) {
+        ring_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    logFile.open(kLogFile, std::ios::app);
+    std::error_code ec;
+    file_bytes_ = fs::exists(kLogFile, ec) ? fs::file_size(kLogFile, ec) : 0;
+    if (ec) {
+        file_bytes_ = 0;
+    }
+    opened_at_ = static_cast<int64_t>(std::time(nullptr));
+    running = true;
+    writer_ = std::thread(&Logger::writer_main, this);
+    compressor_ = std::thread(&Logger::compressor_main, this);
+}
+
+Logger::~Logger() {
+    stop();
 }
 
 void Logger::setLogLevel(const std::string& level) {
@@ -34,31 +67,41 @@ void Logger::setLogLevel(const std::string& level) {
 }
 
 void Logger::setLogLevel(LogLevel level) {
-    std::lock_guard<std::mutex> lock(logMutex);
     currentLevel = level;
 }
 
-void Logger::rotate_if_needed() {
-    if (log_file_.tellp() >= max_size_) {
-        log_file_.close();
-        std::string new_name = "server_" + std::to_string(std::time(nullptr)) + ".log";
-        fs::rename("server.log", new_name);
-        log_file_.open("server.log", std::ios::trunc);
-    }
+void Logger::setOverflowPolicy(const std::string& policy) {
+    std::string upper = policy;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    instance().policy_ = (upper == "BLOCK") ? LogOverflowPolicy::BLOCK : LogOverflowPolicy::DROP;
+}
+
+void Logger::setConsoleOutput(bool enabled) {
+    instance().console_ = enabled;
+}
+
+void Logger::setRotation(uint64_t max_bytes, int interval_seconds, int max_files) {
+    Logger& logger = instance();
+    logger.max_bytes_ = max_bytes;
+    logger.rotate_interval_ = std::max(interval_seconds, 0);
+    logger.max_files_ = std::max(max_files, 0);
 }
 
 void Logger::log(const std::string& message, LogLevel level) {
-    if (level >= currentLevel) {
-        std::lock_guard<std::mutex> lock(logMutex);
-        auto now = std::time(nullptr);
-        auto tm = *std::localtime(&now);
-        std::string timestamp = std::to_string(std::mktime(&tm));
-        std::string levelStr = levelToString(level);
-        
-        std::string logMessage = "[" + timestamp + "] [" + levelStr + "] " + message + "\n";
-        std::cout << logMessage;
-        logFile << logMessage;
-        logFile.flush();
+    if (!enabled(level)) {
+        return;
+    }
+    Logger& logger = instance();
+    Producer producer(logger);
+    if (!producer.queued()) {
+        // After shutdown (e.g. during static destruction)
+        logger.write_sync(level, message);
+        return;
+    }
+    while (!logger.enqueue(level, message)) {
+        if (!logger.wait_for_space()) {
+            return;
+        }
     }
 }
 
@@ -66,6 +109,422 @@ void Logger::log(LogLevel level, const std::string& message) {
     log(message, level);
 }
 
+void Logger::write_sync(LogLevel level, const std::string& message) {
+    std::lock_guard<std::mutex> lock(sync_mtx_);
+    std::string line = "[" + std::to_string(std::time(nullptr)) + "] [" + levelToString(level) + "] " + message + "\n";
+    if (console_.load(std::memory_order_relaxed)) {
+        std::cout << line;
+    }
+    if (logFile.is_open()) {
+        logFile << line;
+        logFile.flush();
+    }
+}
+
+Logger::Record* Logger::claim(uint64_t& pos) {
+    // Bounded MPSC ring: a producer claims a position with CAS, fills the
+    // record and publishes it by setting seq to pos + 1
+    pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+        Record* record = &ring_[pos & (kQueueSize - 1)];
+        uint64_t seq = record->seq.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                return record;
+            }
+        } else if (diff < 0) {
+            return nullptr;   // full
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::publish(Record* record, uint64_t pos) {
+    record->seq.store(pos + 1, std::memory_order_release);
+}
+
+bool Logger::wait_for_space() {
+    if (policy_.load(std::memory_order_relaxed) == LogOverflowPolicy::DROP) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    wake_cv_.notify_one();
+    std::this_thread::yield();
+    return true;
+}
+
+bool Logger::enqueue(LogLevel level, const std::string& message) {
+    uint64_t pos;
+    Record* record = claim(pos);
+    if (!record) {
+        return false;
+    }
+    record->timestamp = static_cast<int64_t>(std::time(nullptr));
+    record->level = level;
+    record->encoded = false;
+    record->truncated = message.size() > kMaxText;
+    record->length = static_cast<uint32_t>(std::min(message.size(), kMaxText));
+    std::memcpy(record->text, message.data(), record->length);
+    publish(record, pos);
+    return true;
+}
+
+void Logger::ArgWriter::put_text(const char* s, size_t n) {
+    const size_t header = 1 + sizeof(uint16_t);
+    if (len_ + header >= cap_) {
+        truncated_ = truncated_ || n > 0;
+        return;
+    }
+    if (n > cap_ - len_ - header) {
+        n = cap_ - len_ - header;
+        truncated_ = true;
+    }
+    uint16_t length = static_cast<uint16_t>(n);
+    buf_[len_++] = 'S';
+    std::memcpy(buf_ + len_, &length, sizeof(length));
+    len_ += sizeof(length);
+    std::memcpy(buf_ + len_, s, n);
+    len_ += n;
+}
+
+void Logger::decode_args(std::string& out, const char* data, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        char tag = data[i++];
+        if (tag == 'S') {
+            uint16_t n;
+            std::memcpy(&n, data + i, sizeof(n));
+            i += sizeof(n);
+            out.append(data + i, n);
+            i += n;
+        } else if (tag == 'I') {
+            int64_t v;
+            std::memcpy(&v, data + i, sizeof(v));
+            i += sizeof(v);
+            out += std::to_string(v);
+        } else if (tag == 'U') {
+            uint64_t v;
+            std::memcpy(&v, data + i, sizeof(v));
+            i += sizeof(v);
+            out += std::to_string(v);
+        } else if (tag == 'B') {
+            uint64_t v;
+            std::memcpy(&v, data + i, sizeof(v));
+            i += sizeof(v);
+            out += v ? "true" : "false";
+        } else if (tag == 'D') {
+            double v;
+            std::memcpy(&v, data + i, sizeof(v));
+            i += sizeof(v);
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%g", v);
+            out += buf;
+        } else {
+            break;
+        }
+    }
+}
+
+void Logger::writer_main() {
+    std::string batch;
+    batch.reserve(64 * 1024);
+    for (;;) {
+        batch.clear();
+        size_t count = 0;
+        for (;;) {
+            Record& record = ring_[dequeue_pos_ & (kQueueSize - 1)];
+            if (record.seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+                break;
+            }
+            batch += "[" + std::to_string(record.timestamp) + "] [" + levelToString(record.level) + "] ";
+            if (record.encoded) {
+                decode_args(batch, record.text, record.length);
+            } else {
+                batch.append(record.text, record.length);
+            }
+            if (record.truncated) {
+                batch += "...";
+            }
+            batch += "\n";
+            record.seq.store(dequeue_pos_ + kQueueSize, std::memory_order_release);
+            ++dequeue_pos_;
+            if (++count == kQueueSize || batch.size() >= 64 * 1024) {
+                break;
+            }
+        }
+
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            batch += "[" + std::to_string(std::time(nullptr)) + "] [WARN] " +
+                     std::to_string(dropped) + " log messages dropped (queue full)\n";
+        }
+
+        if (!batch.empty()) {
+            {
+                // Late producers write_sync once stop() has begun
+                std::lock_guard<std::mutex> lock(sync_mtx_);
+                if (console_.load(std::memory_order_relaxed)) {
+                    std::cout << batch;
+                }
+                logFile << batch;
+                logFile.flush();
+                file_bytes_ += batch.size();
+                rotate_if_needed();
+            }
+            {
+                std::lock_guard<std::mutex> lock(wake_mtx_);
+                written_pos_.store(dequeue_pos_, std::memory_order_release);
+            }
+            flushed_cv_.notify_all();
+            continue;
+        }
+
+        // stop() clears running first, so once no producer is mid-call every
+        // record that will ever be queued has been claimed
+        if (stopping_.load(std::memory_order_acquire) && producers_.load() == 0 &&
+            enqueue_pos_.load(std::memory_order_acquire) == dequeue_pos_) {
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sync_mtx_);
+            rotate_if_needed();
+        }
+        std::unique_lock<std::mutex> lock(wake_mtx_);
+        wake_cv_.wait_for(lock, std::chrono::milliseconds(20));
+    }
+    std::cout.flush();
+}
+
+void Logger::rotate_if_needed() {
+    uint64_t max_bytes = max_bytes_.load(std::memory_order_relaxed);
+    int64_t interval = rotate_interval_.load(std::memory_order_relaxed);
+    int64_t now = static_cast<int64_t>(std::time(nullptr));
+    bool by_size = max_bytes > 0 && file_bytes_ >= max_bytes;
+    bool by_age = interval > 0 && now - opened_at_ >= interval;
+    if (!by_size && !by_age) {
+        return;
+    }
+    if (file_bytes_ == 0) {
+        opened_at_ = now;   // nothing to rotate yet
+        return;
+    }
+
+    // Only the writer touches logFile, so producers keep enqueueing while we
+    // rename; compression happens on the compressor thread
+    std::string rotated = "server_" + std::to_string(now) + ".log";
+    std::error_code ec;
+    for (int n = 1; fs::exists(rotated, ec) || fs::exists(rotated + ".gz", ec); ++n) {
+        rotated = "server_" + std::to_string(now) + "_" + std::to_string(n) + ".log";
+    }
+    logFile.close();
+    fs::rename(kLogFile, rotated, ec);
+    logFile.open(kLogFile, std::ios::app);
+    file_bytes_ = 0;
+    opened_at_ = now;
+    if (ec) {
+        std::cerr << "Log rotation failed: " << ec.message() << "\n";
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(compress_mtx_);
+        compress_queue_.push_back(rotated);
+    }
+    compress_cv_.notify_one();
+}
+
+void Logger::compressor_main() {
+    // Pick up files rotated but not compressed before a previous exit
+    std::error_code ec;
+    std::vector<std::string> leftover;
+    for (const auto& entry : fs::directory_iterator(".", ec)) {
+        std::string name = entry.path().filename().string();
+        if (is_rotated_log(name) && entry.path().extension() == ".log") {
+            leftover.push_back(name);
+        }
+    }
+    std::sort(leftover.begin(), leftover.end());
+    {
+        std::lock_guard<std::mutex> lock(compress_mtx_);
+        compress_queue_.insert(compress_queue_.begin(), leftover.begin(), leftover.end());
+    }
+
+    for (;;) {
+        std::string path;
+        {
+            std::unique_lock<std::mutex> lock(compress_mtx_);
+            compress_cv_.wait(lock, [this]{ return compress_stop_ || !compress_queue_.empty(); });
+            if (compress_queue_.empty()) {
+                return;
+            }
+            path = compress_queue_.front();
+            compress_queue_.pop_front();
+        }
+        if (compress_file(path)) {
+            fs::remove(path, ec);
+        } else {
+            LOG_WARN("Failed to compress rotated log ", path);
+        }
+        prune_rotated();
+    }
+}
+
+bool Logger::compress_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::string tmp = path + ".gz.tmp";
+    gzFile out = gzopen(tmp.c_str(), "wb6");
+    if (!out) {
+        return false;
+    }
+    std::vector<char> buf(64 * 1024);
+    bool ok = true;
+    while (ok && in) {
+        in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        std::streamsize n = in.gcount();
+        if (n > 0 && gzwrite(out, buf.data(), static_cast<unsigned>(n)) != n) {
+            ok = false;
+        }
+    }
+    if (gzclose(out) != Z_OK || in.bad()) {
+        ok = false;
+    }
+    std::error_code ec;
+    if (ok) {
+        fs::rename(tmp, path + ".gz", ec);
+        ok = !ec;
+    }
+    if (!ok) {
+        fs::remove(tmp, ec);
+    }
+    return ok;
+}
+
+void Logger::prune_rotated() {
+    int max_files = max_files_.load(std::memory_order_relaxed);
+    if (max_files <= 0) {
+        return;
+    }
+    std::error_code ec;
+    std::vector<std::string> rotated;
+    for (const auto& entry : fs::directory_iterator(".", ec)) {
+        std::string name = entry.path().filename().string();
+        if (is_rotated_log(name)) {
+            rotated.push_back(name);
+        }
+    }
+    if (rotated.size() <= static_cast<size_t>(max_files)) {
+        return;
+    }
+    std::sort(rotated.begin(), rotated.end());
+    for (size_t i = 0; i + max_files < rotated.size(); ++i) {
+        fs::remove(rotated[i], ec);
+    }
+}
+
+void Logger::flush() {
+    if (!running.load(std::memory_order_acquire)) {
+        return;
+    }
+    Logger& logger = instance();
+    uint64_t target = logger.enqueue_pos_.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(logger.wake_mtx_);
+    logger.wake_cv_.notify_one();
+    logger.flushed_cv_.wait(lock, [&]{
+        return logger.written_pos_.load(std::memory_order_acquire) >= target;
+    });
+}
+
+uint64_t Logger::queue_depth() {
+    if (!running.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    Logger& logger = instance();
+    return logger.enqueue_pos_.load(std::memory_order_relaxed) -
+           logger.written_pos_.load(std::memory_order_relaxed);
+}
+
+void Logger::shutdown() {
+    if (running.load(std::memory_order_acquire)) {
+        instance().stop();
+    }
+}
+
+void Logger::stop() {
+    if (!writer_.joinable()) {
+        return;
+    }
+    // New calls switch to write_sync; the writer drains until callers that
+    // already chose the queue have published
+    running = false;
+    stopping_ = true;
+    wake_cv_.notify_one();
+    writer_.join();
+    logFile.flush();
+    {
+        std::lock_guard<std::mutex> lock(compress_mtx_);
+        compress_stop_ = true;
+    }
+    compress_cv_.notify_one();
+    compressor_.join();
+}
+
+void Logger::install_crash_handlers() {
+    instance();
+    std::set_terminate(on_terminate);
+    for (int signum : {SIGSEGV, SIGILL, SIGFPE, SIGABRT}) {
+        std::signal(signum, on_fatal_signal);
+    }
+#ifdef SIGBUS
+    std::signal(SIGBUS, on_fatal_signal);
+#endif
+}
+
+// Gives the writer up to a second to write what is already queued. Uses only
+// atomics, the clock and yield so it is safe in a signal handler; if the
+// writer is the thread that crashed it simply times out.
+void Logger::drain_for_crash() {
+    if (!running.load(std::memory_order_acquire)) {
+        return;
+    }
+    Logger& logger = instance();
+    uint64_t target = logger.enqueue_pos_.load(std::memory_order_acquire);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (logger.written_pos_.load(std::memory_order_acquire) < target &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+}
+
+void Logger::on_terminate() {
+    // enqueue() never blocks, which matters if the writer is terminating
+    std::string reason = "std::terminate called";
+    if (std::exception_ptr error = std::current_exception()) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+            reason += ": uncaught exception: " + std::string(e.what());
+        } catch (...) {
+            reason += ": uncaught exception";
+        }
+    }
+    if (running.load(std::memory_order_acquire)) {
+        instance().enqueue(LogLevel::ERROR, reason);
+    }
+    drain_for_crash();
+    std::signal(SIGABRT, SIG_DFL);
+    std::abort();
+}
+
+void Logger::on_fatal_signal(int signum) {
+    drain_for_crash();
+    std::signal(signum, SIG_DFL);
+    std::raise(signum);
+}
+
 std::string Logger::levelToString(LogLevel level) {
     switch (level) {
         case LogLevel::DEBUG: return "DEBUG";
@@ -74,4 +533,4 @@ std::string Logger::levelToString(LogLevel level) {
         case LogLevel::ERROR: return "ERROR";
         default: return "UNKNOWN";
     }
-} 
\ No newline at end of file
+}
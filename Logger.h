@@ -3,12 +3,28 @@
 #include <string>
 #include <fstream>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+#include <deque>
+#include <ctime>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
 
 // Undefine Windows' ERROR macro if defined.
 #ifdef ERROR
 #undef ERROR
 #endif
 
+// Build-time level floor: LOG_* statements below it compile to nothing.
+// 0 = DEBUG, 1 = INFO, 2 = WARN, 3 = ERROR
+#ifndef CHAT_LOG_MIN_LEVEL
+#define CHAT_LOG_MIN_LEVEL 0
+#endif
+
 enum class LogLevel {
     DEBUG,
     INFO,
@@ -16,16 +32,237 @@ enum class LogLevel {
     ERROR
 };
 
+// What log() does when the queue is full
+enum class LogOverflowPolicy {
+    DROP,   // discard the record and count it (default)
+    BLOCK   // wait for the writer to make room
+};
+
+// Asynchronous logger. Callers copy each line into a fixed-size record in a
+// bounded lock-free MPSC ring; one background thread timestamps, formats and
+// writes records to stdout and server.log in batches. flush() waits until
+// everything logged so far is on disk, and the queue is drained on shutdown.
 class Logger {
 public:
+    static Logger& instance();
+
     static void setLogLevel(const std::string& level);
     static void setLogLevel(LogLevel level);
+    static void setOverflowPolicy(const std::string& policy);
+    // Whether lines are echoed to stdout as well as server.log
+    static void setConsoleOutput(bool enabled);
+    // Rotates server.log once it reaches max_bytes or is interval_seconds old
+    // (0 disables either trigger). Rotated files are gzip-compressed in the
+    // background and only the newest max_files are kept (0 keeps all).
+    static void setRotation(uint64_t max_bytes, int interval_seconds, int max_files);
     static void log(const std::string& message, LogLevel level = LogLevel::INFO);
     static void log(LogLevel level, const std::string& message);
 
+    // True if a message at this level would be written
+    static bool enabled(LogLevel level) {
+        return static_cast<int>(level) >= CHAT_LOG_MIN_LEVEL &&
+               level >= currentLevel.load(std::memory_order_relaxed);
+    }
+
+    // Logs the concatenation of args. The arguments are copied into the queue
+    // in binary form and converted to text by the writer thread. Prefer the
+    // LOG_* macros, which skip evaluating the arguments when filtered out.
+    template <typename... Args>
+    static void logf(LogLevel level, const Args&... args);
+
+    // Blocks until all records logged before the call have been written
+    static void flush();
+    // Records logged but not yet written
+    static uint64_t queue_depth();
+    // Drains the queue and stops the writer; later calls log synchronously
+    static void shutdown();
+    // Lets the writer drain the queue before the process dies from
+    // std::terminate or a fatal signal (SIGSEGV, SIGABRT, ...)
+    static void install_crash_handlers();
+
+    ~Logger();
+
 private:
-    static LogLevel currentLevel;
-    static std::mutex logMutex;
-    static std::ofstream logFile;
+    Logger();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    // Held by log()/logf() while they decide between the queue and
+    // write_sync, so stop() cannot let the writer exit under a producer
+    class Producer {
+    public:
+        explicit Producer(Logger& logger) : logger_(logger) { logger_.producers_.fetch_add(1); }
+        ~Producer() { logger_.producers_.fetch_sub(1); }
+        bool queued() const { return running.load(); }
+    private:
+        Logger& logger_;
+    };
+
+    // Lines longer than this are truncated
+    static constexpr size_t kMaxText = 480;
+    static constexpr size_t kQueueSize = 8192;   // power of two
+
+    struct Record {
+        std::atomic<uint64_t> seq{0};
+        int64_t timestamp;      // seconds since epoch
+        LogLevel level;
+        bool encoded;           // text holds logf() arguments, not a line
+        bool truncated;
+        uint32_t length;
+        char text[kMaxText];
+    };
+
+    // Serializes logf() arguments as tagged values into a record's text
+    class ArgWriter {
+    public:
+        ArgWriter(char* buf, size_t cap) : buf_(buf), cap_(cap) {}
+
+        void put(const std::string& s) { put_text(s.data(), s.size()); }
+        void put(std::string_view s) { put_text(s.data(), s.size()); }
+        void put(const char* s) { put_text(s, s ? std::strlen(s) : 0); }
+        void put(char c) { put_text(&c, 1); }
+        void put(bool b) { put_value('B', static_cast<uint64_t>(b)); }
+        template <typename T>
+        std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>> put(T v) {
+            put_value('I', static_cast<int64_t>(v));
+        }
+        template <typename T>
+        std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T>> put(T v) {
+            put_value('U', static_cast<uint64_t>(v));
+        }
+        template <typename T>
+        std::enable_if_t<std::is_floating_point_v<T>> put(T v) {
+            put_value('D', static_cast<double>(v));
+        }
+
+        size_t size() const { return len_; }
+        bool truncated() const { return truncated_; }
+
+    private:
+        void put_text(const char* s, size_t n);
+        template <typename V>
+        void put_value(char tag, V v) {
+            if (len_ + 1 + sizeof(V) > cap_) {
+                truncated_ = true;
+                return;
+            }
+            buf_[len_++] = tag;
+            std::memcpy(buf_ + len_, &v, sizeof(V));
+            len_ += sizeof(V);
+        }
+
+        char* buf_;
+        size_t cap_;
+        size_t len_ = 0;
+        bool truncated_ = false;
+    };
+
+    // Claims the next free record, or returns nullptr if the queue is full
+    Record* claim(uint64_t& pos);
+    void publish(Record* record, uint64_t pos);
+    // Applies the overflow policy; false means the message is dropped
+    bool wait_for_space();
+    bool enqueue(LogLevel level, const std::string& message);
+    void write_sync(LogLevel level, const std::string& message);
+    void rotate_if_needed();            // writer thread only
+    void compressor_main();
+    void prune_rotated();
+    static bool compress_file(const std::string& path);
+    static void decode_args(std::string& out, const char* data, size_t length);
+    void writer_main();
+    void stop();
+    static void drain_for_crash();
+    static void on_terminate();
+    static void on_fatal_signal(int signum);
+
+    static std::atomic<LogLevel> currentLevel;
+    static std::atomic<bool> running;   // false before start and after shutdown
     static std::string levelToString(LogLevel level);
+
+    std::unique_ptr<Record[]> ring_;
+    std::atomic<uint64_t> enqueue_pos_{0};
+    uint64_t dequeue_pos_ = 0;              // writer thread only
+    std::atomic<uint64_t> written_pos_{0};  // records written to the file
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<LogOverflowPolicy> policy_{LogOverflowPolicy::DROP};
+    std::atomic<bool> console_{true};
+
+    std::ofstream logFile;
+    std::mutex wake_mtx_;
+    std::condition_variable wake_cv_;       // writer waits for records
+    std::condition_variable flushed_cv_;    // flush() waits for the writer
+    std::atomic<bool> stopping_{false};
+    std::atomic<int> producers_{0};         // callers inside log()/logf()
+    std::mutex sync_mtx_;                   // serializes logFile writes
+    std::thread writer_;
+
+    // Rotation settings, and the current file's size and age (writer only)
+    std::atomic<uint64_t> max_bytes_{0};
+    std::atomic<int64_t> rotate_interval_{0};
+    std::atomic<int> max_files_{0};
+    uint64_t file_bytes_ = 0;
+    int64_t opened_at_ = 0;
+
+    // Rotated files waiting for compression
+    std::mutex compress_mtx_;
+    std::condition_variable compress_cv_;
+    std::deque<std::string> compress_queue_;
+    bool compress_stop_ = false;
+    std::thread compressor_;
 };
+
+template <typename... Args>
+void Logger::logf(LogLevel level, const Args&... args) {
+    if (!enabled(level)) {
+        return;
+    }
+    Logger& logger = instance();
+    Producer producer(logger);
+    if (!producer.queued()) {
+        char buf[kMaxText];
+        ArgWriter writer(buf, sizeof(buf));
+        (writer.put(args), ...);
+        std::string message;
+        decode_args(message, buf, writer.size());
+        logger.write_sync(level, message);
+        return;
+    }
+    uint64_t pos;
+    Record* record;
+    while (!(record = logger.claim(pos))) {
+        if (!logger.wait_for_space()) {
+            return;
+        }
+    }
+    ArgWriter writer(record->text, kMaxText);
+    (writer.put(args), ...);
+    record->timestamp = static_cast<int64_t>(std::time(nullptr));
+    record->level = level;
+    record->encoded = true;
+    record->truncated = writer.truncated();
+    record->length = static_cast<uint32_t>(writer.size());
+    logger.publish(record, pos);
+}
+
+// Level-checked logging. Arguments are only evaluated when the level is
+// enabled, and statements below CHAT_LOG_MIN_LEVEL are removed entirely:
+//   LOG_INFO("User ", username, " status updated to ", status);
+#define CHAT_LOG(level, ...) \
+    do { if (Logger::enabled(level)) Logger::logf(level, __VA_ARGS__); } while (0)
+
+#if CHAT_LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(...) CHAT_LOG(LogLevel::DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+#if CHAT_LOG_MIN_LEVEL <= 1
+#define LOG_INFO(...) CHAT_LOG(LogLevel::INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+#if CHAT_LOG_MIN_LEVEL <= 2
+#define LOG_WARN(...) CHAT_LOG(LogLevel::WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+#define LOG_ERROR(...) CHAT_LOG(LogLevel::ERROR, __VA_ARGS__)
@@ -0,0 +1,122 @@
+#include "Message.h"
+#include "Metrics.h"
+#include "SlabPool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+namespace {
+
+// Blocks of 128 bytes to 4 KB; the room line limit is 2 KB, so only
+// unusually long relayed lines go to operator new
+constexpr size_t kSizeClasses[] = {128, 256, 512, 1024, 2048, 4096};
+constexpr size_t kClassCount = sizeof(kSizeClasses) / sizeof(kSizeClasses[0]);
+
+SlabPool& size_class(size_t index) {
+    static SlabPool pools[kClassCount] = {
+        {kSizeClasses[0], 256}, {kSizeClasses[1], 128}, {kSizeClasses[2], 64},
+        {kSizeClasses[3], 32},  {kSizeClasses[4], 16},  {kSizeClasses[5], 8},
+    };
+    return pools[index];
+}
+
+size_t class_for(size_t bytes) {
+    size_t index = 0;
+    while (index < kClassCount && kSizeClasses[index] < bytes) {
+        ++index;
+    }
+    return index;   // kClassCount: too large for the slabs
+}
+
+std::atomic<int64_t> live_messages{0};
+
+} // namespace
+
+MessagePtr Message::create(std::string_view sender, std::string_view target, std::string_view body,
+                           uint64_t seq, int64_t timestamp_ms) {
+    return build(target.empty() ? std::string_view() : kPrivatePrefix, sender, ": ", body, target, seq,
+                 timestamp_ms);
+}
+
+MessagePtr Message::parse(std::string_view line, std::string_view target) {
+    std::string_view rest = line;
+    std::string_view prefix;
+    if (!target.empty() && rest.substr(0, kPrivatePrefix.size()) == kPrivatePrefix) {
+        prefix = kPrivatePrefix;
+        rest.remove_prefix(prefix.size());
+    }
+    size_t colon = rest.find(": ");
+    if (colon == std::string_view::npos) {
+        // Not a chat line; keep it verbatim, all body
+        return build({}, {}, {}, line, target, 0, 0);
+    }
+    return build(prefix, rest.substr(0, colon), ": ", rest.substr(colon + 2), target, 0, 0);
+}
+
+MessagePtr Message::build(std::string_view prefix, std::string_view sender, std::string_view separator,
+                          std::string_view body, std::string_view target, uint64_t seq, int64_t timestamp_ms) {
+    size_t line_length = prefix.size() + sender.size() + separator.size() + body.size();
+    size_t bytes = sizeof(Message) + kSeqPrefixSpace + line_length + 1 + target.size();
+    size_t index = class_for(bytes);
+    void* memory = index < kClassCount ? size_class(index).allocate(kSizeClasses[index]) : ::operator new(bytes);
+
+    Message* message = new (memory) Message;
+    message->allocation_size_ = static_cast<uint32_t>(index < kClassCount ? kSizeClasses[index] : bytes);
+    message->seq_ = seq;
+    message->timestamp_ms_ = timestamp_ms ? timestamp_ms : std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    message->sender_offset_ = static_cast<uint32_t>(prefix.size());
+    message->sender_length_ = static_cast<uint32_t>(sender.size());
+    message->body_offset_ = static_cast<uint32_t>(prefix.size() + sender.size() + separator.size());
+    message->body_length_ = static_cast<uint32_t>(body.size());
+    message->line_length_ = static_cast<uint32_t>(line_length);
+    message->target_length_ = static_cast<uint32_t>(target.size());
+
+    char* out = reinterpret_cast<char*>(message + 1) + kSeqPrefixSpace;
+    if (seq) {
+        char prefix_buffer[kSeqPrefixSpace];
+        int length = std::snprintf(prefix_buffer, sizeof(prefix_buffer), "#%llu ",
+                                   static_cast<unsigned long long>(seq));
+        message->seq_prefix_length_ = static_cast<uint32_t>(length);
+        std::memcpy(out - length, prefix_buffer, static_cast<size_t>(length));
+    }
+    for (std::string_view part : {prefix, sender, separator, body}) {
+        std::memcpy(out, part.data(), part.size());
+        out += part.size();
+    }
+    *out++ = '\n';
+    std::memcpy(out, target.data(), target.size());
+
+    live_messages.fetch_add(1, std::memory_order_relaxed);
+    return MessagePtr(message);
+}
+
+void intrusive_ptr_release(const Message* message) {
+    if (message->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    size_t bytes = message->allocation_size_;
+    void* memory = const_cast<Message*>(message);
+    message->~Message();
+    live_messages.fetch_sub(1, std::memory_order_relaxed);
+    size_t index = class_for(bytes);
+    if (index < kClassCount && kSizeClasses[index] == bytes) {
+        size_class(index).deallocate(memory, bytes);
+    } else {
+        ::operator delete(memory);
+    }
+}
+
+void Message::register_metrics() {
+    Metrics &metrics = Metrics::getInstance();
+    metrics.gauge_callback("chat_messages_live", "Chat messages referenced by queues or caches",
+        []{ return live_messages.load(std::memory_order_relaxed); });
+    metrics.gauge_callback("chat_message_slab_bytes", "Memory reserved for chat messages", []{
+        size_t bytes = 0;
+        for (size_t i = 0; i < kClassCount; ++i) {
+            bytes += size_class(i).reserved_bytes();
+        }
+        return static_cast<int64_t>(bytes);
+    });
+}
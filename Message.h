@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <boost/intrusive_ptr.hpp>
+
+class Message;
+using MessagePtr = boost::intrusive_ptr<const Message>;
+
+// One chat line, created once when it is sent and then shared, not copied,
+// by everything that handles it: the DB writer's queue, each recipient's
+// output queue, the history cache and the cluster relay. The header and all
+// of its text are a single allocation from size-classed slabs (see
+// SlabPool), and the text is laid out as the line clients receive
+// ("alice: hi\n", "[Private] alice: hi\n" for a DM), so the common wire
+// format costs nothing per recipient; sender and body are views into it.
+// The text is preceded by "#<seq> ", so the sequenced form clients get after
+// /sync is a view into the same bytes.
+//
+// Immutable once created, so any thread may read it; the reference count
+// is atomic because the DB writer drops its references on its own thread.
+class Message {
+public:
+    static constexpr std::string_view kPrivatePrefix = "[Private] ";
+
+    // seq is the message's row id (see Database::next_sequence), 0 for one
+    // not persisted here; timestamp_ms 0 means now
+    static MessagePtr create(std::string_view sender, std::string_view target, std::string_view body,
+                             uint64_t seq = 0, int64_t timestamp_ms = 0);
+    // A line formatted elsewhere (e.g. relayed by a peer); sender and body
+    // are recovered from it when it has the usual shape
+    static MessagePtr parse(std::string_view line, std::string_view target);
+
+    uint64_t seq() const { return seq_; }
+    int64_t timestamp_ms() const { return timestamp_ms_; }  // Unix time it was sent
+    std::string_view sender() const { return {text() + sender_offset_, sender_length_}; }
+    std::string_view body() const { return {text() + body_offset_, body_length_}; }
+    std::string_view target() const { return {text() + line_length_ + 1, target_length_}; }   // empty for the room
+    bool is_private() const { return target_length_ != 0; }
+
+    // As clients see it, without and with the trailing newline
+    std::string_view text_line() const { return {text(), line_length_}; }
+    std::string_view wire_line() const { return {text(), line_length_ + 1}; }
+    // "#<seq> " followed by wire_line(); just wire_line() without a seq
+    std::string_view sequenced_wire_line() const {
+        return {text() - seq_prefix_length_, seq_prefix_length_ + line_length_ + 1};
+    }
+
+    // Messages alive and the memory reserved for them, exported as metrics
+    static void register_metrics();
+
+private:
+    Message() = default;
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+
+    static MessagePtr build(std::string_view prefix, std::string_view sender, std::string_view separator,
+                            std::string_view body, std::string_view target, uint64_t seq, int64_t timestamp_ms);
+    // "#<seq> " occupies the last seq_prefix_length_ of kSeqPrefixSpace
+    static constexpr uint32_t kSeqPrefixSpace = 22;
+    const char* text() const { return reinterpret_cast<const char*>(this + 1) + kSeqPrefixSpace; }
+
+    friend void intrusive_ptr_add_ref(const Message* message) {
+        message->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    friend void intrusive_ptr_release(const Message* message);
+
+    mutable std::atomic<uint32_t> refs_{0};
+    uint32_t allocation_size_ = 0;
+    uint64_t seq_ = 0;
+    int64_t timestamp_ms_ = 0;
+    uint32_t seq_prefix_length_ = 0;
+    uint32_t sender_offset_ = 0;
+    uint32_t sender_length_ = 0;
+    uint32_t body_offset_ = 0;
+    uint32_t body_length_ = 0;
+    uint32_t line_length_ = 0;      // text bytes before the newline
+    uint32_t target_length_ = 0;    // stored after the newline
+    // follows: kSeqPrefixSpace bytes ending in "#<seq> ", line, '\n', target
+};
@@ -0,0 +1,225 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <sstream>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+
+// Index of the highest set bit; value must be nonzero
+inline int highest_bit(uint64_t value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+} // namespace
+
+namespace metrics_detail {
+size_t shard_index() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return index;
+}
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (auto &shard : shards_) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t Histogram::bucket_for(uint64_t micros) {
+    micros = std::min<uint64_t>(micros, (uint64_t(1) << kMaxExponent) - 1);
+    if (micros < static_cast<uint64_t>(kSubBuckets)) {
+        return static_cast<size_t>(micros);
+    }
+    int exponent = highest_bit(micros);
+    size_t sub = (micros >> (exponent - kSubBits)) & (kSubBuckets - 1);
+    return static_cast<size_t>(exponent - kSubBits + 1) * kSubBuckets + sub;
+}
+
+uint64_t Histogram::bucket_upper(size_t bucket) {
+    if (bucket < static_cast<size_t>(kSubBuckets)) {
+        return bucket;
+    }
+    int exponent = static_cast<int>(bucket / kSubBuckets) - 1 + kSubBits;
+    uint64_t sub = bucket % kSubBuckets;
+    uint64_t lower = (kSubBuckets + sub) << (exponent - kSubBits);
+    return lower + (uint64_t(1) << (exponent - kSubBits)) - 1;
+}
+
+void Histogram::record(uint64_t micros) {
+    Shard &shard = shards_[metrics_detail::shard_index()];
+    shard.buckets[bucket_for(micros)].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(micros, std::memory_order_relaxed);
+    uint64_t seen = shard.max.load(std::memory_order_relaxed);
+    while (micros > seen &&
+           !shard.max.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+    }
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snap;
+    snap.buckets.assign(kBuckets, 0);
+    for (auto &shard : shards_) {
+        snap.sum += shard.sum.load(std::memory_order_relaxed);
+        snap.max = std::max(snap.max, shard.max.load(std::memory_order_relaxed));
+        for (int i = 0; i < kBuckets; ++i) {
+            snap.buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+    // Count from the buckets so quantiles agree with it under concurrent writes
+    for (uint64_t b : snap.buckets) {
+        snap.count += b;
+    }
+    return snap;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count));
+    rank = std::min(std::max<uint64_t>(rank, 1), count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(bucket_upper(i), max);
+        }
+    }
+    return max;
+}
+
+Metrics::Entry& Metrics::find_or_add(const std::string &name, const std::string &help,
+                                     const std::string &labels, Kind kind) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto &entry : entries_) {
+        if (entry->name == name && entry->labels == labels && entry->kind == kind) {
+            return *entry;
+        }
+    }
+    auto entry = std::make_unique<Entry>();
+    entry->name = name;
+    entry->help = help;
+    entry->labels = labels;
+    entry->kind = kind;
+    switch (kind) {
+        case Kind::COUNTER: entry->counter = std::make_unique<Counter>(); break;
+        case Kind::GAUGE: entry->gauge = std::make_unique<Gauge>(); break;
+        case Kind::HISTOGRAM: entry->histogram = std::make_unique<Histogram>(); break;
+        case Kind::CALLBACK: break;
+    }
+    entries_.push_back(std::move(entry));
+    return *entries_.back();
+}
+
+Counter& Metrics::counter(const std::string &name, const std::string &help, const std::string &labels) {
+    return *find_or_add(name, help, labels, Kind::COUNTER).counter;
+}
+
+Gauge& Metrics::gauge(const std::string &name, const std::string &help, const std::string &labels) {
+    return *find_or_add(name, help, labels, Kind::GAUGE).gauge;
+}
+
+Histogram& Metrics::histogram(const std::string &name, const std::string &help, const std::string &labels) {
+    return *find_or_add(name, help, labels, Kind::HISTOGRAM).histogram;
+}
+
+void Metrics::gauge_callback(const std::string &name, const std::string &help, std::function<int64_t()> fn) {
+    Entry &entry = find_or_add(name, help, "", Kind::CALLBACK);
+    std::lock_guard<std::mutex> lock(mtx_);
+    entry.callback = std::move(fn);
+}
+
+static std::string format_seconds(uint64_t micros) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.6f", static_cast<double>(micros) / 1e6);
+    return buf;
+}
+
+static std::string with_label(const std::string &labels, const std::string &extra) {
+    if (labels.empty()) return "{" + extra + "}";
+    return "{" + labels + "," + extra + "}";
+}
+
+std::string Metrics::render_prometheus() const {
+    // Group series by metric name so HELP/TYPE appear once per family
+    std::map<std::string, std::vector<const Entry*>> families;
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto &entry : entries_) {
+        families[entry->name].push_back(entry.get());
+    }
+
+    std::ostringstream out;
+    for (auto &family : families) {
+        const Entry &first = *family.second.front();
+        const char *type = "gauge";
+        if (first.kind == Kind::COUNTER) type = "counter";
+        else if (first.kind == Kind::HISTOGRAM) type = "summary";
+        out << "# HELP " << family.first << " " << first.help << "\n";
+        out << "# TYPE " << family.first << " " << type << "\n";
+
+        for (const Entry *entry : family.second) {
+            std::string labels = entry->labels.empty() ? "" : "{" + entry->labels + "}";
+            switch (entry->kind) {
+                case Kind::COUNTER:
+                    out << entry->name << labels << " " << entry->counter->value() << "\n";
+                    break;
+                case Kind::GAUGE:
+                    out << entry->name << labels << " " << entry->gauge->value() << "\n";
+                    break;
+                case Kind::CALLBACK:
+                    out << entry->name << labels << " " << (entry->callback ? entry->callback() : 0) << "\n";
+                    break;
+                case Kind::HISTOGRAM: {
+                    Histogram::Snapshot snap = entry->histogram->snapshot();
+                    for (const char *q : {"0.5", "0.9", "0.99", "0.999"}) {
+                        out << entry->name << with_label(entry->labels, std::string("quantile=\"") + q + "\"")
+                            << " " << format_seconds(snap.quantile(std::stod(q))) << "\n";
+                    }
+                    out << entry->name << "_sum" << labels << " " << format_seconds(snap.sum) << "\n";
+                    out << entry->name << "_count" << labels << " " << snap.count << "\n";
+                    break;
+                }
+            }
+        }
+    }
+    return out.str();
+}
+
+std::string Metrics::render_summary() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::ostringstream out;
+    out << "===== Server Stats =====";
+    for (auto &entry : entries_) {
+        out << "\n" << entry->name;
+        if (!entry->labels.empty()) out << "{" << entry->labels << "}";
+        switch (entry->kind) {
+            case Kind::COUNTER: out << ": " << entry->counter->value(); break;
+            case Kind::GAUGE: out << ": " << entry->gauge->value(); break;
+            case Kind::CALLBACK: out << ": " << (entry->callback ? entry->callback() : 0); break;
+            case Kind::HISTOGRAM: {
+                Histogram::Snapshot snap = entry->histogram->snapshot();
+                out << ": count=" << snap.count
+                    << " p50=" << snap.quantile(0.5) << "us"
+                    << " p99=" << snap.quantile(0.99) << "us"
+                    << " max=" << snap.max << "us";
+                break;
+            }
+        }
+    }
+    return out.str();
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Writers update one of kShards cache-line sized slots picked per thread, so
+// concurrent increments never share a line; readers sum the shards.
+namespace metrics_detail {
+constexpr size_t kShards = 16;
+size_t shard_index();
+
+struct alignas(64) PaddedCounter {
+    std::atomic<uint64_t> value{0};
+};
+}
+
+class Counter {
+public:
+    void inc(uint64_t n = 1) {
+        shards_[metrics_detail::shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+
+private:
+    metrics_detail::PaddedCounter shards_[metrics_detail::kShards];
+};
+
+class Gauge {
+public:
+    void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// HDR-style latency histogram over microseconds. Values below 8 get exact
+// buckets and each higher power of two is split into 8 linear sub-buckets,
+// so quantiles are within 12.5% up to 2^40us (~12 days) with 304 buckets.
+class Histogram {
+public:
+    static constexpr int kSubBits = 3;
+    static constexpr int kSubBuckets = 1 << kSubBits;
+    static constexpr int kMaxExponent = 40;
+    static constexpr int kBuckets = (kMaxExponent - kSubBits + 1) * kSubBuckets;
+
+    void record(uint64_t micros);
+    void record(std::chrono::steady_clock::duration elapsed) {
+        record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+    }
+
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;       // microseconds
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets;
+        // Upper bound (microseconds) of the bucket holding quantile q
+        uint64_t quantile(double q) const;
+    };
+    Snapshot snapshot() const;
+
+    static size_t bucket_for(uint64_t micros);
+    static uint64_t bucket_upper(size_t bucket);
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+        std::atomic<uint64_t> buckets[kBuckets];
+        Shard() {
+            for (auto &b : buckets) b.store(0, std::memory_order_relaxed);
+        }
+    };
+    Shard shards_[metrics_detail::kShards];
+};
+
+// Records the lifetime of the scope into a histogram
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram &histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.record(std::chrono::steady_clock::now() - start_); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram &histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Process-wide registry. Metrics are created once (under a mutex) and live
+// until exit, so callers keep the returned reference and update it lock-free.
+// Labels are given pre-formatted, e.g. command="msg".
+class Metrics {
+public:
+    static Metrics& getInstance() {
+        static Metrics instance;
+        return instance;
+    }
+
+    Counter& counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    Gauge& gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    Histogram& histogram(const std::string &name, const std::string &help, const std::string &labels = "");
+    // Gauge whose value is computed when metrics are read
+    void gauge_callback(const std::string &name, const std::string &help, std::function<int64_t()> fn);
+
+    // Prometheus text exposition format (version 0.0.4)
+    std::string render_prometheus() const;
+    // Short human-readable summary for the /stats command
+    std::string render_summary() const;
+
+private:
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    enum class Kind { COUNTER, GAUGE, HISTOGRAM, CALLBACK };
+    struct Entry {
+        std::string name;
+        std::string help;
+        std::string labels;
+        Kind kind;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<int64_t()> callback;
+    };
+    Entry& find_or_add(const std::string &name, const std::string &help,
+                       const std::string &labels, Kind kind);
+
+    mutable std::mutex mtx_;    // guards entries_ (registration and reads only)
+    std::vector<std::unique_ptr<Entry>> entries_;
+};
@@ -0,0 +1,76 @@
+#include "MetricsServer.h"
+#include "Metrics.h"
+#include "Logger.h"
+
+MetricsServer::MetricsServer(const std::string& address, unsigned short port)
+    : acceptor_(io_context_, boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(address), port)) {
+    LOG_INFO("Metrics endpoint listening on http://", address, ":", port, "/metrics");
+}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+void MetricsServer::start() {
+    accept_loop();
+    thread_ = std::thread([this]{ io_context_.run(); });
+}
+
+void MetricsServer::stop() {
+    if (!thread_.joinable()) return;
+    io_context_.stop();
+    thread_.join();
+    boost::system::error_code ec;
+    acceptor_.close(ec);
+}
+
+void MetricsServer::accept_loop() {
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (!ec) {
+                handle(std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket)));
+            }
+            if (acceptor_.is_open()) {
+                accept_loop();
+            }
+        });
+}
+
+void MetricsServer::handle(std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
+    // Give slow or idle clients a few seconds to send their request
+    auto timer = std::make_shared<boost::asio::steady_timer>(io_context_, std::chrono::seconds(5));
+    timer->async_wait([socket](const boost::system::error_code& ec) {
+        if (!ec) {
+            boost::system::error_code ignored;
+            socket->close(ignored);
+        }
+    });
+
+    auto request = std::make_shared<boost::asio::streambuf>(8192);
+    boost::asio::async_read_until(*socket, *request, "\r\n\r\n",
+        [socket, request, timer](boost::system::error_code ec, std::size_t /*length*/) {
+            timer->cancel();
+            if (ec) return;
+
+            std::istream in(request.get());
+            std::string method, path;
+            in >> method >> path;
+
+            auto response = std::make_shared<std::string>();
+            if (method == "GET" && (path == "/metrics" || path.rfind("/metrics?", 0) == 0)) {
+                std::string body = Metrics::getInstance().render_prometheus();
+                *response = "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                            "Connection: close\r\n\r\n" + body;
+            } else {
+                *response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            boost::asio::async_write(*socket, boost::asio::buffer(*response),
+                [socket, response](boost::system::error_code, std::size_t) {
+                    boost::system::error_code ignored;
+                    socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                    socket->close(ignored);
+                });
+        });
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Minimal HTTP/1.0 endpoint serving GET /metrics in Prometheus text format.
+// Runs its own io_context on a dedicated thread so scrapes never queue behind
+// chat traffic on the main loop.
+class MetricsServer {
+public:
+    MetricsServer(const std::string& address, unsigned short port);
+    ~MetricsServer();
+    void start();
+    void stop();
+
+private:
+    void accept_loop();
+    void handle(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
+
+    boost::asio::io_context io_context_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    std::thread thread_;
+};
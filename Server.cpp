@@ -1,36 +1,78 @@
 #include "Server.h"
 #include "Logger.h"
+#include "Handoff.h"
+#include <algorithm>
 #include <iostream>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
-Server::Server(boost::asio::io_context& io_context, short port, int maxConnections)
-    : acceptor_(io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+namespace {
+
+// Pause before accepting again after a failed accept (e.g. EMFILE), so a
+// listener that stays readable doesn't spin the io thread
+constexpr std::chrono::milliseconds kAcceptBackoff(100);
+
+void open_listener(boost::asio::ip::tcp::acceptor& acceptor, short port, bool reusePort) {
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+    if (reusePort) {
+        // Must be set before bind, by every process sharing the port
+        using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        acceptor.set_option(reuse_port(true));
+    }
+#endif
+    acceptor.bind(endpoint);
+    acceptor.listen();
+}
+
+} // namespace
+
+Server::Server(boost::asio::io_context& io_context, short port, int maxConnections, bool reusePort)
+    : acceptor_(io_context),
+      accept_backoff_(io_context),
+      tls_accept_backoff_(io_context),
+      io_context_(io_context),
+      maxConnections_(maxConnections),
+      running_(false),
+      threadPool_(maxConnections) {
+    open_listener(acceptor_, port, reusePort);
+    LOG_DEBUG("Server constructed (port=", port, ", maxConnections=", maxConnections, ")");
+}
+
+Server::Server(boost::asio::io_context& io_context, boost::asio::ip::tcp::acceptor acceptor, int maxConnections)
+    : acceptor_(std::move(acceptor)),
+      accept_backoff_(io_context),
+      tls_accept_backoff_(io_context),
       io_context_(io_context),
       maxConnections_(maxConnections),
       running_(false),
       threadPool_(maxConnections) {
-    Logger::log("Server constructed (port=" + std::to_string(port) +
-                ", maxConnections=" + std::to_string(maxConnections) + ")", LogLevel::DEBUG);
+    LOG_DEBUG("Server constructed on a handed-off listener (maxConnections=", maxConnections, ")");
 }
 
 Server::~Server() {
     stop();
 }
 
+void Server::listen_tls(short port, TlsContext& tls, bool reusePort) {
+    tls_acceptor_ = std::make_unique<boost::asio::ip::tcp::acceptor>(io_context_);
+    open_listener(*tls_acceptor_, port, reusePort);
+    tls_ = &tls;
+    LOG_INFO("Accepting TLS connections on port ", port);
+}
+
 void Server::start() {
-    Logger::log("Starting server...", LogLevel::INFO);
+    LOG_INFO("Starting server...");
     running_ = true;
 
     // Start accepting connections
-    acceptor_.async_accept(
-        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
-            if (!ec) {
-                Logger::log("New connection accepted", LogLevel::INFO);
-                handleClient(std::move(socket));
-            }
-            if (running_) {
-                acceptLoop();
-            }
-        });
+    acceptLoop(acceptor_, nullptr);
+    if (tls_acceptor_) {
+        acceptLoop(*tls_acceptor_, tls_);
+    }
 }
 
 void Server::stop() {
@@ -39,27 +81,148 @@ void Server::stop() {
     
     boost::system::error_code ec;
     acceptor_.close(ec);
+    if (tls_acceptor_) {
+        tls_acceptor_->close(ec);
+    }
+    accept_backoff_.cancel(ec);
+    tls_accept_backoff_.cancel(ec);
     
-    Logger::log("Server stopped.", LogLevel::INFO);
+    LOG_INFO("Server stopped.");
 }
 
-void Server::acceptLoop() {
-    acceptor_.async_accept(
-        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
-            if (!ec) {
-                Logger::log("New connection accepted", LogLevel::INFO);
-                handleClient(std::move(socket));
+void Server::drain(std::chrono::milliseconds deadline, std::function<void()> on_drained) {
+    stop();
+    auto sessions = live_sessions();
+    size_t bytes = 0;
+    for (auto& session : sessions) {
+        bytes += session->pending_bytes();
+        session->begin_drain();
+    }
+    LOG_INFO("Shutdown: stopped accepting; draining ", sessions.size(), " connections with ", bytes,
+             " bytes queued, deadline ", deadline.count(), " ms");
+
+    on_drained_ = std::move(on_drained);
+    drain_started_ = std::chrono::steady_clock::now();
+    drain_deadline_ = drain_started_ + deadline;
+    drain_next_report_ = drain_started_ + std::chrono::seconds(1);
+    drain_timer_ = std::make_unique<boost::asio::steady_timer>(io_context_);
+    poll_drain();
+}
+
+void Server::poll_drain() {
+    auto now = std::chrono::steady_clock::now();
+    auto open = live_sessions();
+    open.erase(std::remove_if(open.begin(), open.end(),
+                              [](const std::shared_ptr<Session>& s) { return !s->is_open(); }),
+               open.end());
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - drain_started_).count();
+
+    if (open.empty()) {
+        LOG_INFO("Shutdown: all connections drained in ", elapsed, " ms");
+    } else if (now >= drain_deadline_) {
+        size_t bytes = 0;
+        for (auto& session : open) {
+            bytes += session->pending_bytes();
+            session->force_disconnect();
+        }
+        LOG_WARN("Shutdown: deadline reached, closed ", open.size(), " connections with ", bytes, " bytes unsent");
+    } else {
+        if (now >= drain_next_report_) {
+            size_t bytes = 0;
+            for (auto& session : open) {
+                bytes += session->pending_bytes();
             }
-            if (running_) {
-                acceptLoop();
+            LOG_INFO("Shutdown: ", open.size(), " connections still draining, ", bytes, " bytes queued");
+            drain_next_report_ = now + std::chrono::seconds(1);
+        }
+        drain_timer_->expires_after(std::chrono::milliseconds(50));
+        drain_timer_->async_wait([this](const boost::system::error_code& ec) {
+            if (!ec) poll_drain();
+        });
+        return;
+    }
+    auto on_drained = std::move(on_drained_);
+    on_drained();
+}
+
+#ifndef _WIN32
+int Server::release_listener() {
+    running_ = false;
+    boost::system::error_code ec;
+    if (tls_acceptor_) {
+        tls_acceptor_->close(ec);
+    }
+    int fd = acceptor_.is_open() ? acceptor_.release(ec) : -1;
+    return ec ? -1 : fd;
+}
+#endif
+
+std::vector<std::shared_ptr<Session>> Server::live_sessions() {
+    std::vector<std::shared_ptr<Session>> live;
+    for (auto& weak : sessions_) {
+        if (auto session = weak.lock()) {
+            live.push_back(session);
+        }
+    }
+    return live;
+}
+
+#ifndef _WIN32
+void Server::resume_session(const HandoffSession& state) {
+    boost::system::error_code ec;
+    boost::asio::ip::tcp::socket socket(io_context_);
+    socket.assign(acceptor_.local_endpoint(ec).protocol(), state.fd, ec);
+    if (ec) {
+        LOG_ERROR("Cannot resume handed-off session of ", state.username, ": ", ec.message());
+        close(state.fd);
+        return;
+    }
+    auto session = Session::create(std::move(socket));
+    track_session(session);
+    session->resume(state);
+}
+#endif
+
+void Server::acceptLoop(boost::asio::ip::tcp::acceptor& acceptor, TlsContext* tls) {
+    acceptor.async_accept(
+        [this, &acceptor, tls](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (!running_) {
+                return;
             }
+            if (!ec) {
+                LOG_INFO("New connection accepted");
+                handleClient(std::move(socket), tls);
+                acceptLoop(acceptor, tls);
+                return;
+            }
+            // The pending connection stays queued, so accepting again at
+            // once would fail the same way until a descriptor frees up
+            LOG_WARN("Accept failed: ", ec.message(), ", retrying in ", kAcceptBackoff.count(), " ms");
+            auto& backoff = &acceptor == &acceptor_ ? accept_backoff_ : tls_accept_backoff_;
+            backoff.expires_after(kAcceptBackoff);
+            backoff.async_wait([this, &acceptor, tls](const boost::system::error_code& wait_ec) {
+                if (!wait_ec && running_) acceptLoop(acceptor, tls);
+            });
         });
 }
 
-void Server::handleClient(boost::asio::ip::tcp::socket socket) {
-    Logger::log("Handling new client connection", LogLevel::INFO);
+void Server::handleClient(boost::asio::ip::tcp::socket socket, TlsContext* tls) {
+    LOG_INFO("Handling new client connection");
     
     // Create a new session and start it
-    auto session = std::make_shared<Session>(std::move(socket));
+    auto session = Session::create(std::move(socket), tls);
+    track_session(session);
     session->start();
+}
+
+void Server::track_session(const std::shared_ptr<Session>& session) {
+    // Closed sessions leave expired entries behind. Sweeping only once the
+    // list has doubled since the last sweep keeps accepts O(1) amortized.
+    if (sessions_.size() >= sweep_at_) {
+        sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(),
+                                       [](const std::weak_ptr<Session>& w) { return w.expired(); }),
+                        sessions_.end());
+        sweep_at_ = std::max<size_t>(kMinSessionSweep, 2 * sessions_.size());
+    }
+    sessions_.push_back(session);
 } 
\ No newline at end of file
@@ -2,25 +2,68 @@
 #include <boost/asio.hpp>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <thread>
 #include <vector>
 #include "Session.h"
 #include "Network/ThreadPool.h"
 
+struct HandoffSession;
+class TlsContext;
+
 class Server {
 public:
-    Server(boost::asio::io_context& io_context, short port, int maxConnections);
+    // With reusePort several processes can listen on the same port and the
+    // kernel spreads incoming connections across them
+    Server(boost::asio::io_context& io_context, short port, int maxConnections, bool reusePort = false);
+    // Serves on a listening socket handed over by the previous process
+    Server(boost::asio::io_context& io_context, boost::asio::ip::tcp::acceptor acceptor, int maxConnections);
     ~Server();
+    // Also accepts TLS connections on port, before start(); tls must
+    // outlive the server
+    void listen_tls(short port, TlsContext& tls, bool reusePort = false);
     void start();
     void stop();
 
+    // Staged shutdown: stops accepting, lets every connection finish its
+    // output and close (see Session::begin_drain), and force-closes the
+    // rest at the deadline. on_drained runs on the io_context either way.
+    void drain(std::chrono::milliseconds deadline, std::function<void()> on_drained);
+
+#ifndef _WIN32
+    // Upgrade support (see Handoff): stops accepting and gives up the
+    // plaintext listening socket, or -1 if there is none. The TLS listener
+    // is closed, as TLS sessions can't be handed over.
+    int release_listener();
+    // Takes over a connection from the previous process
+    void resume_session(const HandoffSession& state);
+#endif
+    // Every open client connection, logged in or not
+    std::vector<std::shared_ptr<Session>> live_sessions();
+
 private:
-    void acceptLoop();
-    void handleClient(boost::asio::ip::tcp::socket socket);
+    void acceptLoop(boost::asio::ip::tcp::acceptor& acceptor, TlsContext* tls);
+    void handleClient(boost::asio::ip::tcp::socket socket, TlsContext* tls);
+    void track_session(const std::shared_ptr<Session>& session);
+    void poll_drain();
 
     boost::asio::ip::tcp::acceptor acceptor_;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> tls_acceptor_;
+    // Delay re-arming a listener after a failed accept; see acceptLoop
+    boost::asio::steady_timer accept_backoff_;
+    boost::asio::steady_timer tls_accept_backoff_;
+    TlsContext* tls_ = nullptr;
     boost::asio::io_context& io_context_;
     int maxConnections_;
     std::atomic<bool> running_;
     ThreadPool threadPool_;
+    static constexpr size_t kMinSessionSweep = 64;
+    std::vector<std::weak_ptr<Session>> sessions_;
+    size_t sweep_at_ = kMinSessionSweep;    // sessions_ size that triggers a sweep
+    std::unique_ptr<boost::asio::steady_timer> drain_timer_;
+    std::chrono::steady_clock::time_point drain_started_;
+    std::chrono::steady_clock::time_point drain_deadline_;
+    std::chrono::steady_clock::time_point drain_next_report_;
+    std::function<void()> on_drained_;
 }; 
\ No newline at end of file
@@ -3,47 +3,293 @@
 #include "SessionManager.h"
 #include "Logger.h"
 #include "Config.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "FlightRecorder.h"
+#include "Handoff.h"
+#include "SlabPool.h"
+#include "TlsContext.h"
 #include <boost/algorithm/string.hpp>
 #include <string>
+#include <cstring>
 #include <iostream>
 #include <atomic>
 
-// global for performance counting
-extern std::atomic<int> g_messageCount;
+static Counter& messages_received =
+    Metrics::getInstance().counter("chat_messages_received_total", "Lines received from clients");
+static Gauge& queued_bytes =
+    Metrics::getInstance().gauge("chat_session_queued_bytes", "Output queued on client connections");
+
+// Sessions together with their shared_ptr control block, whose size is only
+// known to allocate_shared (hence the block size taken on first use)
+static SlabPool session_slab(0, 256);
+// Receive buffers, each lent to one read for the duration of its handler
+static SlabPool receive_buffers(2048, 16);
+
+namespace {
+
+// Lines a waiting output class may be overtaken by before it gets one through
+constexpr uint8_t kMaxOvertaken = 64;
+// Most plaintext one TLS record carries
+constexpr std::size_t kTlsRecordBytes = 16384;
+
+// A receive buffer borrowed from receive_buffers for one read
+class ReceiveBuffer {
+public:
+    explicit ReceiveBuffer(std::size_t size)
+        : size_(size), data_(static_cast<char*>(receive_buffers.allocate(size))) {}
+    ~ReceiveBuffer() { receive_buffers.deallocate(data_, size_); }
+    ReceiveBuffer(const ReceiveBuffer&) = delete;
+    ReceiveBuffer& operator=(const ReceiveBuffer&) = delete;
+    char* data() { return data_; }
+
+private:
+    std::size_t size_;
+    char* data_;
+};
+
+} // namespace
 
 // forward-declared in main.cpp
 extern boost::asio::io_context* g_io_context_ptr;
 
-Session::Session(boost::asio::ip::tcp::socket socket)
+static std::atomic<uint64_t> next_session_id{1};
+
+Session::Session(boost::asio::ip::tcp::socket socket, TlsContext* tls)
     : socket_(std::move(socket)),
+      tls_(tls ? std::make_unique<boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>>(socket_, tls->context())
+               : nullptr),
       idle_timer_(socket_.get_executor()),
-      authenticated_(false)
+      overtaken_{},
+      id_(next_session_id.fetch_add(1, std::memory_order_relaxed)),
+      authenticated_(false),
+      handed_off_(false),
+      handshaking_(false),
+      draining_(false),
+      said_goodbye_(false),
+      sequenced_(false),
+      command_router_(*this)
 {
-    // Load session timeout from config
-    std::string timeout_str = Config::getInstance().getValue("session_timeout", "300");
-    idle_timeout_seconds_ = std::stoi(timeout_str);
-    
-    Logger::log("New session created with timeout: " + std::to_string(idle_timeout_seconds_), LogLevel::INFO);
+    LOG_INFO("New session created with timeout: ", Config::getInstance().settings().session_timeout_seconds);
+}
 
-    // Attach "this" session pointer to the command router
-    command_router_.set_session(shared_from_this());
+Session::~Session() {
+    queued_bytes.add(-static_cast<int64_t>(pending_bytes()));
+}
+
+std::shared_ptr<Session> Session::create(boost::asio::ip::tcp::socket socket, TlsContext* tls) {
+    return std::allocate_shared<Session>(SlabAllocator<Session>(session_slab), std::move(socket), tls);
+}
+
+void Session::register_metrics() {
+    Metrics &metrics = Metrics::getInstance();
+    metrics.gauge_callback("chat_connections_open", "Client connections with a live session",
+        []{ return static_cast<int64_t>(session_slab.blocks_in_use()); });
+    metrics.gauge_callback("chat_session_slab_bytes", "Memory reserved for sessions",
+        []{ return static_cast<int64_t>(session_slab.reserved_bytes()); });
+    metrics.gauge_callback("chat_session_block_bytes", "Size of one session, as allocated",
+        []{ return static_cast<int64_t>(session_slab.block_size()); });
+    metrics.gauge_callback("chat_receive_buffer_bytes", "Memory reserved for receive buffers",
+        []{ return static_cast<int64_t>(receive_buffers.reserved_bytes()); });
+    metrics.gauge_callback("chat_connection_memory_bytes",
+        "Average memory per open connection: its share of the slabs and receive buffers, plus queued output",
+        []{
+            size_t open = session_slab.blocks_in_use();
+            int64_t total = static_cast<int64_t>(session_slab.reserved_bytes() + receive_buffers.reserved_bytes()) +
+                            queued_bytes.value();
+            return open ? total / static_cast<int64_t>(open) : 0;
+        });
 }
 
 void Session::start() {
-    deliver("Welcome! Please login with: /login <username> <password>");
+    boost::system::error_code ec;
+    // Reads happen only once the socket is readable (see do_read)
+    socket_.non_blocking(true, ec);
+    auto remote = socket_.remote_endpoint(ec);
+    FlightRecorder::record(FlightEvent::Accept, id_, 0,
+                           ec ? std::string() : remote.address().to_string() + ":" + std::to_string(remote.port()));
     start_idle_timer();
+    if (!tls_) {
+        welcome();
+        return;
+    }
+    // The handshake and the ticket after it are several small writes; with
+    // Nagle each would wait for the client's delayed ACK
+    socket_.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+    // The idle timeout also bounds the handshake
+    handshaking_ = true;
+    auto self(shared_from_this());
+    tls_->async_handshake(boost::asio::ssl::stream_base::server, [this, self](const boost::system::error_code &ec) {
+        handshaking_ = false;
+        TlsContext::record_handshake(tls_->native_handle(), ec);
+        if (ec) {
+            LOG_INFO("TLS handshake failed: ", ec.message());
+            FlightRecorder::record(FlightEvent::SocketError, id_, static_cast<uint64_t>(ec.value()), "tls handshake");
+            boost::system::error_code ignored;
+            idle_timer_.cancel(ignored);
+            force_disconnect();
+            return;
+        }
+        welcome();
+    });
+}
+
+void Session::welcome() {
+    deliver("Welcome! Please login with: /login <username> <password>");
     do_read();
 }
 
-void Session::deliver(const std::string &msg) {
+void Session::deliver(const std::string &msg, Priority priority) {
+    uint64_t trace = Tracer::current();
+    queue_output({nullptr, msg + "\n", trace, trace ? Tracer::now_ns() : 0}, priority);
+}
+
+void Session::deliver(const MessagePtr &message, Priority priority) {
+    uint64_t trace = Tracer::current();
+    queue_output({message, {}, trace, trace ? Tracer::now_ns() : 0, sequenced_}, priority);
+}
+
+void Session::queue_output(Outgoing out, Priority priority) {
+    // Only one async_write may be in flight per socket, and its buffer must
+    // outlive it, so lines wait in their class's lane until it is done
+    queued_bytes.add(static_cast<int64_t>(out.bytes().size()));
+    if (writing_.empty()) {
+        writing_ = std::move(out);
+        do_write();
+        return;
+    }
+    if (!backlog_) {
+        backlog_ = std::make_unique<std::array<OutputLane, kPriorityCount>>();
+    }
+    (*backlog_)[static_cast<std::size_t>(priority)].items.push_back(std::move(out));
+}
+
+bool Session::take_output(Outgoing &out) {
+    if (!backlog_) {
+        return false;
+    }
+    auto &lanes = *backlog_;
+    // Strict priority, except that a class kept waiting this long gets one
+    // line through, so a steady stream of urgent lines can't stall it
+    // forever. Each class counts its own wait; of those due, the one that
+    // has waited longest goes first, so every waiting class gets its turn.
+    std::size_t next = kPriorityCount, due = kPriorityCount;
+    for (std::size_t i = 0; i < kPriorityCount; ++i) {
+        if (lanes[i].head == lanes[i].items.size()) {
+            overtaken_[i] = 0;
+            continue;
+        }
+        if (next == kPriorityCount) next = i;
+        if (overtaken_[i] >= kMaxOvertaken && (due == kPriorityCount || overtaken_[i] > overtaken_[due])) {
+            due = i;
+        }
+    }
+    if (next == kPriorityCount) {
+        backlog_.reset();
+        return false;
+    }
+    if (due != kPriorityCount) {
+        next = due;
+    }
+    overtaken_[next] = 0;
+    for (std::size_t i = next + 1; i < kPriorityCount; ++i) {
+        if (lanes[i].head < lanes[i].items.size()) {
+            ++overtaken_[i];
+        }
+    }
+
+    OutputLane &lane = lanes[next];
+    out = std::move(lane.items[lane.head++]);
+    if (lane.head == lane.items.size()) {
+        std::vector<Outgoing>().swap(lane.items);
+        lane.head = 0;
+    } else if (lane.head >= 64 && lane.head * 2 >= lane.items.size()) {
+        // Under a steady backlog the lane never drains; drop the sent
+        // (moved-from) entries once they are half of it
+        lane.items.erase(lane.items.begin(), lane.items.begin() + static_cast<std::ptrdiff_t>(lane.head));
+        lane.head = 0;
+    }
+    return true;
+}
+
+void Session::coalesce_output() {
+    // Encryption copies every line anyway, and each record costs a header,
+    // a tag and a write of its own, so under a backlog several lines share one
+    Outgoing next;
+    while (writing_.bytes().size() < kTlsRecordBytes && take_output(next)) {
+        if (writing_.message) {
+            writing_.data.assign(writing_.bytes());
+            writing_.message.reset();
+        }
+        writing_.data.append(next.bytes());
+        if (!writing_.trace_id) {
+            writing_.trace_id = next.trace_id;
+            writing_.queued_ns = next.queued_ns;
+        }
+    }
+}
+
+void Session::clear_output() {
+    queued_bytes.add(-static_cast<int64_t>(pending_bytes()));
+    writing_.message.reset();
+    std::string().swap(writing_.data);
+    backlog_.reset();
+}
+
+void Session::do_write() {
     auto self(shared_from_this());
-    boost::asio::async_write(socket_, boost::asio::buffer(msg + "\n"),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-            if (ec) {
-                Logger::instance().log(LogLevel::ERROR,
-                    "Error delivering message to " + username_ + ": " + ec.message());
+    if (tls_) {
+        coalesce_output();
+    }
+    std::string_view bytes = writing_.bytes();
+    auto on_written = [this, self](boost::system::error_code ec, std::size_t length) {
+        if (ec && handed_off_) {
+            // Cancelled by begin_handoff; the rest goes to the new process
+            writing_.data = std::string(writing_.bytes().substr(length));
+            writing_.message.reset();
+            return;
+        }
+        if (ec) {
+            LOG_ERROR("Error delivering message to ", username_, ": ", ec.message());
+            FlightRecorder::record(FlightEvent::SocketError, id_, static_cast<uint64_t>(ec.value()), username_);
+            clear_output();
+            if (draining_) {
+                force_disconnect();
             }
-        });
+            return;
+        }
+        if (writing_.trace_id) {
+            Tracer::getInstance().record(writing_.trace_id, "socket.write", writing_.queued_ns,
+                                         Tracer::now_ns(), true);
+        }
+        queued_bytes.add(-static_cast<int64_t>(writing_.bytes().size()));
+        if (next_output()) {
+            do_write();
+            return;
+        }
+        // Idle; releases the line's storage as well
+        writing_.message.reset();
+        std::string().swap(writing_.data);
+        if (draining_ && !said_goodbye_) {
+            say_goodbye();
+            return;
+        }
+        if (draining_) {
+            // Everything is out. Closing with unread input would reset
+            // the connection, so if there is any, the read below closes
+            // once it has discarded it.
+            boost::system::error_code ignored;
+            socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ignored);
+            if (socket_.available(ignored) == 0) {
+                force_disconnect();
+            }
+        }
+    };
+    if (tls_) {
+        boost::asio::async_write(*tls_, boost::asio::buffer(bytes.data(), bytes.size()), std::move(on_written));
+    } else {
+        boost::asio::async_write(socket_, boost::asio::buffer(bytes.data(), bytes.size()), std::move(on_written));
+    }
 }
 
 bool Session::is_authenticated() const {
@@ -67,33 +313,192 @@ void Session::force_disconnect() {
     socket_.close(ignored);
 }
 
+void Session::begin_drain() {
+    if (draining_ || !socket_.is_open()) return;
+    if (handshaking_) {
+        force_disconnect();
+        return;
+    }
+    draining_ = true;
+    boost::system::error_code ignored;
+    idle_timer_.cancel(ignored);
+    // The goodbye must follow everything already queued. Any lane can be
+    // overtaken by a later, more urgent line, so rather than queue it at
+    // some priority it is written on its own once the lanes are empty; if
+    // nothing is being written, that is now.
+    if (writing_.empty()) {
+        say_goodbye();
+    }
+}
+
+void Session::say_goodbye() {
+    said_goodbye_ = true;
+    deliver("Server is shutting down now. You will be disconnected.");
+}
+
+size_t Session::pending_bytes() const {
+    size_t bytes = writing_.bytes().size();
+    if (backlog_) {
+        for (auto &lane : *backlog_) {
+            for (size_t i = lane.head; i < lane.items.size(); ++i) {
+                bytes += lane.items[i].bytes().size();
+            }
+        }
+    }
+    return bytes;
+}
+
+int Session::begin_handoff() {
+    handed_off_ = true;
+    boost::system::error_code ec;
+    idle_timer_.cancel(ec);
+    if (!socket_.is_open()) {
+        return -1;
+    }
+    if (tls_) {
+        // The client reconnects, resuming its TLS session, and catches up
+        // with /sync
+        socket_.close(ec);
+        return -1;
+    }
+    // Cancels the pending read and write; their handlers see handed_off_
+    int fd = socket_.release(ec);
+    return ec ? -1 : fd;
+}
+
+void Session::fill_handoff(HandoffSession &state) const {
+    state.authenticated = authenticated_;
+    state.sequenced = sequenced_;
+    state.username = username_;
+    state.read_buffer = read_buffer_;
+    if (!writing_.empty()) {
+        state.pending_output.emplace_back(writing_.bytes());
+    }
+    // In priority order, roughly as they would have been sent; the new
+    // process queues them all as one class, so this order is kept
+    if (backlog_) {
+        for (auto &lane : *backlog_) {
+            for (size_t i = lane.head; i < lane.items.size(); ++i) {
+                state.pending_output.emplace_back(lane.items[i].bytes());
+            }
+        }
+    }
+}
+
+void Session::resume(const HandoffSession &state) {
+    boost::system::error_code ec;
+    socket_.non_blocking(true, ec);
+    authenticated_ = state.authenticated;
+    sequenced_ = state.sequenced;
+    username_ = state.username;
+    read_buffer_ = state.read_buffer;
+    FlightRecorder::record(FlightEvent::Accept, id_, 0, "handoff " + username_);
+    if (authenticated_) {
+        UserManager::getInstance().add_user(username_, shared_from_this());
+        SessionManager::getInstance().add_session(shared_from_this());
+    }
+    for (auto &line : state.pending_output) {
+        if (!line.empty()) {
+            queue_output({nullptr, line, 0, 0}, Priority::Control);
+        }
+    }
+    start_idle_timer();
+    do_read();
+}
+
 void Session::do_read() {
     auto self(shared_from_this());
-    socket_.async_read_some(boost::asio::buffer(data_, max_length_),
-        [this, self](boost::system::error_code ec, std::size_t length) {
-            if (!ec) {
-                reset_idle_timer();
-                // If length is abnormally large, we can handle that
-                if (length > max_length_) {
-                    deliver("Message too long!");
-                    return;
-                }
-
-                std::string msg(data_, length);
-                boost::algorithm::trim(msg);
-                process_message(msg);
+    if (tls_) {
+        // Received records may decrypt to nothing (or to more than one read
+        // takes), so readiness of the socket says nothing; read through the stream
+        auto buffer = std::make_shared<ReceiveBuffer>(max_length_);
+        tls_->async_read_some(boost::asio::buffer(buffer->data(), max_length_),
+            [this, self, buffer](boost::system::error_code ec, std::size_t length) {
+                handle_read(ec, buffer->data(), length);
+            });
+        return;
+    }
+    // Wait for input before taking a buffer, so idle connections hold none
+    socket_.async_wait(boost::asio::ip::tcp::socket::wait_read,
+        [this, self](boost::system::error_code ec) {
+            if (ec) {
+                handle_read(ec, nullptr, 0);
+                return;
+            }
+            ReceiveBuffer buffer(max_length_);
+            std::size_t length = socket_.read_some(boost::asio::buffer(buffer.data(), max_length_), ec);
+            if (ec == boost::asio::error::would_block) {
                 do_read();
-            } else {
-                Logger::instance().log(LogLevel::INFO, "Session ended for user: " + username_);
-                UserManager::instance().remove_user(username_);
-                SessionManager::instance().remove_session(self);
+                return;
             }
+            handle_read(ec, buffer.data(), length);
         });
 }
 
+void Session::handle_read(const boost::system::error_code &ec, const char *data, std::size_t length) {
+    if (!ec && !draining_) {
+        reset_idle_timer();
+        consume(data, length);
+        do_read();
+        return;
+    }
+    if (draining_) {
+        // Discard input until our output is out
+        boost::system::error_code ignored;
+        if (ec || (writing_.empty() && socket_.available(ignored) == 0)) {
+            force_disconnect();
+        } else {
+            do_read();
+        }
+    } else if (handed_off_) {
+        // The connection lives on in the new process
+    } else {
+        LOG_INFO("Session ended for user: ", username_);
+        FlightRecorder::record(FlightEvent::Disconnect, id_, static_cast<uint64_t>(ec.value()), username_);
+        UserManager::getInstance().remove_user(username_);
+        SessionManager::getInstance().remove_session(shared_from_this());
+        // Otherwise the idle timer keeps the session, and its descriptor,
+        // until it fires
+        boost::system::error_code ignored;
+        idle_timer_.cancel(ignored);
+        force_disconnect();
+    }
+}
+
+void Session::consume(const char *data, std::size_t length) {
+    // A read may hold several lines or part of one
+    const char *end = data + length;
+    while (data < end) {
+        const char *newline = draining_ ? nullptr : static_cast<const char*>(std::memchr(data, '\n', end - data));
+        if (!newline) {
+            // The rest of a line, or unprocessed input once a /shutdown
+            // stopped processing mid-read
+            read_buffer_.append(data, end);
+            break;
+        }
+        std::string msg;
+        if (read_buffer_.empty()) {
+            msg.assign(data, newline);
+        } else {
+            read_buffer_.append(data, newline);
+            msg.swap(read_buffer_);
+        }
+        data = newline + 1;
+        boost::algorithm::trim(msg);
+        if (!msg.empty()) {
+            TraceContext trace(Tracer::getInstance().maybe_start());
+            TraceSpan span("session.process");
+            process_message(msg);
+        }
+    }
+    if (read_buffer_.size() > max_length_) {
+        deliver("Message too long!");
+        std::string().swap(read_buffer_);
+    }
+}
+
 void Session::process_message(const std::string &msg) {
-    // Increase performance counter
-    g_messageCount++;
+    messages_received.inc();
 
     // If the user isn't authenticated, only allow /login
     if (!is_authenticated()) {
@@ -117,11 +522,19 @@ void Session::process_message(const std::string &msg) {
 
 void Session::start_idle_timer() {
     auto self(shared_from_this());
-    idle_timer_.expires_after(std::chrono::seconds(idle_timeout_seconds_));
+    // Read per reset so a reloaded session_timeout applies to open sessions
+    idle_timer_.expires_after(std::chrono::seconds(Config::getInstance().settings().session_timeout_seconds));
     idle_timer_.async_wait([this, self](const boost::system::error_code& ec) {
         if (!ec) {
+            if (handshaking_) {
+                force_disconnect();
+                return;
+            }
             deliver("Idle timeout. Disconnecting...");
-            Logger::log("Session timed out for user: " + username_, LogLevel::INFO);
+            LOG_INFO("Session timed out for user: ", username_);
+            FlightRecorder::record(FlightEvent::Timeout, id_,
+                                   static_cast<uint64_t>(Config::getInstance().settings().session_timeout_seconds),
+                                   username_);
             force_disconnect();
         }
     });
@@ -1,21 +1,43 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <array>
 #include <memory>
 #include <string>
 #include <functional>
 #include <vector>
-#include <stack>
+#include <cstdint>
 
 #include "CommandRouter.h"
+#include "Message.h"
+
+struct HandoffSession;
+class TlsContext;
 
 class Session : public std::enable_shared_from_this<Session> {
 public:
-    Session(boost::asio::ip::tcp::socket socket);
+    // With tls, the connection is encrypted and start() begins with the
+    // handshake; tls must outlive the session
+    Session(boost::asio::ip::tcp::socket socket, TlsContext* tls = nullptr);
+    virtual ~Session();
+    // Allocates from the session slab (see SlabPool); the server creates
+    // every client session this way
+    static std::shared_ptr<Session> create(boost::asio::ip::tcp::socket socket, TlsContext* tls = nullptr);
     void start();
 
-    // Send a message to this session
-    void deliver(const std::string &msg);
+    // Classes of output, most urgent first. Each is queued separately and
+    // the writer takes the next line from the most urgent non-empty queue,
+    // so command replies and DMs overtake a backlog of room lines and bulk
+    // replies (history, search, sync) yield to everything else. Lines of
+    // one class keep their order.
+    enum class Priority : uint8_t { Control, Private, Broadcast, Bulk };
+    static constexpr std::size_t kPriorityCount = 4;
+
+    // Send a message to this session (virtual so benchmarks can mock it)
+    virtual void deliver(const std::string &msg, Priority priority = Priority::Control);
+    // Send a chat line; the session shares it rather than copying it
+    virtual void deliver(const MessagePtr &message, Priority priority = Priority::Broadcast);
 
     // Authentication state
     bool is_authenticated() const;
@@ -25,28 +47,111 @@ public:
     void set_username(const std::string &name);
     std::string get_username() const;
 
+    // Once set (by /sync), chat lines are sent with their "#<seq> " prefix
+    // so the client can ack them and resume from the last one it saw
+    void set_sequenced(bool sequenced) { sequenced_ = sequenced; }
+    bool is_sequenced() const { return sequenced_; }
+
+    // Process-unique id, used to correlate flight recorder events
+    uint64_t get_id() const { return id_; }
+
     // Utility for referencing command router
     CommandRouter& get_command_router() { return command_router_; }
 
     // For graceful shutdown from within commands
     void force_disconnect();
 
+    // Shutdown (see Server::drain): input is no longer processed, and the
+    // connection closes once the queued output and then a goodbye are written
+    void begin_drain();
+    bool is_open() const { return socket_.is_open(); }
+    size_t pending_bytes() const;
+
+    // Upgrade support (see Handoff). begin_handoff detaches the socket and
+    // returns its descriptor (-1 if closed, or closed by it because the
+    // session is encrypted and its TLS state can't move); once the operations it cancels
+    // have completed, fill_handoff describes what the new process needs.
+    int begin_handoff();
+    void fill_handoff(HandoffSession &state) const;
+    // Continues a session handed off by the previous process, in place of start()
+    void resume(const HandoffSession &state);
+
+    // Memory held for connections (slabs, receive buffers, queued output),
+    // exported as metrics
+    static void register_metrics();
+
 private:
+    void welcome();
     void do_read();
+    void handle_read(const boost::system::error_code &ec, const char *data, std::size_t length);
+    void consume(const char *data, std::size_t length);
+    void do_write();
+    void clear_output();
     void process_message(const std::string &msg);
     void start_idle_timer();
     void reset_idle_timer();
 
     boost::asio::ip::tcp::socket socket_;
+    // TLS sessions read and write through this stream over socket_, which
+    // still closes the connection; null for plaintext. The stream keeps its
+    // own record buffers, so only encrypted connections pay for them.
+    std::unique_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>> tls_;
     boost::asio::steady_timer idle_timer_;
 
-    // Buffer for incoming data
+    // Reads wait for the socket to become readable and only then borrow a
+    // receive buffer from a shared pool, so an idle connection holds none.
+    // Complete lines are processed straight from that buffer; read_buffer_
+    // keeps a partial line until the rest arrives. TLS reads hold their
+    // buffer while they wait, as the stream decrypts into it.
     static const std::size_t max_length_ = 2048;
-    char data_[max_length_];
+    std::string read_buffer_;
+
+    // Outgoing lines. writing_ is the one being written (empty when idle;
+    // on TLS sessions, possibly several copied into one record) and lives
+    // outside the queues, whose storage may move. The rest wait in
+    // backlog_, one lane per Priority, each holding its lines from head on;
+    // backlog_ exists only while something waits, so an idle connection
+    // owns no output storage.
+    struct Outgoing {
+        MessagePtr message;         // a shared chat line, or
+        std::string data;           // text of its own (replies, notices)
+        uint64_t trace_id = 0;      // sampled trace (see Tracer), 0 if none
+        int64_t queued_ns = 0;
+        bool sequenced = false;     // message goes out with its seq
+
+        std::string_view bytes() const {
+            if (!message) return data;
+            return sequenced ? message->sequenced_wire_line() : message->wire_line();
+        }
+        bool empty() const { return !message && data.empty(); }
+    };
+    struct OutputLane {
+        std::vector<Outgoing> items;
+        std::size_t head = 0;
+    };
+    void queue_output(Outgoing out, Priority priority);
+    // Draining: queues the last line, written once the lanes are empty
+    void say_goodbye();
+    // Moves the next line into out (writing_ for next_output); false if
+    // nothing is waiting
+    bool take_output(Outgoing &out);
+    bool next_output() { return take_output(writing_); }
+    // TLS only: appends waiting lines to writing_, up to one record
+    void coalesce_output();
+    Outgoing writing_;
+    std::unique_ptr<std::array<OutputLane, kPriorityCount>> backlog_;
+    // Per class, lines sent ahead of it while it waited; see take_output.
+    // Bounded by kMaxOvertaken plus the number of classes.
+    std::array<uint8_t, kPriorityCount> overtaken_;
 
+    uint64_t id_;
     bool authenticated_;
+    bool handed_off_;
+    bool handshaking_;      // TLS handshake in progress; nothing may be written
+    bool draining_;
+    bool said_goodbye_;     // draining: the goodbye is queued
+    bool sequenced_;
     std::string username_;
-    int idle_timeout_seconds_;
 
     // The command router (each session has one to handle commands)
     CommandRouter command_router_;
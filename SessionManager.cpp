@@ -1,37 +1,39 @@
 #include "SessionManager.h"
 #include <algorithm>
 #include "Logger.h"
+#include "Metrics.h"
+#include "Tracer.h"
 
-SessionManager& SessionManager::instance() {
-    static SessionManager instance;
-    return instance;
-}
+SessionManager::SessionManager()
+    : active_sessions_(Metrics::getInstance().gauge("chat_sessions_active", "Logged-in sessions")),
+      broadcast_time_(Metrics::getInstance().histogram("chat_broadcast_duration_seconds",
+                                                       "Time to fan a broadcast out to all sessions")),
+      broadcast_recipients_(Metrics::getInstance().counter("chat_broadcast_recipients_total",
+                                                           "Messages queued to sessions by broadcasts")) {}
 
 void SessionManager::add_session(std::shared_ptr<Session> session) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    sessions_.push_back(session);
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    sessions.push_back(session);
+    active_sessions_.set(static_cast<int64_t>(sessions.size()));
 }
 
 void SessionManager::remove_session(std::shared_ptr<Session> session) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    sessions_.erase(std::remove(sessions_.begin(), sessions_.end(), session), sessions_.end());
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+    active_sessions_.set(static_cast<int64_t>(sessions.size()));
 }
 
-void SessionManager::broadcast(const std::string &message, std::shared_ptr<Session> exclude) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    for (auto& session : sessions_) {
-        if (session != exclude) {
+void SessionManager::broadcast(const MessagePtr &message, const Session *exclude) {
+    ScopedTimer timer(broadcast_time_);
+    TraceSpan span("sessions.broadcast");
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    uint64_t delivered = 0;
+    for (auto& session : sessions) {
+        if (session.get() != exclude) {
             session->deliver(message);
+            ++delivered;
         }
     }
+    broadcast_recipients_.inc(delivered);
 }
-
-void SessionManager::close_all_sessions() {
-    std::lock_guard<std::mutex> lock(mtx_);
-    Logger::instance().log(LogLevel::INFO, "Closing all sessions for server shutdown...");
-    for (auto &sess : sessions_) {
-        sess->deliver("Server is shutting down now. You will be disconnected.");
-        sess->force_disconnect();
-    }
-    sessions_.clear();
-} 
\ No newline at end of file
+ 
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <memory>
 #include <mutex>
 #include "Session.h"
+#include "Metrics.h"
 
 class SessionManager {
 public:
@@ -14,11 +15,11 @@ public:
 
     void add_session(std::shared_ptr<Session> session);
     void remove_session(std::shared_ptr<Session> session);
-    void broadcast(const std::string& message, std::shared_ptr<Session> exclude = nullptr);
-    void close_all_sessions();
+    // Every logged-in session but exclude receives the same Message
+    void broadcast(const MessagePtr& message, const Session* exclude = nullptr);
 
 private:
-    SessionManager() = default;
+    SessionManager();
     ~SessionManager() = default;
 
     SessionManager(const SessionManager&) = delete;
@@ -26,4 +27,8 @@ private:
 
     std::vector<std::shared_ptr<Session>> sessions;
     std::mutex sessionsMutex;
+
+    Gauge& active_sessions_;
+    Histogram& broadcast_time_;
+    Counter& broadcast_recipients_;
 }; 
\ No newline at end of file
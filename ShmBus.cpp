@@ -0,0 +1,174 @@
+#include "ShmBus.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ShmBus::ShmBus(int memfd, std::vector<int> eventfds, void* base, size_t size)
+    : memfd_(memfd), eventfds_(std::move(eventfds)), base_(base), size_(size) {}
+
+ShmBus::~ShmBus() {
+    munmap(base_, size_);
+    close(memfd_);
+    for (int fd : eventfds_) {
+        close(fd);
+    }
+}
+
+std::unique_ptr<ShmBus> ShmBus::create(int workers) {
+    // No CLOEXEC: the workers inherit these descriptors across exec
+    int memfd = memfd_create("chat-bus", 0);
+    if (memfd < 0) {
+        return nullptr;
+    }
+    size_t size = segment_size(workers);
+    void* base = ftruncate(memfd, static_cast<off_t>(size)) == 0
+                     ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)
+                     : MAP_FAILED;
+    if (base == MAP_FAILED) {
+        int saved = errno;
+        close(memfd);
+        errno = saved;
+        return nullptr;
+    }
+
+    std::vector<int> eventfds;
+    for (int i = 0; i < workers; ++i) {
+        int fd = ::eventfd(0, EFD_NONBLOCK);
+        if (fd < 0) {
+            int saved = errno;
+            for (int open_fd : eventfds) close(open_fd);
+            munmap(base, size);
+            close(memfd);
+            errno = saved;
+            return nullptr;
+        }
+        eventfds.push_back(fd);
+    }
+
+    // The segment starts zeroed; seed each slot's sequence like Logger's ring
+    Header* header = new (base) Header;
+    header->sequence.store(0, std::memory_order_relaxed);
+    Inbox* inboxes = reinterpret_cast<Inbox*>(static_cast<char*>(base) + sizeof(Header));
+    for (int w = 0; w < workers; ++w) {
+        Inbox* box = new (inboxes + w) Inbox;
+        box->enqueue_pos.store(0, std::memory_order_relaxed);
+        box->dequeue_pos.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < kSlotsPerInbox; ++i) {
+            box->slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    return std::unique_ptr<ShmBus>(new ShmBus(memfd, std::move(eventfds), base, size));
+}
+
+std::vector<std::string> ShmBus::environment() const {
+    std::string eventfds;
+    for (int fd : eventfds_) {
+        if (!eventfds.empty()) eventfds += ',';
+        eventfds += std::to_string(fd);
+    }
+    return {"CHAT_BUS_FD=" + std::to_string(memfd_), "CHAT_BUS_EVENTFDS=" + eventfds};
+}
+
+std::unique_ptr<ShmBus> ShmBus::attach_from_environment() {
+    const char* memfd_env = getenv("CHAT_BUS_FD");
+    const char* eventfds_env = getenv("CHAT_BUS_EVENTFDS");
+    if (!memfd_env || !eventfds_env) {
+        return nullptr;
+    }
+    int memfd = atoi(memfd_env);
+    std::vector<int> eventfds;
+    for (const char* p = eventfds_env; *p;) {
+        char* end;
+        eventfds.push_back(static_cast<int>(strtol(p, &end, 10)));
+        if (end == p) return nullptr;
+        p = *end == ',' ? end + 1 : end;
+    }
+    if (eventfds.empty()) {
+        return nullptr;
+    }
+    size_t size = segment_size(static_cast<int>(eventfds.size()));
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::unique_ptr<ShmBus>(new ShmBus(memfd, std::move(eventfds), base, size));
+}
+
+bool ShmBus::push(int worker, const std::string& frame) {
+    if (worker < 0 || worker >= workers() || frame.size() > kMaxFrame) {
+        return false;
+    }
+    Inbox& box = inbox(worker);
+    uint64_t pos = box.enqueue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &box.slots[pos & (kSlotsPerInbox - 1)];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+        if (diff == 0) {
+            if (box.enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;   // full: the worker is down or not keeping up
+        } else {
+            pos = box.enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    // A producer that dies between the claim above and the publish below
+    // leaves this slot unpublished, stalling the inbox until release_claims()
+    slot->length = frame.size();
+    std::memcpy(slot->data, frame.data(), frame.size());
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    uint64_t one = 1;
+    ssize_t ignored = write(eventfds_[worker], &one, sizeof(one));
+    (void)ignored;
+    return true;
+}
+
+bool ShmBus::pop(int worker, std::string& frame) {
+    Inbox& box = inbox(worker);
+    for (;;) {
+        uint64_t pos = box.dequeue_pos.load(std::memory_order_relaxed);
+        Slot& slot = box.slots[pos & (kSlotsPerInbox - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        frame.assign(slot.data, slot.length);
+        slot.seq.store(pos + kSlotsPerInbox, std::memory_order_release);
+        box.dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        if (!frame.empty()) {
+            return true;
+        }
+        // An abandoned claim released by release_claims()
+    }
+}
+
+int ShmBus::release_claims() {
+    int released = 0;
+    for (int w = 0; w < workers(); ++w) {
+        Inbox& box = inbox(w);
+        int before = released;
+        uint64_t end = box.enqueue_pos.load(std::memory_order_acquire);
+        for (uint64_t pos = box.dequeue_pos.load(std::memory_order_acquire); pos < end; ++pos) {
+            Slot& slot = box.slots[pos & (kSlotsPerInbox - 1)];
+            if (slot.seq.load(std::memory_order_acquire) == pos) {
+                // Claimed but never published: publish it empty
+                slot.length = 0;
+                slot.seq.store(pos + 1, std::memory_order_release);
+                ++released;
+            }
+        }
+        if (released > before) {
+            uint64_t one = 1;
+            ssize_t ignored = write(eventfds_[w], &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    return released;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Message bus between the worker processes of one server (see Supervisor).
+// A shared memory segment holds one inbox per worker: a bounded lock-free
+// MPSC ring, like the Logger's, whose positions also live in the segment so
+// a restarted worker resumes where its predecessor stopped. Each inbox has an
+// eventfd that producers signal after pushing, so a worker can wait for
+// frames on its io_context. Ahead of the inboxes, the segment also holds
+// state the workers share, like the message sequence and TLS ticket keys.
+//
+// The segment is a memfd and the eventfds are plain descriptors; both are
+// created by the supervisor and inherited by the workers across exec.
+class ShmBus {
+public:
+    // Largest frame a slot holds (chat lines are at most 2 KB)
+    static constexpr size_t kMaxFrame = 4096 - 2 * sizeof(uint64_t);
+    static constexpr size_t kSlotsPerInbox = 1024;
+
+    // Supervisor side; nullptr (and errno set) on failure
+    static std::unique_ptr<ShmBus> create(int workers);
+    // Worker side, from the variables environment() produced; nullptr if
+    // they are missing or the segment cannot be mapped
+    static std::unique_ptr<ShmBus> attach_from_environment();
+    ~ShmBus();
+
+    // "NAME=value" entries describing the descriptors, for a worker's envp
+    std::vector<std::string> environment() const;
+
+    int workers() const { return static_cast<int>(eventfds_.size()); }
+    // Descriptor a worker waits on for frames in its inbox
+    int eventfd(int worker) const { return eventfds_[worker]; }
+
+    // Appends frame to worker's inbox and wakes it; false if the inbox is
+    // full or the frame too long
+    bool push(int worker, const std::string& frame);
+    // Takes the next frame from worker's inbox; only that worker may call it
+    bool pop(int worker, std::string& frame);
+
+    // Source of message sequence numbers for all workers (see
+    // Database::share_sequence); starts at 0, each worker raises it to its
+    // own starting point when it attaches
+    std::atomic<uint64_t>& sequence() { return header().sequence; }
+    // Session ticket keys for every worker's TlsContext, so a ticket from
+    // one worker resumes on another; the supervisor fills them before the
+    // first worker starts
+    static constexpr size_t kTicketKeyBytes = 80;
+    unsigned char* ticket_keys() { return header().ticket_keys; }
+
+    // Publishes, as empty frames that pop() skips, slots a producer claimed
+    // but never filled. Only safe once that producer is known to be dead and
+    // every live producer has had time to finish its push; the supervisor
+    // calls it a while after a worker crashes. Returns the number released.
+    int release_claims();
+
+private:
+    struct Header {
+        alignas(64) std::atomic<uint64_t> sequence;
+        unsigned char ticket_keys[kTicketKeyBytes];
+    };
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        uint64_t length;
+        char data[kMaxFrame];
+    };
+    struct Inbox {
+        alignas(64) std::atomic<uint64_t> enqueue_pos;
+        alignas(64) std::atomic<uint64_t> dequeue_pos;
+        Slot slots[kSlotsPerInbox];
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                  "bus atomics must be lock-free to work across processes");
+
+    ShmBus(int memfd, std::vector<int> eventfds, void* base, size_t size);
+    static size_t segment_size(int workers) { return sizeof(Header) + sizeof(Inbox) * static_cast<size_t>(workers); }
+    Header& header() { return *static_cast<Header*>(base_); }
+    Inbox* inboxes() { return reinterpret_cast<Inbox*>(static_cast<char*>(base_) + sizeof(Header)); }
+    Inbox& inbox(int worker) { return inboxes()[worker]; }
+
+    int memfd_;
+    std::vector<int> eventfds_;
+    void* base_;
+    size_t size_;
+};
@@ -0,0 +1,149 @@
+#include "SimdSearch.h"
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_SEARCH_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+
+using FindFn = size_t (*)(const char*, size_t, const char*, size_t);
+
+size_t find_scalar(const char* haystack, size_t n, const char* needle, size_t m) {
+    return std::string_view(haystack, n).find(std::string_view(needle, m));
+}
+
+#ifdef SIMD_SEARCH_X86
+
+inline unsigned count_trailing_zeros(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Compares the first and last needle byte against 16 candidate positions at
+// once and only memcmp()s the middle where both match. The final block is
+// shifted back to end exactly at the haystack end (overlapping the previous
+// one) so no load goes out of bounds and no tail is left for scalar code.
+size_t find_sse2(const char* haystack, size_t n, const char* needle, size_t m) {
+    const size_t positions = n - m + 1;
+    if (positions < 16) {
+        return find_scalar(haystack, n, needle, m);
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+
+    for (size_t i = 0; i < positions; i += 16) {
+        size_t start = std::min(i, positions - 16);
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + start));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + start + m - 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last))));
+        mask &= ~0u << (i - start);   // skip positions the previous block covered
+        while (mask) {
+            unsigned bit = count_trailing_zeros(mask);
+            if (std::memcmp(haystack + start + bit + 1, needle + 1, m - 2) == 0) {
+                return start + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return std::string::npos;
+}
+
+#if defined(__GNUC__) || defined(__clang__) || defined(__AVX2__)
+#define SIMD_SEARCH_AVX2 1
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+size_t find_avx2(const char* haystack, size_t n, const char* needle, size_t m) {
+    const size_t positions = n - m + 1;
+    if (positions < 32) {
+        return find_sse2(haystack, n, needle, m);
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+
+    for (size_t i = 0; i < positions; i += 32) {
+        size_t start = std::min(i, positions - 32);
+        __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(haystack + start));
+        __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(haystack + start + m - 1));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last))));
+        mask &= ~0u << (i - start);
+        while (mask) {
+            unsigned bit = count_trailing_zeros(mask);
+            if (std::memcmp(haystack + start + bit + 1, needle + 1, m - 2) == 0) {
+                return start + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return std::string::npos;
+}
+#endif
+
+bool cpu_has_avx2() {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_cpu_supports("avx2");
+#elif defined(__AVX2__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+#endif // SIMD_SEARCH_X86
+
+struct Kernel {
+    FindFn fn;
+    const char* name;
+};
+
+Kernel select_kernel() {
+#ifdef SIMD_SEARCH_X86
+#ifdef SIMD_SEARCH_AVX2
+    if (cpu_has_avx2()) {
+        return {find_avx2, "avx2"};
+    }
+#endif
+    return {find_sse2, "sse2"};
+#else
+    return {find_scalar, "scalar"};
+#endif
+}
+
+const Kernel& kernel() {
+    static const Kernel selected = select_kernel();
+    return selected;
+}
+
+} // namespace
+
+size_t simd_find(const char* haystack, size_t haystack_len,
+                 const char* needle, size_t needle_len) {
+    if (needle_len == 0) return 0;
+    if (needle_len > haystack_len) return std::string::npos;
+    if (needle_len == 1) {
+        const void* hit = std::memchr(haystack, needle[0], haystack_len);
+        return hit ? static_cast<const char*>(hit) - haystack : std::string::npos;
+    }
+    return kernel().fn(haystack, haystack_len, needle, needle_len);
+}
+
+const char* simd_find_kernel() {
+    return kernel().name;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Substring search over raw bytes. Uses AVX2 when the CPU supports it,
+// SSE2 on other x86-64 targets and std::string_view::find elsewhere.
+// Returns the offset of the first match or std::string::npos.
+size_t simd_find(const char* haystack, size_t haystack_len,
+                 const char* needle, size_t needle_len);
+
+// Name of the kernel simd_find dispatches to ("avx2", "sse2" or "scalar")
+const char* simd_find_kernel();
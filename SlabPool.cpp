@@ -0,0 +1,69 @@
+#include "SlabPool.h"
+#include <algorithm>
+#include <new>
+
+namespace {
+
+std::size_t round_up(std::size_t bytes) {
+    // Every block must be able to hold the free list link
+    constexpr std::size_t align = alignof(std::max_align_t);
+    return (std::max(bytes, sizeof(void*)) + align - 1) / align * align;
+}
+
+} // namespace
+
+SlabPool::SlabPool(std::size_t block_size, std::size_t blocks_per_slab)
+    : block_size_(block_size ? round_up(block_size) : 0),
+      blocks_per_slab_(std::max<std::size_t>(blocks_per_slab, 1)) {}
+
+SlabPool::~SlabPool() {
+    for (void* slab : slabs_) {
+        ::operator delete(slab);
+    }
+}
+
+void* SlabPool::allocate(std::size_t bytes) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::size_t block = block_size_.load(std::memory_order_relaxed);
+    if (block == 0) {
+        block = round_up(bytes);
+        block_size_.store(block, std::memory_order_relaxed);
+    }
+    if (bytes > block) {
+        return ::operator new(bytes);
+    }
+    if (!free_) {
+        grow();
+    }
+    FreeBlock* head = free_;
+    free_ = head->next;
+    blocks_in_use_.fetch_add(1, std::memory_order_relaxed);
+    return head;
+}
+
+void SlabPool::deallocate(void* block, std::size_t bytes) noexcept {
+    if (!block) return;
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (bytes > block_size_.load(std::memory_order_relaxed)) {
+        ::operator delete(block);
+        return;
+    }
+    auto* head = static_cast<FreeBlock*>(block);
+    head->next = free_;
+    free_ = head;
+    blocks_in_use_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void SlabPool::grow() {
+    std::size_t block = block_size_.load(std::memory_order_relaxed);
+    std::size_t bytes = block * blocks_per_slab_;
+    char* slab = static_cast<char*>(::operator new(bytes));
+    slabs_.push_back(slab);
+    // Threaded back to front so blocks are handed out in address order
+    for (std::size_t i = blocks_per_slab_; i-- > 0;) {
+        auto* free_block = reinterpret_cast<FreeBlock*>(slab + i * block);
+        free_block->next = free_;
+        free_ = free_block;
+    }
+    reserved_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
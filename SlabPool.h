@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Fixed-size blocks carved from larger slabs and recycled through a free
+// list, for objects that exist by the hundred thousand (see Session). A block
+// costs its size and nothing more: no malloc header, and freed blocks are
+// reused rather than fragmenting the heap. Slabs are kept for the life of the
+// pool, so memory reserved during a connection spike stays reserved; both
+// reserved and in-use figures are exported as metrics.
+class SlabPool {
+public:
+    // block_size 0 takes the size of the first allocation, for blocks whose
+    // type can't be named (the control block behind allocate_shared)
+    SlabPool(std::size_t block_size, std::size_t blocks_per_slab);
+    ~SlabPool();
+
+    // Requests larger than a block fall through to operator new
+    void* allocate(std::size_t bytes);
+    void deallocate(void* block, std::size_t bytes) noexcept;
+
+    std::size_t block_size() const { return block_size_.load(std::memory_order_relaxed); }
+    std::size_t reserved_bytes() const { return reserved_bytes_.load(std::memory_order_relaxed); }
+    std::size_t blocks_in_use() const { return blocks_in_use_.load(std::memory_order_relaxed); }
+
+private:
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    void grow();
+
+    std::mutex mtx_;
+    std::atomic<std::size_t> block_size_;
+    std::size_t blocks_per_slab_;
+    FreeBlock* free_ = nullptr;
+    std::vector<void*> slabs_;
+    std::atomic<std::size_t> reserved_bytes_{0};
+    std::atomic<std::size_t> blocks_in_use_{0};
+};
+
+// Standard allocator over a SlabPool, e.g. for std::allocate_shared
+template <class T>
+class SlabAllocator {
+public:
+    using value_type = T;
+
+    explicit SlabAllocator(SlabPool& pool) noexcept : pool_(&pool) {}
+    template <class U>
+    SlabAllocator(const SlabAllocator<U>& other) noexcept : pool_(other.pool_) {}
+
+    T* allocate(std::size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types need their own allocator");
+        return static_cast<T*>(pool_->allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n) noexcept { pool_->deallocate(p, n * sizeof(T)); }
+
+    template <class U>
+    bool operator==(const SlabAllocator<U>& other) const noexcept { return pool_ == other.pool_; }
+    template <class U>
+    bool operator!=(const SlabAllocator<U>& other) const noexcept { return pool_ != other.pool_; }
+
+private:
+    template <class U>
+    friend class SlabAllocator;
+    SlabPool* pool_;
+};
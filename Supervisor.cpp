@@ -0,0 +1,231 @@
+#include "Supervisor.h"
+#include "Logger.h"
+#include "Config.h"
+#include "TlsContext.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace {
+
+constexpr int kMinBackoffMs = 500;
+constexpr int kMaxBackoffMs = 30000;
+// A worker that stayed up this long is not crash-looping
+constexpr auto kStableUptime = std::chrono::seconds(60);
+// Time workers get to exit after SIGTERM, beyond their drain deadline,
+// before they are killed
+constexpr auto kStopGrace = std::chrono::seconds(5);
+// Longer than any live push takes; see ShmBus::release_claims
+constexpr auto kReleaseDelay = std::chrono::seconds(1);
+
+} // namespace
+
+Supervisor::Supervisor(int workers)
+    : signals_(io_context_), kill_timer_(io_context_), release_timer_(io_context_), workers_(workers) {}
+
+int Supervisor::run() {
+    // Resolved now rather than exec'ing /proc/self/exe, so workers show up
+    // as ChatServer in ps and a rebuilt binary is picked up on restart
+    std::error_code ec;
+    exe_ = std::filesystem::read_symlink("/proc/self/exe", ec).string();
+    if (ec) {
+        LOG_ERROR("Cannot locate the server binary: ", ec.message());
+        return 1;
+    }
+    bus_ = ShmBus::create(static_cast<int>(workers_.size()));
+    if (!bus_) {
+        LOG_ERROR("Cannot create the worker bus: ", std::strerror(errno));
+        return 1;
+    }
+    static_assert(ShmBus::kTicketKeyBytes == TlsContext::kTicketKeyBytes, "ticket key sizes differ");
+    if (!TlsContext::generate_ticket_keys(bus_->ticket_keys())) {
+        LOG_ERROR("Cannot generate TLS ticket keys");
+        return 1;
+    }
+    for (int signum : {SIGCHLD, SIGINT, SIGTERM, SIGHUP, SIGUSR1, SIGUSR2}) {
+        signals_.add(signum);
+    }
+    wait_signal();
+
+    LOG_INFO("Supervisor starting ", workers_.size(), " workers");
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i].backoff_ms = kMinBackoffMs;
+        workers_[i].restart_timer = std::make_unique<boost::asio::steady_timer>(io_context_);
+        spawn(static_cast<int>(i));
+    }
+    io_context_.run();
+    LOG_INFO("Supervisor exiting, all workers stopped");
+    return 0;
+}
+
+void Supervisor::spawn(int index) {
+    // Everything the child needs is built before fork: the parent has other
+    // threads (the log writer), so the child may only make async-signal-safe
+    // calls until exec
+    std::vector<std::string> env;
+    for (char** var = environ; *var; ++var) {
+        if (std::strncmp(*var, "CHAT_", 5) != 0) {
+            env.emplace_back(*var);
+        }
+    }
+    env.push_back("CHAT_WORKER_INDEX=" + std::to_string(index));
+    for (auto& var : bus_->environment()) {
+        env.push_back(var);
+    }
+    std::vector<char*> envp;
+    for (auto& var : env) {
+        envp.push_back(&var[0]);
+    }
+    envp.push_back(nullptr);
+    char name[] = "ChatServer";
+    char* argv[] = {name, nullptr};
+    pid_t parent = getpid();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Don't outlive the supervisor, even if it is killed outright
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(1);
+        }
+        // Out of the terminal's process group: a Ctrl-C reaches only the
+        // supervisor, which stops workers with a single SIGTERM (a second
+        // one would cut their drain short)
+        setpgid(0, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        execve(exe_.c_str(), argv, envp.data());
+        _exit(127);
+    }
+
+    Worker& worker = workers_[index];
+    if (pid < 0) {
+        LOG_ERROR("Cannot start worker ", index, ": ", std::strerror(errno));
+        worker_crashed(index);
+        return;
+    }
+    worker.pid = pid;
+    worker.started = std::chrono::steady_clock::now();
+    LOG_INFO("Worker ", index, " started (pid ", pid, ")");
+}
+
+void Supervisor::wait_signal() {
+    signals_.async_wait([this](const boost::system::error_code& ec, int signum) {
+        if (ec) return;
+        switch (signum) {
+        case SIGCHLD:
+            reap();
+            break;
+        case SIGINT:
+        case SIGTERM:
+            LOG_INFO("Supervisor received signal ", signum, ", stopping workers");
+            stop_all();
+            break;
+        default:
+            signal_all(signum);
+            break;
+        }
+        wait_signal();
+    });
+}
+
+void Supervisor::reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto it = std::find_if(workers_.begin(), workers_.end(),
+                               [pid](const Worker& worker) { return worker.pid == pid; });
+        if (it == workers_.end()) continue;
+        int index = static_cast<int>(it - workers_.begin());
+        it->pid = 0;
+
+        if (stopping_) {
+            LOG_INFO("Worker ", index, " stopped");
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            LOG_INFO("Worker ", index, " shut down cleanly, stopping the others");
+            stop_all();
+        } else {
+            if (WIFSIGNALED(status)) {
+                LOG_ERROR("Worker ", index, " killed by signal ", WTERMSIG(status));
+            } else {
+                LOG_ERROR("Worker ", index, " exited with status ", WEXITSTATUS(status));
+            }
+            worker_crashed(index);
+        }
+    }
+    if (stopping_ && !any_running()) {
+        io_context_.stop();
+    }
+}
+
+void Supervisor::worker_crashed(int index) {
+    Worker& worker = workers_[index];
+    // Its sessions are gone; the other workers drop it from their directory
+    for (int i = 0; i < static_cast<int>(workers_.size()); ++i) {
+        if (i != index) {
+            bus_->push(i, "supervisor\tDOWN\tworker" + std::to_string(index));
+        }
+    }
+    // It may have died mid-push, leaving a slot in another inbox claimed
+    release_timer_.expires_after(kReleaseDelay);
+    release_timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        int released = bus_->release_claims();
+        if (released > 0) {
+            LOG_WARN("Released ", released, " bus slots abandoned by a crashed worker");
+        }
+    });
+
+    if (std::chrono::steady_clock::now() - worker.started >= kStableUptime) {
+        worker.backoff_ms = kMinBackoffMs;
+    }
+    LOG_WARN("Restarting worker ", index, " in ", worker.backoff_ms, " ms");
+    worker.restart_timer->expires_after(std::chrono::milliseconds(worker.backoff_ms));
+    worker.restart_timer->async_wait([this, index](const boost::system::error_code& ec) {
+        if (!ec && !stopping_) {
+            spawn(index);
+        }
+    });
+    worker.backoff_ms = std::min(worker.backoff_ms * 2, kMaxBackoffMs);
+}
+
+void Supervisor::stop_all() {
+    if (stopping_) return;
+    stopping_ = true;
+    for (auto& worker : workers_) {
+        worker.restart_timer->cancel();
+    }
+    release_timer_.cancel();
+    if (!any_running()) {
+        io_context_.stop();
+        return;
+    }
+    signal_all(SIGTERM);
+    kill_timer_.expires_after(std::chrono::seconds(Config::getInstance().settings().shutdown_drain_seconds) +
+                              kStopGrace);
+    kill_timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        LOG_WARN("Workers did not stop within the grace period, killing them");
+        signal_all(SIGKILL);
+    });
+}
+
+void Supervisor::signal_all(int signum) {
+    for (auto& worker : workers_) {
+        if (worker.pid > 0) {
+            kill(worker.pid, signum);
+        }
+    }
+}
+
+bool Supervisor::any_running() const {
+    return std::any_of(workers_.begin(), workers_.end(), [](const Worker& worker) { return worker.pid > 0; });
+}
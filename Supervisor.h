@@ -0,0 +1,51 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "ShmBus.h"
+
+// Parent process for workers > 1. Starts that many copies of this binary as
+// workers (CHAT_WORKER_INDEX=<k> in their environment), each listening on
+// the shared port with SO_REUSEPORT, and connects them with a ShmBus.
+//
+// A worker that crashes is restarted with a backoff and its peers are told
+// to forget its users. A worker exiting cleanly means an admin ran /shutdown,
+// so the others are stopped too. SIGINT/SIGTERM stop every worker (SIGKILL
+// after a grace period); SIGHUP, SIGUSR1 and SIGUSR2 are forwarded, so
+// reloads and dumps work as with a single process.
+class Supervisor {
+public:
+    explicit Supervisor(int workers);
+    // Runs until every worker has exited; returns the process exit code
+    int run();
+
+private:
+    struct Worker {
+        pid_t pid = 0;
+        std::chrono::steady_clock::time_point started;
+        int backoff_ms = 0;
+        std::unique_ptr<boost::asio::steady_timer> restart_timer;
+    };
+
+    void spawn(int index);
+    void wait_signal();
+    void reap();
+    void worker_crashed(int index);
+    void stop_all();
+    void signal_all(int signum);
+    bool any_running() const;
+
+    boost::asio::io_context io_context_;
+    boost::asio::signal_set signals_;
+    boost::asio::steady_timer kill_timer_;
+    boost::asio::steady_timer release_timer_;
+    std::string exe_;
+    std::unique_ptr<ShmBus> bus_;
+    std::vector<Worker> workers_;
+    bool stopping_ = false;
+};
@@ -0,0 +1,65 @@
+#include "TlsContext.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <openssl/rand.h>
+
+static Counter& full_handshakes = Metrics::getInstance().counter(
+    "chat_tls_handshakes_total", "TLS handshakes completed or failed", "result=\"full\"");
+static Counter& resumed_handshakes = Metrics::getInstance().counter(
+    "chat_tls_handshakes_total", "TLS handshakes completed or failed", "result=\"resumed\"");
+static Counter& failed_handshakes = Metrics::getInstance().counter(
+    "chat_tls_handshakes_total", "TLS handshakes completed or failed", "result=\"failed\"");
+
+TlsContext::TlsContext() : context_(boost::asio::ssl::context::tls_server) {}
+
+std::unique_ptr<TlsContext> TlsContext::create(const std::string& cert_file, const std::string& key_file) {
+    std::unique_ptr<TlsContext> tls(new TlsContext);
+    boost::system::error_code ec;
+    tls->context_.set_options(boost::asio::ssl::context::default_workarounds |
+                              boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3 |
+                              boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1, ec);
+    if (!ec) tls->context_.use_certificate_chain_file(cert_file, ec);
+    if (ec) {
+        LOG_ERROR("Cannot load TLS certificate ", cert_file, ": ", ec.message());
+        return nullptr;
+    }
+    tls->context_.use_private_key_file(key_file, boost::asio::ssl::context::pem, ec);
+    if (ec) {
+        LOG_ERROR("Cannot load TLS key ", key_file, ": ", ec.message());
+        return nullptr;
+    }
+
+    SSL_CTX* ctx = tls->context_.native_handle();
+    if (SSL_CTX_check_private_key(ctx) != 1) {
+        LOG_ERROR("TLS key ", key_file, " does not match certificate ", cert_file);
+        return nullptr;
+    }
+    // Resumption relies on tickets alone; a server-side cache would cost
+    // memory per client and not be shared between workers
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    // A client reconnects over one connection at a time, so one TLS 1.3
+    // ticket per handshake is enough (OpenSSL sends two by default)
+    SSL_CTX_set_num_tickets(ctx, 1);
+    return tls;
+}
+
+bool TlsContext::set_ticket_keys(const unsigned char* keys) {
+    unsigned char copy[kTicketKeyBytes];
+    std::copy(keys, keys + kTicketKeyBytes, copy);
+    return SSL_CTX_set_tlsext_ticket_keys(context_.native_handle(), copy, sizeof(copy)) == 1;
+}
+
+bool TlsContext::generate_ticket_keys(unsigned char* keys) {
+    return RAND_bytes(keys, static_cast<int>(kTicketKeyBytes)) == 1;
+}
+
+void TlsContext::record_handshake(SSL* ssl, const boost::system::error_code& ec) {
+    if (ec) {
+        failed_handshakes.inc();
+    } else if (SSL_session_reused(ssl)) {
+        resumed_handshakes.inc();
+    } else {
+        full_handshakes.inc();
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <boost/asio/ssl.hpp>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Server-side TLS settings for the tls_port listener (see Server). Sessions
+// resume from stateless tickets, so a reconnecting client skips the key
+// exchange and certificate and the server keeps no per-client cache. Workers
+// of one Supervisor share the ticket keys through the bus segment, so a
+// ticket issued by one worker is accepted by whichever worker the kernel
+// hands the reconnect to.
+//
+// Record encryption stays in user space: Asio's SSL stream drives OpenSSL
+// through a memory BIO pair, which leaves no socket for kernel TLS to attach to.
+class TlsContext {
+public:
+    // Name, AES and HMAC keys, as SSL_CTX_set_tlsext_ticket_keys takes them
+    static constexpr std::size_t kTicketKeyBytes = 80;
+
+    // nullptr (and the reason logged) if the certificate or key can't be loaded
+    static std::unique_ptr<TlsContext> create(const std::string& cert_file, const std::string& key_file);
+
+    boost::asio::ssl::context& context() { return context_; }
+
+    // Replaces the ticket keys OpenSSL generated for this process
+    bool set_ticket_keys(const unsigned char* keys);
+    // Fresh random keys, for the supervisor to hand to its workers
+    static bool generate_ticket_keys(unsigned char* keys);
+
+    // Counts a finished handshake as full, resumed or failed
+    static void record_handshake(SSL* ssl, const boost::system::error_code& ec);
+
+private:
+    TlsContext();
+
+    boost::asio::ssl::context context_;
+};
@@ -0,0 +1,184 @@
+#include "TokenIndex.h"
+#include <algorithm>
+
+namespace {
+
+inline bool is_word_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+inline unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c - 'A' + 'a') : c;
+}
+
+// Records that message_no has a posting the index could not keep
+inline void mark_dropped(std::atomic<uint64_t>& dropped_upto, uint64_t message_no) {
+    if (dropped_upto.load(std::memory_order_relaxed) < message_no + 1) {
+        dropped_upto.store(message_no + 1, std::memory_order_release);
+    }
+}
+
+} // namespace
+
+TokenIndex::TokenIndex(size_t expected_messages) {
+    // Roughly four distinct tokens per line keeps probe chains short
+    size_t buckets = 64;
+    while (buckets < expected_messages * 4) {
+        buckets <<= 1;
+    }
+    mask_ = buckets - 1;
+    buckets_.reset(new Bucket[buckets]);
+    arena_size_ = std::max<size_t>(expected_messages, 1) * kPostingsPerMessage;
+    arena_.reset(new Posting[arena_size_]);
+}
+
+void TokenIndex::tokenize(const char* text, size_t length, std::vector<uint64_t>& hashes) {
+    // FNV-1a over the folded bytes of each token
+    const uint64_t kOffset = 1469598103934665603ULL;
+    const uint64_t kPrime = 1099511628211ULL;
+    uint64_t hash = kOffset;
+    bool in_token = false;
+    for (size_t i = 0; i <= length; ++i) {
+        unsigned char c = i < length ? static_cast<unsigned char>(text[i]) : ' ';
+        if (is_word_byte(c)) {
+            hash = (hash ^ fold(c)) * kPrime;
+            in_token = true;
+        } else if (in_token) {
+            hashes.push_back(hash ? hash : 1);
+            hash = kOffset;
+            in_token = false;
+        }
+    }
+}
+
+bool TokenIndex::is_word_query(const std::string& query) {
+    bool any = false;
+    for (unsigned char c : query) {
+        if (is_word_byte(c)) {
+            any = true;
+        } else if (c != ' ' && c != '\t') {
+            return false;
+        }
+    }
+    return any;
+}
+
+void TokenIndex::add(uint64_t message_no, const char* text, size_t length, uint64_t oldest_live) {
+    scratch_.clear();
+    tokenize(text, length, scratch_);
+    std::sort(scratch_.begin(), scratch_.end());
+    scratch_.erase(std::unique(scratch_.begin(), scratch_.end()), scratch_.end());
+
+    for (uint64_t key : scratch_) {
+        size_t home = static_cast<size_t>(key) & mask_;
+        size_t target = SIZE_MAX;
+        bool reclaim = false;
+        for (size_t probe = 0; probe < kMaxProbe; ++probe) {
+            size_t b = (home + probe) & mask_;
+            uint64_t existing = buckets_[b].key.load(std::memory_order_relaxed);
+            if (existing == key || existing == 0) {
+                target = b;
+                reclaim = existing == 0;
+                break;
+            }
+            // Token left the window: reuse unless the key shows up later
+            if (target == SIZE_MAX && buckets_[b].newest.load(std::memory_order_relaxed) <= oldest_live) {
+                target = b;
+                reclaim = true;
+            }
+        }
+        if (target == SIZE_MAX) {
+            mark_dropped(dropped_upto_, message_no);
+            continue;
+        }
+        append(target, key, message_no, reclaim, oldest_live);
+    }
+}
+
+void TokenIndex::append(size_t b, uint64_t key, uint64_t message_no, bool reclaim, uint64_t oldest_live) {
+    // Overwrite the oldest arena entry; if it still described a live message
+    // the index is lossy for messages up to that one
+    uint64_t position = next_position_++;
+    Posting& posting = arena_[position % arena_size_];
+    uint64_t evicted = posting.message.load(std::memory_order_relaxed);
+    if (evicted != kNone && evicted - 1 >= oldest_live) {
+        mark_dropped(dropped_upto_, evicted - 1);
+    }
+
+    Bucket& bucket = buckets_[b];
+    uint64_t prev = reclaim ? kNone : bucket.head.load(std::memory_order_relaxed);
+
+    posting.tag.store(kNone, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    posting.message.store(message_no + 1, std::memory_order_relaxed);
+    posting.prev.store(prev, std::memory_order_relaxed);
+    posting.tag.store(position + 1, std::memory_order_release);
+
+    uint64_t version = bucket.version.load(std::memory_order_relaxed);
+    bucket.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (reclaim) {
+        bucket.key.store(key, std::memory_order_relaxed);
+    }
+    bucket.head.store(position + 1, std::memory_order_relaxed);
+    bucket.newest.store(message_no + 1, std::memory_order_relaxed);
+    bucket.version.store(version + 2, std::memory_order_release);
+}
+
+TokenIndex::Result TokenIndex::lookup(uint64_t key, uint64_t oldest_live, std::vector<uint64_t>& out) const {
+    size_t home = static_cast<size_t>(key) & mask_;
+    for (size_t probe = 0; probe < kMaxProbe; ++probe) {
+        const Bucket& bucket = buckets_[(home + probe) & mask_];
+
+        uint64_t existing, head;
+        for (int attempt = 0;; ++attempt) {
+            uint64_t version = bucket.version.load(std::memory_order_acquire);
+            existing = bucket.key.load(std::memory_order_relaxed);
+            head = bucket.head.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((version & 1) == 0 && bucket.version.load(std::memory_order_relaxed) == version) {
+                break;
+            }
+            if (attempt == 8) {
+                return Result::Unknown; // writer keeps beating us to this bucket
+            }
+        }
+        if (existing == 0) {
+            break;
+        }
+        if (existing != key) {
+            continue;
+        }
+
+        // Walk newest to oldest until the chain leaves the cache window
+        size_t before = out.size();
+        bool broken = false;
+        for (uint64_t position = head; position != kNone;) {
+            const Posting& posting = arena_[(position - 1) % arena_size_];
+            if (posting.tag.load(std::memory_order_acquire) != position) {
+                broken = true;
+                break;
+            }
+            uint64_t message = posting.message.load(std::memory_order_relaxed);
+            uint64_t prev = posting.prev.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (posting.tag.load(std::memory_order_relaxed) != position) {
+                broken = true;
+                break;
+            }
+            if (message - 1 < oldest_live) {
+                break;
+            }
+            out.push_back(message - 1);
+            position = prev;
+        }
+        // An overwritten link only matters if it may have held a live message
+        if (broken && dropped_upto_.load(std::memory_order_acquire) > oldest_live) {
+            out.resize(before);
+            return Result::Unknown;
+        }
+        std::reverse(out.begin() + before, out.end());
+        return out.size() > before ? Result::Found : Result::Absent;
+    }
+    return dropped_upto_.load(std::memory_order_acquire) > oldest_live ? Result::Unknown : Result::Absent;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Inverted index from word tokens to message numbers for ChatHistoryCache.
+//
+// An open-addressed table maps token hashes to the newest posting for that
+// token; postings live in a shared ring (the arena) and link to the previous
+// posting of the same token, so a lookup walks exactly the live occurrences.
+// add() is called by the single cache writer; lookup() is lock-free, with
+// buckets and postings validated seqlock-style. Buckets are never emptied,
+// only reclaimed once their token has left the cache window, so probe
+// chains stay intact.
+//
+// lookup() reports Unknown when the answer may be incomplete (a token that
+// did not fit in the table, or live postings overwritten because lines held
+// more tokens than the arena budgets for) so the caller can fall back to a
+// scan. Hash collisions are possible; callers verify against the text.
+class TokenIndex {
+public:
+    enum class Result { Found, Absent, Unknown };
+
+    explicit TokenIndex(size_t expected_messages);
+
+    // Writer only. oldest_live is the oldest message number still cached.
+    void add(uint64_t message_no, const char* text, size_t length, uint64_t oldest_live);
+
+    // Appends live message numbers (>= oldest_live) for the token, in
+    // ascending order
+    Result lookup(uint64_t token_hash, uint64_t oldest_live, std::vector<uint64_t>& out) const;
+
+    // Bytes allocated for the table and arena, fixed at construction
+    size_t memory_bytes() const {
+        return (mask_ + 1) * sizeof(Bucket) + arena_size_ * sizeof(Posting);
+    }
+
+    // Tokens are runs of ASCII letters/digits (and non-ASCII bytes),
+    // case-folded the same way as the FTS5 unicode61 tokenizer does for ASCII
+    static void tokenize(const char* text, size_t length, std::vector<uint64_t>& hashes);
+    static bool is_word_query(const std::string& query);
+
+private:
+    static constexpr size_t kMaxProbe = 16;
+    static constexpr size_t kPostingsPerMessage = 16;
+    static constexpr uint64_t kNone = 0;   // positions and numbers are stored + 1
+
+    struct Bucket {
+        std::atomic<uint64_t> version{0};
+        std::atomic<uint64_t> key{0};       // token hash, 0 = never used
+        std::atomic<uint64_t> head{kNone};  // arena position of newest posting + 1
+        std::atomic<uint64_t> newest{kNone};// newest message number + 1
+    };
+
+    struct Posting {
+        std::atomic<uint64_t> tag{kNone};   // arena position + 1 while valid
+        std::atomic<uint64_t> message{kNone};
+        std::atomic<uint64_t> prev{kNone};  // previous posting position + 1
+    };
+
+    void append(size_t bucket, uint64_t key, uint64_t message_no, bool reclaim, uint64_t oldest_live);
+
+    size_t mask_;
+    std::unique_ptr<Bucket[]> buckets_;
+    size_t arena_size_;
+    std::unique_ptr<Posting[]> arena_;
+    uint64_t next_position_ = 0;              // writer only
+    std::atomic<uint64_t> dropped_upto_{0};   // newest message with a lost posting, + 1
+    std::vector<uint64_t> scratch_;           // writer-side token buffer
+};
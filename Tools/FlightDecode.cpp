@@ -0,0 +1,88 @@
+// Prints a flight recorder dump (/flight or SIGUSR1) as one line per event,
+// oldest first:
+//
+//   flight_decode flight-1792398750.bin [--session N] [--event NAME]
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "FlightRecorder.h"
+
+int main(int argc, char **argv) {
+    std::string path;
+    uint64_t session_filter = 0;
+    std::string event_filter;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--session" && i + 1 < argc) {
+            session_filter = std::stoull(argv[++i]);
+        } else if (arg == "--event" && i + 1 < argc) {
+            event_filter = argv[++i];
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            path.clear();
+            break;
+        }
+    }
+    if (path.empty()) {
+        std::cerr << "Usage: flight_decode <dump.bin> [--session N] [--event NAME]\n";
+        return 2;
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    FlightDumpHeader header{};
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, "CHATFLT1", sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(FlightRecord)) {
+        std::cerr << path << ": not a flight recorder dump\n";
+        return 1;
+    }
+
+    std::map<uint16_t, std::string> thread_names;
+    for (uint32_t i = 0; i < header.thread_count; ++i) {
+        FlightDumpThread thread{};
+        if (!in.read(reinterpret_cast<char *>(&thread), sizeof(thread))) {
+            std::cerr << path << ": truncated thread table\n";
+            return 1;
+        }
+        thread.name[sizeof(thread.name) - 1] = '\0';
+        thread_names[thread.thread] = thread.name[0] ? thread.name : "thread-" + std::to_string(thread.thread);
+    }
+
+    uint64_t printed = 0;
+    FlightRecord rec{};
+    for (uint64_t i = 0; i < header.record_count; ++i) {
+        if (!in.read(reinterpret_cast<char *>(&rec), sizeof(rec))) {
+            std::cerr << path << ": truncated after " << i << " records\n";
+            return 1;
+        }
+        const char *event = flight_event_name(rec.event);
+        if ((session_filter && rec.session != session_filter) ||
+            (!event_filter.empty() && event_filter != event)) {
+            continue;
+        }
+
+        std::time_t seconds = static_cast<std::time_t>(rec.wall_ns / 1000000000);
+        std::tm tm{};
+        localtime_r(&seconds, &tm);
+        char when[32];
+        std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        std::string tag(rec.tag, strnlen(rec.tag, sizeof(rec.tag)));
+
+        std::printf("%s.%06lld %-14s %-13s session=%-6llu value=%-8llu %s\n",
+                    when, static_cast<long long>(rec.wall_ns % 1000000000 / 1000),
+                    thread_names[rec.thread].c_str(), event,
+                    static_cast<unsigned long long>(rec.session),
+                    static_cast<unsigned long long>(rec.value), tag.c_str());
+        ++printed;
+    }
+    std::cerr << printed << " of " << header.record_count << " events\n";
+    return 0;
+}
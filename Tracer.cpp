@@ -0,0 +1,118 @@
+#include "Tracer.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+
+thread_local uint64_t Tracer::current_trace_ = 0;
+
+int64_t Tracer::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t Tracer::maybe_start() {
+    int every = sample_every_.load(std::memory_order_relaxed);
+    if (every == 0) {
+        return 0;
+    }
+    if (messages_.fetch_add(1, std::memory_order_relaxed) % static_cast<uint64_t>(every) != 0) {
+        return 0;
+    }
+    return next_trace_.fetch_add(1, std::memory_order_relaxed);
+}
+
+Tracer::ThreadBuffer &Tracer::local_buffer() {
+    thread_local ThreadBuffer *buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        buffers_.push_back(std::make_unique<ThreadBuffer>());
+        buffer = buffers_.back().get();
+        buffer->tid = static_cast<uint32_t>(buffers_.size());
+    }
+    return *buffer;
+}
+
+void Tracer::record(uint64_t trace, const char *name, int64_t start_ns, int64_t end_ns, bool async) {
+    ThreadBuffer &buffer = local_buffer();
+    uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    Span &span = buffer.spans[head & (kSpansPerThread - 1)];
+    span.trace.store(trace, std::memory_order_relaxed);
+    span.name.store(name, std::memory_order_relaxed);
+    span.start_ns.store(start_ns, std::memory_order_relaxed);
+    span.end_ns.store(end_ns, std::memory_order_relaxed);
+    span.async.store(async, std::memory_order_relaxed);
+    buffer.head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::name_thread(const std::string &name) {
+    ThreadBuffer &buffer = local_buffer();
+    std::lock_guard<std::mutex> lock(mtx_);
+    buffer.name = name;
+}
+
+bool Tracer::dump(const std::string &path) const {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto emit = [&](const std::string &event) {
+        out << (first ? "\n" : ",\n") << event;
+        first = false;
+    };
+    char buf[256];
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto &buffer : buffers_) {
+        if (!buffer->name.empty()) {
+            std::snprintf(buf, sizeof(buf),
+                          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                          buffer->tid, buffer->name.c_str());
+            emit(buf);
+        }
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t begin = head > kSpansPerThread ? head - kSpansPerThread : 0;
+        for (uint64_t i = begin; i < head; ++i) {
+            const Span &span = buffer->spans[i & (kSpansPerThread - 1)];
+            uint64_t trace = span.trace.load(std::memory_order_relaxed);
+            const char *name = span.name.load(std::memory_order_relaxed);
+            int64_t start = span.start_ns.load(std::memory_order_relaxed);
+            int64_t end = span.end_ns.load(std::memory_order_relaxed);
+            bool async = span.async.load(std::memory_order_relaxed);
+            // Skip slots the owner overwrote while we were reading
+            if (buffer->head.load(std::memory_order_acquire) - i >= kSpansPerThread || !name) {
+                continue;
+            }
+            if (async) {
+                // Async spans may overlap, so they get their own track per trace
+                std::snprintf(buf, sizeof(buf),
+                              "{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"b\",\"id\":%llu,\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%.3f}",
+                              name, static_cast<unsigned long long>(trace), buffer->tid, start / 1000.0);
+                emit(buf);
+                std::snprintf(buf, sizeof(buf),
+                              "{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"e\",\"id\":%llu,\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%.3f}",
+                              name, static_cast<unsigned long long>(trace), buffer->tid, end / 1000.0);
+                emit(buf);
+            } else {
+                std::snprintf(buf, sizeof(buf),
+                              "{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"trace\":%llu}}",
+                              name, buffer->tid, start / 1000.0, (end - start) / 1000.0,
+                              static_cast<unsigned long long>(trace));
+                emit(buf);
+            }
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+std::string Tracer::dump_to_dir(const std::string &dir) const {
+    std::string path = (dir.empty() ? std::string(".") : dir) + "/trace-" +
+                       std::to_string(std::time(nullptr)) + ".json";
+    return dump(path) ? path : "";
+}
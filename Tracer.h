@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Sampled per-message tracing. One inbound line in every sample_every starts
+// a trace; each stage it passes through records a span into a fixed-size ring
+// owned by the recording thread. dump() writes the rings as Chrome
+// trace-event JSON (chrome://tracing, Perfetto). Unsampled messages cost one
+// thread-local load per stage.
+class Tracer {
+public:
+    static Tracer& getInstance() {
+        static Tracer instance;
+        return instance;
+    }
+
+    // 0 disables tracing
+    void set_sample_every(int n) { sample_every_.store(n > 0 ? n : 0, std::memory_order_relaxed); }
+    // A new trace id if this message is sampled, otherwise 0
+    uint64_t maybe_start();
+
+    // Trace id of the message being handled on this thread (0 = none)
+    static uint64_t current() { return current_trace_; }
+    static void set_current(uint64_t trace) { current_trace_ = trace; }
+
+    static int64_t now_ns();
+    // async spans cover a hand-off (e.g. queued -> written) and may overlap
+    // other spans on the same thread
+    void record(uint64_t trace, const char *name, int64_t start_ns, int64_t end_ns, bool async = false);
+    // Names the calling thread in dumps
+    void name_thread(const std::string &name);
+
+    bool dump(const std::string &path) const;
+    // Dumps to <dir>/trace-<epoch>.json; returns the path, or "" on failure
+    std::string dump_to_dir(const std::string &dir) const;
+
+private:
+    Tracer() = default;
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    static constexpr size_t kSpansPerThread = 1 << 16;
+
+    // Fields are atomics so dump() can read a ring while its thread writes
+    struct Span {
+        std::atomic<uint64_t> trace{0};
+        std::atomic<const char *> name{nullptr};
+        std::atomic<int64_t> start_ns{0};
+        std::atomic<int64_t> end_ns{0};
+        std::atomic<bool> async{false};
+    };
+    struct ThreadBuffer {
+        uint32_t tid;
+        std::string name;
+        std::atomic<uint64_t> head{0};
+        std::unique_ptr<Span[]> spans{new Span[kSpansPerThread]};
+    };
+    ThreadBuffer &local_buffer();
+
+    static thread_local uint64_t current_trace_;
+    std::atomic<int> sample_every_{0};
+    std::atomic<uint64_t> next_trace_{1};
+    std::atomic<uint64_t> messages_{0};
+
+    mutable std::mutex mtx_;    // guards buffers_ and thread names
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+// Makes trace the current trace for the scope, restoring the previous one
+class TraceContext {
+public:
+    explicit TraceContext(uint64_t trace) : previous_(Tracer::current()) { Tracer::set_current(trace); }
+    ~TraceContext() { Tracer::set_current(previous_); }
+
+    TraceContext(const TraceContext&) = delete;
+    TraceContext& operator=(const TraceContext&) = delete;
+
+private:
+    uint64_t previous_;
+};
+
+// Records the scope as a span of the current trace, if there is one
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name)
+        : trace_(Tracer::current()), name_(name), start_(trace_ ? Tracer::now_ns() : 0) {}
+    ~TraceSpan() {
+        if (trace_) {
+            Tracer::getInstance().record(trace_, name_, start_, Tracer::now_ns());
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    uint64_t trace_;
+    const char *name_;
+    int64_t start_;
+};
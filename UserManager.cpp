@@ -1,48 +1,85 @@
 #include "UserManager.h"
 #include "Logger.h"
-
-UserManager& UserManager::instance() {
-    static UserManager instance;
-    return instance;
-}
+#include "Cluster.h"
 
 void UserManager::add_user(const std::string &username, std::shared_ptr<Session> session) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    users_[username] = session;
-    user_status_[username] = "online";
-    Logger::instance().log(LogLevel::INFO, "User added: " + username);
+    {
+        std::lock_guard<std::mutex> lock(usersMutex);
+        users[username] = session;
+        user_status_[username] = "online";
+    }
+    LOG_INFO("User added: ", username);
+    Cluster::getInstance().user_joined(username);
 }
 
 void UserManager::remove_user(const std::string &username) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    users_.erase(username);
-    user_status_.erase(username);
-    Logger::instance().log(LogLevel::INFO, "User removed: " + username);
+    bool was_local;
+    {
+        std::lock_guard<std::mutex> lock(usersMutex);
+        was_local = users.erase(username) > 0;
+        user_status_.erase(username);
+    }
+    LOG_INFO("User removed: ", username);
+    if (was_local) {
+        Cluster::getInstance().user_left(username);
+    }
 }
 
 std::shared_ptr<Session> UserManager::get_user(const std::string &username) {
-    std::lock_guard<std::mutex> lock(mtx_);
-    auto it = users_.find(username);
-    if (it != users_.end()) {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    auto it = users.find(username);
+    if (it != users.end()) {
         return it->second;
     }
     return nullptr;
 }
 
 void UserManager::update_status(const std::string &username, const std::string &status) {
-    std::lock_guard<std::mutex> lock(mtx_);
+    std::lock_guard<std::mutex> lock(usersMutex);
     auto it = user_status_.find(username);
     if (it != user_status_.end()) {
         it->second = status;
-        Logger::instance().log(LogLevel::INFO, "User " + username + " status updated to " + status);
+        LOG_INFO("User ", username, " status updated to ", status);
     }
 }
 
 std::vector<std::string> UserManager::get_all_users() {
-    std::lock_guard<std::mutex> lock(mtx_);
+    std::lock_guard<std::mutex> lock(usersMutex);
     std::vector<std::string> result;
-    for (auto &pair : users_) {
+    for (auto &pair : users) {
         result.push_back(pair.first);
     }
     return result;
-} 
\ No newline at end of file
+} 
+
+void UserManager::add_remote_user(const std::string &username, const std::string &node) {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    remote_users_[username] = node;
+}
+
+void UserManager::remove_remote_user(const std::string &username, const std::string &node) {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    auto it = remote_users_.find(username);
+    // The user may already have logged in again on another node
+    if (it != remote_users_.end() && it->second == node) {
+        remote_users_.erase(it);
+    }
+}
+
+void UserManager::remove_node(const std::string &node) {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    for (auto it = remote_users_.begin(); it != remote_users_.end();) {
+        it = it->second == node ? remote_users_.erase(it) : std::next(it);
+    }
+}
+
+std::string UserManager::get_user_node(const std::string &username) {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    auto it = remote_users_.find(username);
+    return it != remote_users_.end() ? it->second : "";
+}
+
+std::vector<std::pair<std::string, std::string>> UserManager::get_remote_users() {
+    std::lock_guard<std::mutex> lock(usersMutex);
+    return {remote_users_.begin(), remote_users_.end()};
+}
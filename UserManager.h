@@ -5,6 +5,7 @@
 #include <unordered_map>
 #include <mutex>
 #include <vector>
+#include <utility>
 #include "Session.h"
 
 class UserManager {
@@ -18,8 +19,17 @@ public:
     void remove_user(const std::string& username);
     std::shared_ptr<Session> get_user(const std::string& username);
     void update_status(const std::string& username, const std::string& status);
+    // Users logged in on this node
     std::vector<std::string> get_all_users();
 
+    // Cluster directory: users logged in on other nodes (see Cluster)
+    void add_remote_user(const std::string& username, const std::string& node);
+    void remove_remote_user(const std::string& username, const std::string& node);
+    void remove_node(const std::string& node);
+    // The node holding username, or "" if it is not logged in on another node
+    std::string get_user_node(const std::string& username);
+    std::vector<std::pair<std::string, std::string>> get_remote_users();
+
 private:
     UserManager() = default;
     ~UserManager() = default;
@@ -29,5 +39,6 @@ private:
 
     std::unordered_map<std::string, std::shared_ptr<Session>> users;
     std::unordered_map<std::string, std::string> user_status_;
+    std::unordered_map<std::string, std::string> remote_users_;    // username -> node
     std::mutex usersMutex;
 }; 
\ No newline at end of file
@@ -3,22 +3,33 @@
 #include <vector>
 #include <atomic>
 #include <iostream>
+#include <filesystem>
+#include <cstdlib>
 #include <signal.h>
 
 #include "Server.h"
 #include "Logger.h"
 #include "Config.h"
 #include "Database.h"
+#include "HistoryManager.h"
+#include "Metrics.h"
+#include "MetricsServer.h"
+#include "Tracer.h"
+#include "FlightRecorder.h"
+#include "Cluster.h"
+#ifndef _WIN32
+#include "Supervisor.h"
+#endif
+#include "Handoff.h"
+#include "TlsContext.h"
 
 // We'll store a pointer to the io_context globally
 // so we can stop it gracefully on shutdown.
 boost::asio::io_context* g_io_context_ptr = nullptr;
 
-// Counter for performance monitoring
-std::atomic<int> g_messageCount(0);
-
 std::atomic<bool> running(true);
 
+// Until the io_context runs, signals stop startup outright
 void signalHandler(int signum) {
     running = false;
     if (g_io_context_ptr) {
@@ -26,54 +37,311 @@ void signalHandler(int signum) {
     }
 }
 
-void performance_monitor(boost::asio::io_context &io_context) {
-    using namespace std::chrono_literals;
-    boost::asio::steady_timer timer(io_context, std::chrono::seconds(10));
-    timer.async_wait([&](const boost::system::error_code& ec){
+// Set while serving, for request_shutdown
+Server* g_server_ptr = nullptr;
+
+// Staged shutdown (see Server::drain); called on the io_context for SIGINT,
+// SIGTERM and /shutdown. A second request stops immediately.
+void request_shutdown(const std::string &reason) {
+    static bool draining = false;
+    if (draining || !g_server_ptr) {
+        LOG_WARN("Shutdown requested again (", reason, "), stopping without waiting");
+        signalHandler(0);
+        return;
+    }
+    draining = true;
+    int seconds = Config::getInstance().settings().shutdown_drain_seconds;
+    LOG_INFO("Shutdown requested (", reason, ")");
+    g_server_ptr->drain(std::chrono::seconds(seconds), [] { signalHandler(0); });
+}
+
+// Pushes the live-reloadable settings into the subsystems that cache them
+void apply_settings(const ServerSettings &settings) {
+    Logger::setLogLevel(settings.log_level);
+    Logger::setOverflowPolicy(settings.log_overflow_policy);
+    Logger::setConsoleOutput(settings.log_console);
+    Logger::setRotation(settings.log_max_bytes, settings.log_rotate_interval_seconds, settings.log_max_files);
+    Tracer::getInstance().set_sample_every(settings.trace_sample_every);
+}
+
+// Periodically snapshots the history caches so a crash doesn't mean a cold start
+void history_snapshot_timer(boost::asio::steady_timer &timer, int interval_seconds) {
+    timer.expires_after(std::chrono::seconds(interval_seconds));
+    timer.async_wait([&timer, interval_seconds](const boost::system::error_code& ec) {
         if (!ec) {
-            Logger::instance().log(LogLevel::INFO,
-                "[Performance] Messages processed in last 10 sec: " + std::to_string(g_messageCount.load()));
-            g_messageCount.store(0);
-            performance_monitor(io_context); // reschedule
+            HistoryManager::getInstance().save_snapshot_async();
+            history_snapshot_timer(timer, interval_seconds);
         }
     });
 }
 
-int main() {
+// Workers started by a Supervisor share the config and database but keep
+// their logs, snapshots and dumps in worker<k>/; switch before anything
+// opens a file
+std::string enter_worker_dir(int workerIndex) {
+    namespace fs = std::filesystem;
+    std::string configFile = fs::absolute("server.config").string();
+    Database::set_path(fs::absolute("chat.db").string());
+    fs::path dir = "worker" + std::to_string(workerIndex);
+    fs::create_directories(dir);
+    fs::current_path(dir);
+    return configFile;
+}
+
+int main(int argc, char *argv[]) {
+    bool upgrade = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--upgrade") {
+            upgrade = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--upgrade]" << std::endl;
+            return 2;
+        }
+    }
+#ifndef _WIN32
+    const char *workerEnv = std::getenv("CHAT_WORKER_INDEX");
+    int workerIndex = workerEnv ? std::atoi(workerEnv) : -1;
+#else
+    int workerIndex = -1;   // worker processes need POSIX (see Supervisor)
+#endif
     try {
+        std::string configFile = workerIndex >= 0 ? enter_worker_dir(workerIndex) : "server.config";
+
         // Set up signal handling
         signal(SIGINT, signalHandler);
         signal(SIGTERM, signalHandler);
+        Logger::install_crash_handlers();
 
         // Load configuration
-        Config::getInstance().load("server.config");
-        int port = Config::getInstance().getInt("port", 12345);
-        int maxConnections = Config::getInstance().getInt("max_connections", 100);
-        std::string logLevel = Config::getInstance().getValue("log_level", "INFO");
+        Config::getInstance().load(configFile);
+        const ServerSettings &settings = Config::getInstance().settings();
+        int port = settings.port;
+        int maxConnections = settings.max_connections;
+
+        if (workerIndex < 0 && settings.workers > 1) {
+            apply_settings(settings);
+#ifndef _WIN32
+            int rc = Supervisor(settings.workers).run();
+#else
+            LOG_ERROR("workers > 1 is not supported on this platform; set workers=1");
+            int rc = 1;
+#endif
+            Logger::shutdown();
+            return rc;
+        }
+
+        // Set up logging and tracing, and re-apply them on every reload
+        apply_settings(settings);
+        Config::getInstance().on_reload(apply_settings);
+
+        Tracer::getInstance().name_thread("main");
+        FlightRecorder::getInstance().name_thread("main");
+        FlightRecorder::record(FlightEvent::Start, 0, static_cast<uint64_t>(port));
+
+#ifndef _WIN32
+        // Take over from the running server before reading the files it is
+        // still writing
+        bool handoffEnabled = workerIndex < 0 && !settings.upgrade_socket.empty();
+        HandoffState handoff;
+        int predecessor;
+        if (upgrade && handoffEnabled) {
+            if (Handoff::receive(settings.upgrade_socket, handoff, predecessor)) {
+                LOG_INFO("Took over ", handoff.sessions.size(), " sessions, waiting for the previous process to exit");
+                Handoff::wait_for_predecessor(predecessor, std::chrono::seconds(30));
+            } else {
+                LOG_WARN("No server to take over on ", settings.upgrade_socket, ", starting normally");
+            }
+        } else if (upgrade) {
+            LOG_WARN("--upgrade needs upgrade_socket and a single process, starting normally");
+        }
+#else
+        // Handoff passes descriptors over a Unix socket (SCM_RIGHTS)
+        if (upgrade) {
+            LOG_WARN("--upgrade is not supported on this platform, starting normally");
+        }
+#endif
 
-        // Set up logging
-        Logger::setLogLevel(logLevel);
+        // Warm the history caches from the last snapshot (or the DB)
+        HistoryManager::getInstance().warm_start();
 
         // Create and start server
         boost::asio::io_context io_context;
         g_io_context_ptr = &io_context;
-        
-        Server server(io_context, port, maxConnections);
-        server.start();
 
-        // Run the io_context
-        while (running) {
+        // Declared first, as sessions use it until the server is gone
+        std::unique_ptr<TlsContext> tls;
+        std::unique_ptr<Server> server;
+#ifndef _WIN32
+        if (handoff.listen_fd >= 0) {
+            server = std::make_unique<Server>(io_context,
+                boost::asio::ip::tcp::acceptor(io_context, boost::asio::ip::tcp::v4(), handoff.listen_fd),
+                maxConnections);
+        } else
+#endif
+        {
+            server = std::make_unique<Server>(io_context, port, maxConnections, workerIndex >= 0);
+        }
+        if (settings.tls_port > 0) {
+            // Relative to the config file, as workers run in worker<k>/
+            auto resolve = [&configFile](const std::string &file) {
+                return (std::filesystem::path(configFile).parent_path() / file).string();
+            };
+            tls = TlsContext::create(resolve(settings.tls_cert_file), resolve(settings.tls_key_file));
+            if (!tls) {
+                Logger::shutdown();
+                return 1;
+            }
+            server->listen_tls(static_cast<short>(settings.tls_port), *tls, workerIndex >= 0);
+        }
+        server->start();
+        g_server_ptr = server.get();
+#ifndef _WIN32
+        if (workerIndex >= 0) {
+            if (!settings.node_id.empty()) {
+                LOG_WARN("node_id is ignored in worker processes; federation is disabled");
+            }
+            auto bus = ShmBus::attach_from_environment();
+            if (!bus) {
+                LOG_ERROR("Worker ", workerIndex, " cannot attach to the supervisor's bus");
+                Logger::shutdown();
+                return 1;
+            }
+            if (tls && !tls->set_ticket_keys(bus->ticket_keys())) {
+                LOG_WARN("Cannot install the shared TLS ticket keys; sessions resume only on this worker");
+            }
+            Cluster::getInstance().start_worker(io_context, std::move(bus), workerIndex);
+        } else
+#endif
+        {
+            Cluster::getInstance().start(io_context, settings);
+        }
+#ifndef _WIN32
+        for (auto &session : handoff.sessions) {
+            server->resume_session(session);
+        }
+
+        // Hand everything to a successor started with --upgrade
+        std::unique_ptr<Handoff> upgrades;
+        if (handoffEnabled) {
+            upgrades = std::make_unique<Handoff>(io_context, settings.upgrade_socket, *server, [&io_context] {
+                running = false;
+                io_context.stop();
+            });
+        }
+#endif
+        // Peer sockets must close before io_context is destroyed, even when
+        // unwinding from an exception
+        struct ClusterStopper {
+            ~ClusterStopper() { Cluster::getInstance().stop(); }
+        } clusterStopper;
+
+        Metrics::getInstance().gauge_callback("chat_log_queue_depth", "Log records waiting for the writer",
+            []{ return static_cast<int64_t>(Logger::queue_depth()); });
+        Session::register_metrics();
+        Message::register_metrics();
+
+        // SIGINT and SIGTERM drain connections before stopping
+        boost::asio::signal_set stopSignal(io_context, SIGINT, SIGTERM);
+        std::function<void()> waitStopSignal = [&] {
+            stopSignal.async_wait([&](const boost::system::error_code& ec, int signum) {
+                if (ec) return;
+                request_shutdown(signum == SIGINT ? "SIGINT" : "SIGTERM");
+                waitStopSignal();
+            });
+        };
+        waitStopSignal();
+
+#ifdef SIGUSR2
+        // SIGUSR2 dumps sampled message traces (/trace does too)
+        boost::asio::signal_set traceSignal(io_context, SIGUSR2);
+        std::function<void()> waitTraceSignal = [&] {
+            traceSignal.async_wait([&](const boost::system::error_code& ec, int) {
+                if (ec) return;
+                std::string path = Tracer::getInstance().dump_to_dir(
+                    Config::getInstance().settings().trace_dump_dir);
+                LOG_INFO("Trace dump written to ", path.empty() ? "(failed)" : path);
+                waitTraceSignal();
+            });
+        };
+        waitTraceSignal();
+#endif
+
+#ifdef SIGUSR1
+        // SIGUSR1 dumps the flight recorder (/flight does too)
+        boost::asio::signal_set flightSignal(io_context, SIGUSR1);
+        std::function<void()> waitFlightSignal = [&] {
+            flightSignal.async_wait([&](const boost::system::error_code& ec, int) {
+                if (ec) return;
+                FlightRecorder::record(FlightEvent::Dump);
+                std::string path = FlightRecorder::getInstance().dump_to_dir(
+                    Config::getInstance().settings().flight_dump_dir);
+                LOG_INFO("Flight recorder dump written to ", path.empty() ? "(failed)" : path);
+                waitFlightSignal();
+            });
+        };
+        waitFlightSignal();
+#endif
+
+#ifdef SIGHUP
+        // SIGHUP reloads server.config (/reload does too)
+        boost::asio::signal_set reloadSignal(io_context, SIGHUP);
+        std::function<void()> waitReloadSignal = [&] {
+            reloadSignal.async_wait([&](const boost::system::error_code& ec, int) {
+                if (ec) return;
+                std::vector<std::string> errors;
+                Config::getInstance().reload(errors);
+                waitReloadSignal();
+            });
+        };
+        waitReloadSignal();
+#endif
+
+        std::unique_ptr<MetricsServer> metricsServer;
+        if (settings.metrics_port > 0) {
+            // Each worker has its own registry, so its own port
+            int metricsPort = settings.metrics_port + std::max(workerIndex, 0);
+            metricsServer = std::make_unique<MetricsServer>(
+                settings.metrics_bind_address, static_cast<unsigned short>(metricsPort));
+            metricsServer->start();
+        }
+
+        boost::asio::steady_timer snapshot_timer(io_context);
+        int snapshotInterval = settings.history_snapshot_interval_seconds;
+        if (snapshotInterval > 0) {
+            history_snapshot_timer(snapshot_timer, snapshotInterval);
+        }
+
+        // Run the io_context; /shutdown stops it directly
+        while (running && !io_context.stopped()) {
             io_context.run_one();
         }
 
         // Clean shutdown
-        server.stop();
-        Logger::log("Server shutdown complete", LogLevel::INFO);
+        g_server_ptr = nullptr;
+        server->stop();
+        Cluster::getInstance().stop();
+        if (metricsServer) {
+            metricsServer->stop();
+        }
+        HistoryManager::getInstance().save_snapshot();
+        Database::getInstance().stop_aggregator();
+#ifndef _WIN32
+        if (upgrades) {
+            // Our ports are free and the snapshot is saved; the successor may go on
+            upgrades->finish();
+        }
+#endif
+        LOG_INFO("Server shutdown complete");
 
     } catch (std::exception& e) {
-        Logger::log("Exception: " + std::string(e.what()), LogLevel::ERROR);
+        LOG_ERROR("Exception: ", e.what());
+        // Keep the events leading up to the failure
+        FlightRecorder::record(FlightEvent::Error, 0, 0, e.what());
+        FlightRecorder::getInstance().dump_to_dir(Config::getInstance().settings().flight_dump_dir);
+        Logger::shutdown();
         return 1;
     }
 
+    Logger::shutdown();
     return 0;
 } 
\ No newline at end of file